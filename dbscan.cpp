@@ -1,15 +1,312 @@
 #include <stdio.h>
 #include <climits>
 #include <cfloat>
+#include <algorithm>
+#include <functional>
+#include <thread>
 
 #include "dbscan.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DBSCAN_X86_SIMD     1                               // 运行时根据cpu选择 sse2/avx2 的实现
+#include <immintrin.h>
+#endif
+
 
 ALGO_NAMESPACE_BEGIN();
 
 
-int DBSCAN::run()
+// 多线程时 每次领取这么多个点
+#define DBSCAN_PARALLEL_BLOCK   256
+
+
+/**
+ * 把 [0, n) 分块, threadNum 个线程 抢着处理, 每块调用一次 fn( begin, end, worker )
+ *      worker 是线程的序号 [0, threadNum), 用来写各自的缓冲区
+ *      block  每次领取的个数
+ *      threadNum 为 1 时 直接在当前线程里做
+ */
+static void parallelFor( int threadNum, int n, const std::function<void( int, int, int )> & fn,
+                         int block = DBSCAN_PARALLEL_BLOCK )
+{
+    if ( threadNum <= 1 || n <= block )
+    {
+        if ( n > 0 )    fn( 0, n, 0 );
+        return;
+    }
+
+    int next = 0;
+
+    auto worker = [ & ]( int id ) {
+        for ( ;; )
+        {
+            int begin = __atomic_fetch_add( &next, block, __ATOMIC_RELAXED );
+            if ( begin >= n )   break;
+
+            fn( begin, std::min( begin + block, n ), id );
+        }
+    };
+
+    vector<std::thread> threads;
+    for ( int i = 1; i < threadNum; i++ )
+        threads.emplace_back( worker, i );
+
+    worker( 0 );
+
+    for ( std::thread & t : threads )
+        t.join();
+}
+
+
+// 并查集的 查找, 顺带做路径减半; 根总是集合里最小的id
+static int unionFind( int * parent, int x )
+{
+    for ( ;; )
+    {
+        int p = __atomic_load_n( &parent[ x ], __ATOMIC_RELAXED );
+        if ( p == x )   return x;
+
+        int gp = __atomic_load_n( &parent[ p ], __ATOMIC_RELAXED );
+        if ( gp != p )
+            __atomic_compare_exchange_n( &parent[ x ], &p, gp, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED );
+
+        x = gp;
+    }
+}
+
+
+// 并查集的 合并, 把大的根 挂到小的根下面, 用 CAS 保证并发时不丢
+static void unionJoin( int * parent, int a, int b )
+{
+    for ( ;; )
+    {
+        a = unionFind( parent, a );
+        b = unionFind( parent, b );
+
+        if ( a == b )   return;
+        if ( a > b )    std::swap( a, b );
+
+        int expected = b;
+        if ( __atomic_compare_exchange_n( &parent[ b ], &expected, a, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+            return;
+    }
+}
+
+
+/**
+ * 找邻居的核心函数: 第 j 个点 ( xs[j], ys[j] ) 和 ( x, y ) 的距离平方 <= eps2 时, 把 ids[j] 写到 out
+ *      返回写出的个数; out 至少要有 n + DBSCAN_RANGE_SLACK 个位置, 整块写出时 会写过结尾
+ *      距离平方 按 float 的 dx * dx + dy * dy 计算, 各个版本的结果一样, 两个点交换后 结果也一样
+ *      坐标是 NaN 的 永远不满足
+ *
+ * 有 scalar / sse2 / avx2 三个版本，第一次使用时根据cpu选择
+ */
+typedef int (*RangeKernel)( float x, float y, const float * xs, const float * ys, const int * ids, int n, float eps2, int * out );
+
+#define DBSCAN_RANGE_SLACK      8
+
+
+static int rangeKernelScalar( float x, float y, const float * xs, const float * ys, const int * ids, int n, float eps2, int * out )
+{
+    int k = 0;
+
+    for ( int j = 0; j < n; j++ )
+    {
+        float dx = x - xs[ j ];
+        float dy = y - ys[ j ];
+
+        out[ k ] = ids[ j ];                                // 无分支, 先写再决定 要不要往后移
+        k += ( dx * dx + dy * dy <= eps2 );
+    }
+
+    return k;
+}
+
+
+#ifdef DBSCAN_X86_SIMD
+
+__attribute__((target("sse2"))) static int
+rangeKernelSse2( float x, float y, const float * xs, const float * ys, const int * ids, int n, float eps2, int * out )
+{
+    __m128 vx = _mm_set1_ps( x );
+    __m128 vy = _mm_set1_ps( y );
+    __m128 ve = _mm_set1_ps( eps2 );
+    int    k  = 0;
+    int    j  = 0;
+
+    for ( ; j + 4 <= n; j += 4 )
+    {
+        __m128 dx = _mm_sub_ps( vx, _mm_loadu_ps( xs + j ) );
+        __m128 dy = _mm_sub_ps( vy, _mm_loadu_ps( ys + j ) );
+        __m128 d2 = _mm_add_ps( _mm_mul_ps( dx, dx ), _mm_mul_ps( dy, dy ) );
+        int    m  = _mm_movemask_ps( _mm_cmple_ps( d2, ve ) );
+
+        // sse2 没有按掩码压缩的指令, 4 个逐个无分支的写
+        out[ k ] = ids[ j ];        k += m & 1;
+        out[ k ] = ids[ j + 1 ];    k += ( m >> 1 ) & 1;
+        out[ k ] = ids[ j + 2 ];    k += ( m >> 2 ) & 1;
+        out[ k ] = ids[ j + 3 ];    k += ( m >> 3 ) & 1;
+    }
+
+    return k + rangeKernelScalar( x, y, xs + j, ys + j, ids + j, n - j, eps2, out + k );
+}
+
+
+// avx2 的压缩写: 掩码 -> 把选中的通道 挪到前面的排列, 第一次选择实现时填好
+static int32_t s_compressTable[ 256 ][ 8 ] __attribute__((aligned(32)));
+
+
+__attribute__((target("avx2"))) static int
+rangeKernelAvx2( float x, float y, const float * xs, const float * ys, const int * ids, int n, float eps2, int * out )
+{
+    __m256 vx = _mm256_set1_ps( x );
+    __m256 vy = _mm256_set1_ps( y );
+    __m256 ve = _mm256_set1_ps( eps2 );
+    int    k  = 0;
+    int    j  = 0;
+
+    for ( ; j + 8 <= n; j += 8 )
+    {
+        __m256 dx = _mm256_sub_ps( vx, _mm256_loadu_ps( xs + j ) );
+        __m256 dy = _mm256_sub_ps( vy, _mm256_loadu_ps( ys + j ) );
+        __m256 d2 = _mm256_add_ps( _mm256_mul_ps( dx, dx ), _mm256_mul_ps( dy, dy ) );
+        int    m  = _mm256_movemask_ps( _mm256_cmp_ps( d2, ve, _CMP_LE_OQ ) );
+
+        if ( 0 == m )   continue;                           // 大部分候选点 都不在半径内
+
+        __m256i perm = _mm256_load_si256( (const __m256i *)s_compressTable[ m ] );
+        __m256i vid  = _mm256_loadu_si256( (const __m256i *)( ids + j ) );
+
+        _mm256_storeu_si256( (__m256i *)( out + k ), _mm256_permutevar8x32_epi32( vid, perm ) );
+        k += __builtin_popcount( m );
+    }
+
+    return k + rangeKernelSse2( x, y, xs + j, ys + j, ids + j, n - j, eps2, out + k );
+}
+
+#endif  // DBSCAN_X86_SIMD
+
+
+static RangeKernel selectRangeKernel()
+{
+#ifdef DBSCAN_X86_SIMD
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports( "avx2" ) )
+    {
+        for ( int m = 0; m < 256; m++ )
+        {
+            int k = 0;
+            for ( int lane = 0; lane < 8; lane++ )
+                if ( m & ( 1 << lane ) )    s_compressTable[ m ][ k++ ] = lane;
+            for ( ; k < 8; k++ )
+                s_compressTable[ m ][ k ] = 0;
+        }
+
+        return rangeKernelAvx2;
+    }
+
+    if ( __builtin_cpu_supports( "sse2" ) )
+        return rangeKernelSse2;
+#endif
+
+    return rangeKernelScalar;
+}
+
+
+// 第一次调用时按cpu能力选择, 静态变量的初始化 多线程是安全的
+static RangeKernel rangeKernel()
+{
+    static const RangeKernel kernel = selectRangeKernel();
+
+    return kernel;
+}
+
+
+// 原子的取小, label 只会变小
+static void atomicMin( int * label, int value )
+{
+    int old = __atomic_load_n( label, __ATOMIC_RELAXED );
+
+    while ( value < old )
+    {
+        if ( __atomic_compare_exchange_n( label, &old, value, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+            break;
+    }
+}
+
+
+
+DBSCAN::DBSCAN( int minPts, float eps, vector<Point> & points )
+{
+    m_minPts    = minPts;
+    m_epsilon   = eps;
+    m_points    = points;
+    m_ownPoints = true;
+    m_stride    = sizeof( Point );
+    bindPoints();
+
+    m_clusterIDs = NULL;
+    m_types      = NULL;
+    m_useGrid    = false;
+    m_cellSize   = 0;
+    m_originX    = 0;
+    m_originY    = 0;
+    m_cellRows   = 0;
+    m_cellCols   = 0;
+    m_eps2       = 0;
+}
+
+
+
+DBSCAN::DBSCAN( int minPts, float eps, const float * x, const float * y, int pointSize, int stride )
+{
+    m_minPts    = minPts;
+    m_epsilon   = eps;
+    m_pointSize = pointSize;
+    m_ownPoints = false;
+
+    m_x         = (const char *)x;
+    m_y         = (const char *)y;
+    m_stride    = stride;
+
+    m_clusterIDs = NULL;
+    m_types      = NULL;
+    m_useGrid    = false;
+    m_cellSize   = 0;
+    m_originX    = 0;
+    m_originY    = 0;
+    m_cellRows   = 0;
+    m_cellCols   = 0;
+    m_eps2       = 0;
+}
+
+
+
+int DBSCAN::run( int threadNum )
+{
+    return run( NULL, NULL, threadNum );
+}
+
+
+
+void DBSCAN::bindPoints()
 {
+    m_pointSize = m_points.size();
+    m_x         = (const char *)( m_points.empty() ? NULL : &m_points[ 0 ].x );
+    m_y         = (const char *)( m_points.empty() ? NULL : &m_points[ 0 ].y );
+}
+
+
+
+int DBSCAN::run( int * clusterIDs, PointType * types, int threadNum )
+{
+    // getPoints() 可能改过 m_points, 地址和数量 都要重新取
+    if ( m_ownPoints )
+        bindPoints();
+
+    int n = m_pointSize;
+
     // 先统一编个号，给个自增id，目前这个id和他在vector中的index是一样的
     int index = 0;
     for ( Point & point : m_points )
@@ -18,146 +315,1277 @@ int DBSCAN::run()
         index++;
     }
 
-    // 先准备足够的空间
-    m_pointRanges.reserve( m_points.size() );
+    // 调用方没给数组的 写到内部
+    if ( NULL == clusterIDs )
+    {
+        m_ownClusterIDs.resize( n );
+        clusterIDs = m_ownClusterIDs.data();
+    }
+    if ( NULL == types )
+    {
+        m_ownTypes.resize( n );
+        types = m_ownTypes.data();
+    }
+
+    m_clusterIDs = clusterIDs;
+    m_types      = types;
 
-    // 循环给每个点建立 他的range
-    for ( Point & point : m_points )
+    for ( int i = 0; i < n; i++ )
+    {
+        m_clusterIDs[ i ] = 0;
+        m_types[ i ]      = PointType::UNCLASSIFIED;
+    }
+
+    if ( threadNum <= 0 )
+        threadNum = std::max( 1, (int)std::thread::hardware_concurrency() );
+
+    // 按格子分桶, 后面找邻居 只看周围的格子
+    buildGrid();
+
+    // 循环给每个点建立 他的range, 并处理好每个点的类型
+    buildRanges( threadNum );
+
+    if ( threadNum > 1 )
+    {
+        clusterParallel( threadNum );
+    }
+    else
     {
-        vector<int> range = buildAllRange( point );
+        // 切分成多个 簇
+        int clusterID = 1;
 
-        int num = range.size();
-        if ( num <= 0 )        point.type = PointType::NOISE;
-        if ( num >= m_minPts ) point.type = PointType::CORE_POINT;
+        for ( int i = 0; i < n; i++ )
+        {
+            if ( m_types[ i ] != PointType::CORE_POINT )
+                continue;
 
-        // 默认都是 UNCLASSIFIED,  下标的位置要严格对应在 point.id
-        // m_pointRanges[ point.id ] = range;
-        // m_pointRanges.assign( point.id, range );
-        m_pointRanges.push_back( range );
+            if ( expandCluster( i, clusterID ) >= 0 )
+            {
+                clusterID += 1;
+            }
+        }
     }
 
-    // 处理好每个点的类型
+    // 用 vector<Point> 构造的 结果写回去
     for ( Point & point : m_points )
     {
-        if ( point.type != PointType::UNCLASSIFIED )
-            continue;
+        point.clusterID = m_clusterIDs[ point.id ];
+        point.type      = m_types[ point.id ];
+    }
+
+    return 0;
+}
+
+
+
+int DBSCAN::getNeighbors( int id, const int ** ids )
+{
+    if ( id < 0 || id >= m_pointSize || m_rangeStart.size() != (size_t)m_pointSize + 1 )
+    {
+        *ids = NULL;
+        return 0;
+    }
+
+    *ids = rangeBegin( id );
+    return rangeSize( id );
+}
+
+
+
+/**
+ * 每 DBSCAN_PARALLEL_BLOCK 个点 一块, 各块的邻居 先写到自己的缓冲区,
+ * 算完后 按块的顺序 拷贝到一个连续的数组里, 分配的次数 只和块数有关
+ */
+void DBSCAN::buildRanges( int threadNum )
+{
+    int n      = m_pointSize;
+    int blocks = ( n + DBSCAN_PARALLEL_BLOCK - 1 ) / DBSCAN_PARALLEL_BLOCK;
+
+    vector< vector<int> > blockIds( blocks );
+
+    m_rangeStart.assign( n + 1, 0 );
+    m_rangeIds.clear();
+
+    // 按块号领取, 第 b 块是 [ b * DBSCAN_PARALLEL_BLOCK, (b + 1) * DBSCAN_PARALLEL_BLOCK ) 的点
+    parallelFor( threadNum, blocks, [ & ]( int begin, int end, int ) {
+        for ( int b = begin; b < end; b++ )
+        {
+            vector<int> & ids  = blockIds[ b ];
+            int           last = std::min( n, ( b + 1 ) * DBSCAN_PARALLEL_BLOCK );
+
+            for ( int i = b * DBSCAN_PARALLEL_BLOCK; i < last; i++ )
+            {
+                size_t before = ids.size();
+
+                buildAllRange( i, ids );
+
+                int num = ids.size() - before;
+                if ( num <= 0 )        m_types[ i ] = PointType::NOISE;
+                if ( num >= m_minPts ) m_types[ i ] = PointType::CORE_POINT;
 
-        vector<int> & range = m_pointRanges.at( point.id );
+                m_rangeStart[ i + 1 ] = num;
+            }
+        }
+    }, 1 );
+
+    for ( int i = 0; i < n; i++ )
+        m_rangeStart[ i + 1 ] += m_rangeStart[ i ];
+
+    m_rangeIds.resize( m_rangeStart[ n ] );
+
+    parallelFor( threadNum, blocks, [ & ]( int begin, int end, int ) {
+        for ( int b = begin; b < end; b++ )
+        {
+            std::copy( blockIds[ b ].begin(), blockIds[ b ].end(), m_rangeIds.begin() + m_rangeStart[ b * DBSCAN_PARALLEL_BLOCK ] );
+            vector<int>().swap( blockIds[ b ] );
+        }
+    }, 1 );
 
-        // 在 1  m_minPts 之间的 都还是 UNCLASSIFIED
-        if ( 1 == range.size() )
+    // 只有1个邻居的点: 邻居是噪声(邻居关系对称, 不会出现) 还是 UNCLASSIFIED, 其他都是边界点
+    // 逐个处理时 邻居可能已经从 UNCLASSIFIED 变成了 BORDER_POINT, 两者结果一样, 所以这里只看邻居的第一轮类型
+    vector<char> border( n, 0 );
+
+    parallelFor( threadNum, n, [ & ]( int begin, int end, int ) {
+        for ( int i = begin; i < end; i++ )
         {
-            Point & to_point = m_points.at( range.at( 0 ) );
+            if ( m_types[ i ] != PointType::UNCLASSIFIED || 1 != rangeSize( i ) )
+                continue;
+
+            border[ i ] = ( m_types[ *rangeBegin( i ) ] != PointType::NOISE );
+        }
+    } );
+
+    for ( int i = 0; i < n; i++ )
+        if ( border[ i ] )  m_types[ i ] = PointType::BORDER_POINT;
+}
+
+
+
+// 格子最多这么多行/列, 再多 double 算格子编号的误差 就可能让邻居跨过 2 个格子
+#define DBSCAN_GRID_MAX_DIM     ( 1 << 30 )
+
+// 格子的边长 比 eps 放大一点, 抵消 float 相减 和 除法的舍入误差
+#define DBSCAN_GRID_MARGIN      1e-5
 
-            if ( to_point.type == PointType::CORE_POINT )   point.type = PointType::BORDER_POINT;
-            if ( to_point.type == PointType::NOISE )        point.type = PointType::UNCLASSIFIED;   // 这是不可能出现的
-            if ( to_point.type == PointType::BORDER_POINT ) point.type = PointType::BORDER_POINT;
-            if ( to_point.type == PointType::UNCLASSIFIED ) point.type = PointType::BORDER_POINT;             
+
+void DBSCAN::buildGrid()
+{
+    int n = m_pointSize;
+
+    m_useGrid = false;
+    m_pointCells.clear();
+    m_cellKeys.clear();
+    m_cellStart.clear();
+    m_cellPoints.clear();
+    m_cellTable.clear();
+    m_sortX.clear();
+    m_sortY.clear();
+
+    m_eps2 = ( m_epsilon >= 0 ) ? (float)m_epsilon * (float)m_epsilon : -1.0f;
+
+    // 不能用格子时 按id顺序 整个扫一遍
+    auto useAll = [ & ]() {
+        m_cellPoints.resize( n );
+        m_sortX.resize( n );
+        m_sortY.resize( n );
+
+        for ( int i = 0; i < n; i++ )
+        {
+            m_cellPoints[ i ] = i;
+            m_sortX[ i ]      = pointX( i );
+            m_sortY[ i ]      = pointY( i );
         }
+    };
+
+    if ( !( m_epsilon > 0 ) || !std::isfinite( m_epsilon ) )
+    {
+        useAll();
+        return;
     }
 
-    // 切分成多个 簇 
-    int clusterID = 1;
+    // 坐标不是有限值的点 和谁的距离都不会 <= eps, 不放进格子
+    double minX =  DBL_MAX, minY =  DBL_MAX;
+    double maxX = -DBL_MAX, maxY = -DBL_MAX;
 
-    for ( Point & point : m_points )
+    for ( int i = 0; i < n; i++ )
     {
-        if ( point.type != PointType::CORE_POINT )
+        float x = pointX( i );
+        float y = pointY( i );
+
+        if ( !std::isfinite( x ) || !std::isfinite( y ) )
             continue;
 
-        if ( expandCluster( point, clusterID ) >= 0 )
+        minX = std::min( minX, (double)x );
+        minY = std::min( minY, (double)y );
+        maxX = std::max( maxX, (double)x );
+        maxY = std::max( maxY, (double)y );
+    }
+
+    m_cellSize = m_epsilon * ( 1 + DBSCAN_GRID_MARGIN );
+    m_originX  = minX;
+    m_originY  = minY;
+
+    if ( minX <= maxX )
+    {
+        double cols = floor( ( maxX - minX ) / m_cellSize ) + 1;
+        double rows = floor( ( maxY - minY ) / m_cellSize ) + 1;
+
+        if ( cols > DBSCAN_GRID_MAX_DIM || rows > DBSCAN_GRID_MAX_DIM )
         {
-            clusterID += 1;
+            useAll();
+            return;
         }
+
+        m_cellCols = (int64_t)cols;
+        m_cellRows = (int64_t)rows;
     }
 
-    return 0;
-}
+    // 按 (格子编号, 点id) 排序, 同一个格子里的点 保持id的顺序
+    vector<int> order;
+    order.reserve( n );
+    m_pointCells.resize( n );
+
+    for ( int i = 0; i < n; i++ )
+    {
+        m_pointCells[ i ] = cellOf( pointX( i ), pointY( i ) );
 
+        if ( m_pointCells[ i ] >= 0 )
+            order.push_back( i );
+    }
 
+    std::sort( order.begin(), order.end(), [ this ]( int a, int b ) {
+        if ( m_pointCells[ a ] != m_pointCells[ b ] )
+            return m_pointCells[ a ] < m_pointCells[ b ];
+        return a < b;
+    } );
 
-vector<int>  DBSCAN::buildAllRange(Point & point)
-{
-    vector<int> range;
+    m_cellPoints = order;
+    m_sortX.resize( order.size() );
+    m_sortY.resize( order.size() );
 
-    // 一定是从前往后加的，所有里面的id是有序的，但不是严格递增的
-    for ( Point & to_point : m_points )
+    for ( size_t i = 0; i < order.size(); i++ )
     {
-        if ( point.id == to_point.id )  continue;       // 同一个点，就不要放进去了
+        int64_t key = m_pointCells[ order[ i ] ];
+
+        m_sortX[ i ] = pointX( order[ i ] );
+        m_sortY[ i ] = pointY( order[ i ] );
 
-        if ( calculateDistance( point, to_point, m_epsilon ) <= m_epsilon )
+        if ( m_cellKeys.empty() || m_cellKeys.back() != key )
         {
-            range.push_back( to_point.id );
+            m_cellKeys.push_back( key );
+            m_cellStart.push_back( (int)i );
         }
     }
+    m_cellStart.push_back( (int)order.size() );
 
-    return range;
+    // hash表的大小 是格子数的 2 倍以上, 线性探测
+    size_t tableSize = 16;
+    while ( tableSize < m_cellKeys.size() * 2 )
+        tableSize <<= 1;
+
+    m_cellTable.assign( tableSize, -1 );
+
+    for ( size_t i = 0; i < m_cellKeys.size(); i++ )
+    {
+        size_t slot = ( (uint64_t)m_cellKeys[ i ] * 0x9E3779B97F4A7C15ULL ) >> 20;
+
+        while ( m_cellTable[ slot & ( tableSize - 1 ) ] >= 0 )
+            slot++;
+
+        m_cellTable[ slot & ( tableSize - 1 ) ] = (int)i;
+    }
+
+    m_useGrid = true;
 }
 
 
 
-// 从核心点出发，进行传染的探索，给 相关点都标上同一个clusterID
-int DBSCAN::expandCluster( Point & point, int clusterID )
-{    
-    if ( point.type != PointType::CORE_POINT )
-        return -1;
-    
-    if ( point.clusterID > 0 )
+int64_t DBSCAN::cellOf( float x, float y ) const
+{
+    if ( !std::isfinite( x ) || !std::isfinite( y ) )
         return -1;
 
-    point.clusterID = clusterID;
+    int64_t cx = (int64_t)floor( ( x - m_originX ) / m_cellSize );
+    int64_t cy = (int64_t)floor( ( y - m_originY ) / m_cellSize );
 
-    // 注意，这里的数组 是复制出来的，因为需要改.   直接密度可达点数组
-    vector<int> clusterSeeds = m_pointRanges.at( point.id );
+    // 舍入误差 不会让最大的点 超出范围, 这里只是保险
+    cx = std::min( std::max( cx, (int64_t)0 ), m_cellCols - 1 );
+    cy = std::min( std::max( cy, (int64_t)0 ), m_cellRows - 1 );
 
-    // 开始循环，进行 直接密度可达的传导，找密度可达
-    for ( size_t i = 0; i < clusterSeeds.size(); i++ )
+    return cx * m_cellRows + cy;
+}
+
+
+
+int DBSCAN::findCell( int64_t key ) const
+{
+    size_t mask = m_cellTable.size() - 1;
+    size_t slot = ( (uint64_t)key * 0x9E3779B97F4A7C15ULL ) >> 20;
+
+    for ( ;; slot++ )
     {
-        // 直接密度可达点
-        Point & seed_point = m_points.at( clusterSeeds[i] );
+        int cell = m_cellTable[ slot & mask ];
 
-        if ( 0 == seed_point.clusterID ) 
-            seed_point.clusterID = clusterID;
+        if ( cell < 0 )                     return -1;
+        if ( m_cellKeys[ cell ] == key )    return cell;
+    }
+}
 
-        // 下一级的关联点.  密度可达点数组
-        vector<int> & clusterNeighors = m_pointRanges.at( seed_point.id );
 
-        for ( int pointId_neighor : clusterNeighors )
-        {
-            // 密度可达点
-            Point & neighor_point = m_points.at( pointId_neighor );
 
-            if ( 0 != neighor_point.clusterID )  
+/**
+ * 多线程的聚类, 结果和单线程的 expandCluster 一样:
+ *
+ *  1. 邻居 和 核心点/噪声 各个点独立, buildRanges 里已经并行算好
+ *  2. 互为邻居的 核心点 用并发的并查集合并成连通块, 根是块里最小的id (邻居关系是对称的)
+ *  3. 单线程的簇 从编号最小的 未标记的核心点开始, 它的邻居(包括非核心点)的邻居 都会被传导,
+ *     这会把后面的连通块 并进来, 按根从小到大 顺序处理一遍连通块, 只看起点附近两层, 很快
+ *  4. 非核心点 取第一个传导到它的簇, 也就是 能传导到它的簇里 编号最小的, 并行的原子取小
+ */
+void DBSCAN::clusterParallel( int threadNum )
+{
+    int n = m_pointSize;
+
+    // 互为邻居的核心点 合并
+    vector<int> parent( n );
+    for ( int i = 0; i < n; i++ )
+        parent[ i ] = i;
+
+    parallelFor( threadNum, n, [ & ]( int begin, int end, int ) {
+        for ( int i = begin; i < end; i++ )
+        {
+            if ( m_types[ i ] != PointType::CORE_POINT )
                 continue;
 
-            neighor_point.clusterID = clusterID;
+            for ( const int * nb = rangeBegin( i ); nb != rangeEnd( i ); nb++ )
+            {
+                if ( i < *nb && m_types[ *nb ] == PointType::CORE_POINT )
+                    unionJoin( parent.data(), i, *nb );
+            }
+        }
+    } );
 
-            // 只有core点 才能进行下一级的探索
-            if ( neighor_point.type == PointType::CORE_POINT )
-                clusterSeeds.push_back( neighor_point.id );
+    vector<int> root( n, -1 );
+
+    parallelFor( threadNum, n, [ & ]( int begin, int end, int ) {
+        for ( int i = begin; i < end; i++ )
+            if ( m_types[ i ] == PointType::CORE_POINT )
+                root[ i ] = unionFind( parent.data(), i );
+    } );
+
+    // 连通块的根 -> 簇id, 借用 parent 的空间
+    vector<int> & compCluster = parent;
+    std::fill( compCluster.begin(), compCluster.end(), 0 );
+
+    vector<int> starts;                     // 每个簇 开始传导的核心点, 下标是 簇id - 1
+    int         clusterID = 1;
+
+    for ( int i = 0; i < n; i++ )
+    {
+        if ( root[ i ] != i || compCluster[ i ] > 0 )
+            continue;
+
+        auto absorb = [ & ]( int point ) {
+            if ( m_types[ point ] != PointType::CORE_POINT )    return;
+
+            int r = root[ point ];
+            if ( compCluster[ r ] == 0 )
+                compCluster[ r ] = clusterID;
+        };
+
+        absorb( i );
+
+        // 起点的所有邻居 都会继续传导一层
+        for ( const int * seed = rangeBegin( i ); seed != rangeEnd( i ); seed++ )
+        {
+            absorb( *seed );
+
+            for ( const int * nb = rangeBegin( *seed ); nb != rangeEnd( *seed ); nb++ )
+                absorb( *nb );
         }
+
+        starts.push_back( i );
+        clusterID += 1;
     }
 
-    return 0;
+    // 核心点 直接取连通块的簇; 非核心点 取传导到它的最小的簇
+    int * label = m_clusterIDs;
+
+    for ( int i = 0; i < n; i++ )
+        label[ i ] = INT_MAX;
+
+    parallelFor( threadNum, n, [ & ]( int begin, int end, int ) {
+        for ( int i = begin; i < end; i++ )
+        {
+            if ( m_types[ i ] != PointType::CORE_POINT )
+                continue;
+
+            int cid = compCluster[ root[ i ] ];
+            label[ i ] = cid;
+
+            for ( const int * nb = rangeBegin( i ); nb != rangeEnd( i ); nb++ )
+                if ( m_types[ *nb ] != PointType::CORE_POINT )
+                    atomicMin( &label[ *nb ], cid );
+        }
+    } );
+
+    parallelFor( threadNum, starts.size(), [ & ]( int begin, int end, int ) {
+        for ( int c = begin; c < end; c++ )
+        {
+            for ( const int * seed = rangeBegin( starts[ c ] ); seed != rangeEnd( starts[ c ] ); seed++ )
+            {
+                if ( m_types[ *seed ] == PointType::CORE_POINT )
+                    continue;
+
+                for ( const int * nb = rangeBegin( *seed ); nb != rangeEnd( *seed ); nb++ )
+                    if ( m_types[ *nb ] != PointType::CORE_POINT )
+                        atomicMin( &label[ *nb ], c + 1 );
+            }
+        }
+    } );
+
+    for ( int i = 0; i < n; i++ )
+        if ( label[ i ] == INT_MAX )    label[ i ] = 0;
 }
 
 
 
-inline double 
-DBSCAN::calculateDistance(const Point& pointCore, const Point& pointTarget, double epsilon )
+void DBSCAN::scanRange( float x, float y, int begin, int end, vector<int> & range )
 {
-    // 这里如果做一个cache能减少一半运算，因为额外存取需要耗时，所以不一定省时间，以后再说
-    float  dx = pointCore.x - pointTarget.x;
-    float  dy = pointCore.y - pointTarget.y;
+    size_t old = range.size();
 
-    if ( dx >= epsilon ) return DBL_MAX;
-    if ( dy >= epsilon ) return DBL_MAX;
+    range.resize( old + ( end - begin ) + DBSCAN_RANGE_SLACK );
 
-    double distance = pow( dx, 2 ) + pow( dy, 2 );
+    int num = rangeKernel()( x, y, m_sortX.data() + begin, m_sortY.data() + begin, m_cellPoints.data() + begin,
+                             end - begin, m_eps2, range.data() + old );
 
-    distance = sqrt( distance );
+    range.resize( old + num );
+}
+
+
+
+void DBSCAN::buildAllRange( int pointId, vector<int> & range )
+{
+    float  x     = pointX( pointId );
+    float  y     = pointY( pointId );
+    size_t start = range.size();
+
+    if ( !m_useGrid )
+    {
+        // 一定是从前往后加的，所有里面的id是有序的
+        scanRange( x, y, 0, m_pointSize, range );
+    }
+    else
+    {
+        int64_t key = m_pointCells[ pointId ];
+        if ( key < 0 )
+            return;
+
+        int64_t cx = key / m_cellRows;
+        int64_t cy = key % m_cellRows;
+
+        // 距离 <= eps 的点 一定在周围 3x3 的格子里;
+        // 同一列的 3 个格子 编号连续, 在排好序的数组里 也是连续的一段, 一次扫完
+        for ( int64_t gx = cx - 1; gx <= cx + 1; gx++ )
+        {
+            if ( gx < 0 || gx >= m_cellCols )   continue;
+
+            int first = -1, last = -1;
+
+            for ( int64_t gy = cy - 1; gy <= cy + 1; gy++ )
+            {
+                if ( gy < 0 || gy >= m_cellRows )   continue;
+
+                int cell = findCell( gx * m_cellRows + gy );
+                if ( cell < 0 )                     continue;
+
+                if ( first < 0 )    first = cell;
+                last = cell;
+            }
+
+            if ( first >= 0 )
+                scanRange( x, y, m_cellStart[ first ], m_cellStart[ last + 1 ], range );
+        }
+
+        // 和逐个比较时一样 按id从小到大, expandCluster 的传导顺序 才不会变
+        std::sort( range.begin() + start, range.end() );
+    }
+
+    // 同一个点，就不要放进去了
+    range.erase( std::remove( range.begin() + start, range.end(), pointId ), range.end() );
+}
+
+
+
+// 从核心点出发，进行传染的探索，给 相关点都标上同一个clusterID
+int DBSCAN::expandCluster( int pointId, int clusterID )
+{
+    if ( m_types[ pointId ] != PointType::CORE_POINT )
+        return -1;
+
+    if ( m_clusterIDs[ pointId ] > 0 )
+        return -1;
+
+    m_clusterIDs[ pointId ] = clusterID;
+
+    // 直接密度可达点数组, 后面会往里加, 所以复制到 m_seeds 里, 每个簇复用同一块内存
+    vector<int> & clusterSeeds = m_seeds;
+    clusterSeeds.assign( rangeBegin( pointId ), rangeEnd( pointId ) );
+
+    // 开始循环，进行 直接密度可达的传导，找密度可达
+    for ( size_t i = 0; i < clusterSeeds.size(); i++ )
+    {
+        // 直接密度可达点
+        int seed_id = clusterSeeds[ i ];
+
+        if ( 0 == m_clusterIDs[ seed_id ] )
+            m_clusterIDs[ seed_id ] = clusterID;
+
+        // 下一级的关联点.  密度可达点数组
+        for ( const int * nb = rangeBegin( seed_id ); nb != rangeEnd( seed_id ); nb++ )
+        {
+            // 密度可达点
+            int neighor_id = *nb;
+
+            if ( 0 != m_clusterIDs[ neighor_id ] )
+                continue;
+
+            m_clusterIDs[ neighor_id ] = clusterID;
+
+            // 只有core点 才能进行下一级的探索
+            if ( m_types[ neighor_id ] == PointType::CORE_POINT )
+                clusterSeeds.push_back( neighor_id );
+        }
+    }
+
+    return 0;
+}
+
+
+
+// 格子编号的上限, 超过的截断到这里. 只是多了候选点, 不会漏:
+// 一个方向上坐标不同的两个邻居 差值至少是 float 的精度, 所以坐标不会大到 eps 的 2^24 倍以上, 格子编号是准确的
+#define DBSCAN_INCR_MAX_CELL    4.0e18
+
+
+IncrementalDBSCAN::IncrementalDBSCAN( int minPts, float eps )
+{
+    m_minPts        = minPts;
+    m_epsilon       = eps;
+    m_eps2          = eps * eps;
+    m_cellSize      = eps * ( 1 + DBSCAN_GRID_MARGIN );
+    m_nextClusterID = 1;
+    m_pointSize     = 0;
+    m_cellCount     = 0;
+}
+
+
+
+size_t IncrementalDBSCAN::hashCell( const CellKey & key )
+{
+    uint64_t h = (uint64_t)key.cx * 0x9E3779B97F4A7C15ULL + (uint64_t)key.cy;
+
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ULL;
+    h ^= h >> 32;
+
+    return (size_t)h;
+}
+
+
+
+int IncrementalDBSCAN::findCell( const CellKey & key ) const
+{
+    if ( m_cellTable.empty() )
+        return -1;
+
+    size_t mask = m_cellTable.size() - 1;
+
+    for ( size_t slot = hashCell( key ) & mask; ; slot = ( slot + 1 ) & mask )
+    {
+        const CellSlot & s = m_cellTable[ slot ];
+
+        if ( s.cell < 0 )       return -1;
+        if ( s.key == key )     return s.cell;
+    }
+}
+
+
+
+void IncrementalDBSCAN::rehashCells( size_t size )
+{
+    vector<CellSlot> old;
+    old.swap( m_cellTable );
+
+    m_cellTable.assign( size, CellSlot{ CellKey{ 0, 0 }, -1 } );
+
+    for ( const CellSlot & s : old )
+    {
+        if ( s.cell < 0 )
+            continue;
+
+        size_t slot = hashCell( s.key ) & ( size - 1 );
+        while ( m_cellTable[ slot ].cell >= 0 )
+            slot = ( slot + 1 ) & ( size - 1 );
+
+        m_cellTable[ slot ] = s;
+    }
+}
+
+
+
+int IncrementalDBSCAN::createCell( const CellKey & key )
+{
+    if ( ( m_cellCount + 1 ) * 2 > m_cellTable.size() )
+        rehashCells( std::max( (size_t)16, m_cellTable.size() * 2 ) );
+
+    int cell;
+
+    if ( !m_freeCells.empty() )
+    {
+        cell = m_freeCells.back();
+        m_freeCells.pop_back();
+    }
+    else
+    {
+        cell = m_cellPool.size();
+        m_cellPool.push_back( Cell() );
+    }
+
+    m_cellPool[ cell ].key = key;
+
+    size_t mask = m_cellTable.size() - 1;
+    size_t slot = hashCell( key ) & mask;
+
+    while ( m_cellTable[ slot ].cell >= 0 )
+        slot = ( slot + 1 ) & mask;
+
+    m_cellTable[ slot ].key  = key;
+    m_cellTable[ slot ].cell = cell;
+    m_cellCount++;
+
+    return cell;
+}
+
+
+
+void IncrementalDBSCAN::eraseCell( int cell )
+{
+    size_t mask = m_cellTable.size() - 1;
+    size_t i    = hashCell( m_cellPool[ cell ].key ) & mask;
+
+    while ( m_cellTable[ i ].cell != cell )
+        i = ( i + 1 ) & mask;
+
+    // 后面同一串里的 如果它的理想位置 不在 (i, j] 之间, 就挪到空出来的 i
+    for ( size_t j = ( i + 1 ) & mask; m_cellTable[ j ].cell >= 0; j = ( j + 1 ) & mask )
+    {
+        size_t k = hashCell( m_cellTable[ j ].key ) & mask;
+
+        bool between = ( i <= j ) ? ( i < k && k <= j ) : ( i < k || k <= j );
+        if ( between )
+            continue;
+
+        m_cellTable[ i ] = m_cellTable[ j ];
+        i = j;
+    }
+
+    m_cellTable[ i ].cell = -1;
+    m_cellCount--;
+
+    m_freeCells.push_back( cell );
+}
+
+
+
+bool IncrementalDBSCAN::cellOf( float x, float y, CellKey & key ) const
+{
+    if ( !( m_epsilon > 0 ) || !std::isfinite( m_epsilon ) )
+        return false;
+
+    if ( !std::isfinite( x ) || !std::isfinite( y ) )
+        return false;
+
+    double cx = floor( x / m_cellSize );
+    double cy = floor( y / m_cellSize );
+
+    key.cx = (int64_t)std::min( std::max( cx, -DBSCAN_INCR_MAX_CELL ), DBSCAN_INCR_MAX_CELL );
+    key.cy = (int64_t)std::min( std::max( cy, -DBSCAN_INCR_MAX_CELL ), DBSCAN_INCR_MAX_CELL );
+
+    return true;
+}
+
+
+
+void IncrementalDBSCAN::query( float x, float y, vector<int> & out )
+{
+    CellKey key;
+    if ( !cellOf( x, y, key ) )
+        return;
+
+    for ( int64_t gx = key.cx - 1; gx <= key.cx + 1; gx++ )
+    {
+        for ( int64_t gy = key.cy - 1; gy <= key.cy + 1; gy++ )
+        {
+            int index = findCell( CellKey{ gx, gy } );
+            if ( index < 0 )
+                continue;
+
+            const Cell & cell = m_cellPool[ index ];
+            size_t       old  = out.size();
+
+            out.resize( old + cell.ids.size() + DBSCAN_RANGE_SLACK );
+
+            int num = rangeKernel()( x, y, cell.xs.data(), cell.ys.data(), cell.ids.data(),
+                                     cell.ids.size(), m_eps2, out.data() + old );
+
+            out.resize( old + num );
+        }
+    }
+}
+
+
+
+void IncrementalDBSCAN::neighbors( int id, vector<int> & out )
+{
+    out.clear();
+
+    if ( m_cell[ id ] < 0 )
+        return;
+
+    query( m_x[ id ], m_y[ id ], out );
+
+    // 同一个点，就不要放进去了
+    out.erase( std::remove( out.begin(), out.end(), id ), out.end() );
+}
+
+
+
+void IncrementalDBSCAN::addToCell( int id )
+{
+    CellKey key;
+
+    m_cell[ id ] = -1;
+    if ( !cellOf( m_x[ id ], m_y[ id ], key ) )
+        return;
+
+    int index = findCell( key );
+    if ( index < 0 )
+        index = createCell( key );
+
+    Cell & cell = m_cellPool[ index ];
+
+    m_cell[ id ] = index;
+    m_slot[ id ] = cell.ids.size();
+
+    cell.xs.push_back( m_x[ id ] );
+    cell.ys.push_back( m_y[ id ] );
+    cell.ids.push_back( id );
+}
+
+
+
+void IncrementalDBSCAN::removeFromCell( int id )
+{
+    if ( m_cell[ id ] < 0 )
+        return;
+
+    Cell & cell = m_cellPool[ m_cell[ id ] ];
+    int    slot = m_slot[ id ];
+    int    last = cell.ids.back();
+
+    // 最后一个点 挪到被删除的位置
+    cell.xs[ slot ]  = cell.xs.back();
+    cell.ys[ slot ]  = cell.ys.back();
+    cell.ids[ slot ] = last;
+    m_slot[ last ]   = slot;
+
+    cell.xs.pop_back();
+    cell.ys.pop_back();
+    cell.ids.pop_back();
+
+    if ( cell.ids.empty() )
+        eraseCell( m_cell[ id ] );
+
+    m_cell[ id ] = -1;
+}
 
-    //printf("%.4f\n", distance );
-    return distance;
+
+
+int IncrementalDBSCAN::insert( const vector<Point> & points, vector<int> & ids )
+{
+    vector<int> nbs;
+    vector<int> newCores;
+    vector<int> affected;
+
+    ids.clear();
+    ids.reserve( points.size() );
+
+    for ( const Point & point : points )
+    {
+        int id;
+
+        if ( !m_freeIds.empty() )
+        {
+            id = m_freeIds.back();
+            m_freeIds.pop_back();
+        }
+        else
+        {
+            id = m_alive.size();
+
+            m_x.push_back( 0 );
+            m_y.push_back( 0 );
+            m_count.push_back( 0 );
+            m_label.push_back( 0 );
+            m_type.push_back( PointType::NOISE );
+            m_alive.push_back( 0 );
+            m_cell.push_back( -1 );
+            m_slot.push_back( 0 );
+            m_mark.push_back( -1 );
+        }
+
+        m_x[ id ]     = point.x;
+        m_y[ id ]     = point.y;
+        m_label[ id ] = 0;
+        m_type[ id ]  = PointType::NOISE;
+        m_alive[ id ] = 1;
+        m_pointSize++;
+
+        addToCell( id );
+        neighbors( id, nbs );
+
+        m_count[ id ] = nbs.size();
+
+        newCores.clear();
+        affected.clear();
+
+        // 邻居的数量 只会增加, 只可能 非核心点 变成核心点
+        for ( int q : nbs )
+        {
+            m_count[ q ]++;
+
+            if ( m_type[ q ] != PointType::CORE_POINT && m_count[ q ] >= m_minPts )
+                newCores.push_back( q );
+        }
+
+        if ( m_count[ id ] >= m_minPts )
+            newCores.push_back( id );
+        else
+            affected.push_back( id );
+
+        // 新的核心点 簇id 先清成 0, connectCores 里用 0 区分 还没有分配簇的
+        for ( int c : newCores )
+        {
+            m_type[ c ]  = PointType::CORE_POINT;
+            m_label[ c ] = 0;
+        }
+
+        connectCores( newCores, affected );
+        updateBorders( affected );
+
+        ids.push_back( id );
+    }
+
+    return 0;
+}
+
+
+
+int IncrementalDBSCAN::remove( const vector<int> & ids )
+{
+    // 先检查, 有不存在的 或者重复的 就什么都不删
+    int ret = 0;
+
+    for ( int id : ids )
+    {
+        if ( !isValid( id ) || m_mark[ id ] >= 0 )
+        {
+            ret = -1;
+            break;
+        }
+
+        m_mark[ id ] = 1;
+    }
+
+    for ( int id : ids )
+    {
+        if ( isValid( id ) )    m_mark[ id ] = -1;
+    }
+
+    if ( ret < 0 )
+        return -1;
+
+    vector<int> nbs;
+    vector<int> lostNbs;
+    vector<int> lost;
+    vector<int> affected;
+
+    for ( int id : ids )
+    {
+        neighbors( id, nbs );
+        removeFromCell( id );
+
+        bool wasCore  = ( m_type[ id ] == PointType::CORE_POINT );
+        int  oldLabel = m_label[ id ];
+
+        lost.clear();
+        affected.clear();
+
+        // 邻居的数量 只会减少, 只可能 核心点 变成非核心点
+        for ( int q : nbs )
+        {
+            m_count[ q ]--;
+
+            if ( m_type[ q ] == PointType::CORE_POINT && m_count[ q ] < m_minPts )
+                lost.push_back( q );
+            else if ( wasCore && m_type[ q ] != PointType::CORE_POINT )
+                affected.push_back( q );
+        }
+
+        m_alive[ id ] = 0;
+        m_label[ id ] = 0;
+        m_type[ id ]  = PointType::NOISE;
+        m_freeIds.push_back( id );
+        m_pointSize--;
+
+        // 失去的核心点 按簇分组, 和它们相邻的 剩下的核心点 是检查分裂的起点
+        vector< std::pair<int, int> > seeds;           // (簇id, 核心点)
+        vector<int>                   lostLabels;
+
+        if ( wasCore )
+            lostLabels.push_back( oldLabel );
+
+        for ( int q : lost )
+        {
+            lostLabels.push_back( m_label[ q ] );
+
+            m_type[ q ]  = PointType::NOISE;           // 后面 updateBorders 重新算
+            m_label[ q ] = 0;
+            affected.push_back( q );
+        }
+
+        for ( size_t i = 0; i < lostLabels.size(); i++ )
+        {
+            int label = lostLabels[ i ];
+
+            m_clusterCores[ label ]--;
+
+            const vector<int> * around = &nbs;
+            if ( !wasCore || i > 0 )
+            {
+                neighbors( lost[ wasCore ? i - 1 : i ], lostNbs );
+                around = &lostNbs;
+            }
+
+            for ( int w : *around )
+            {
+                if ( m_type[ w ] == PointType::CORE_POINT )
+                    seeds.push_back( std::make_pair( label, w ) );
+                else
+                    affected.push_back( w );
+            }
+        }
+
+        std::sort( seeds.begin(), seeds.end() );
+        std::sort( lostLabels.begin(), lostLabels.end() );
+        lostLabels.erase( std::unique( lostLabels.begin(), lostLabels.end() ), lostLabels.end() );
+
+        for ( int label : lostLabels )
+        {
+            if ( 0 == m_clusterCores[ label ] )
+            {
+                m_clusterCores.erase( label );
+                continue;
+            }
+
+            vector<int> labelSeeds;
+            auto it = std::lower_bound( seeds.begin(), seeds.end(), std::make_pair( label, INT_MIN ) );
+
+            for ( ; it != seeds.end() && it->first == label; ++it )
+                labelSeeds.push_back( it->second );
+
+            splitCluster( label, labelSeeds, affected );
+        }
+
+        updateBorders( affected );
+    }
+
+    return 0;
+}
+
+
+
+/**
+ * 新的核心点 按互为邻居 连成块, 每块:
+ *      周围没有已有的簇: 用新的簇id
+ *      周围有一个或多个簇: 都并到 核心点最多的那个簇里, 其他的簇 改成它的id
+ */
+void IncrementalDBSCAN::connectCores( const vector<int> & newCores, vector<int> & affected )
+{
+    vector<int> nbs;
+    vector<int> comp;
+    vector< std::pair<int, int> > touched;              // (簇id, 该簇的一个核心点)
+
+    for ( int c : newCores )
+    {
+        if ( m_label[ c ] != 0 )
+            continue;
+
+        comp.clear();
+        touched.clear();
+
+        comp.push_back( c );
+        m_mark[ c ] = 1;
+
+        for ( size_t i = 0; i < comp.size(); i++ )
+        {
+            neighbors( comp[ i ], nbs );
+
+            for ( int w : nbs )
+            {
+                if ( m_type[ w ] != PointType::CORE_POINT )
+                {
+                    affected.push_back( w );
+                }
+                else if ( m_label[ w ] == 0 )
+                {
+                    if ( m_mark[ w ] < 0 )
+                    {
+                        m_mark[ w ] = 1;
+                        comp.push_back( w );
+                    }
+                }
+                else
+                {
+                    bool seen = false;
+                    for ( std::pair<int, int> & t : touched )
+                        if ( t.first == m_label[ w ] )  seen = true;
+
+                    if ( !seen )
+                        touched.push_back( std::make_pair( m_label[ w ], w ) );
+                }
+            }
+        }
+
+        for ( int u : comp )
+            m_mark[ u ] = -1;
+
+        int winner;
+
+        if ( touched.empty() )
+        {
+            winner = m_nextClusterID++;
+            m_clusterCores[ winner ] = 0;
+        }
+        else
+        {
+            winner = touched[ 0 ].first;
+            for ( std::pair<int, int> & t : touched )
+                if ( m_clusterCores[ t.first ] > m_clusterCores[ winner ] )
+                    winner = t.first;
+
+            for ( std::pair<int, int> & t : touched )
+            {
+                if ( t.first == winner )
+                    continue;
+
+                relabelCluster( t.second, t.first, winner, affected );
+
+                m_clusterCores[ winner ] += m_clusterCores[ t.first ];
+                m_clusterCores.erase( t.first );
+            }
+        }
+
+        for ( int u : comp )
+            m_label[ u ] = winner;
+
+        m_clusterCores[ winner ] += comp.size();
+    }
+}
+
+
+
+void IncrementalDBSCAN::relabelCluster( int start, int from, int to, vector<int> & affected )
+{
+    vector<int> nbs;
+    vector<int> stack;
+
+    m_label[ start ] = to;
+    stack.push_back( start );
+
+    while ( !stack.empty() )
+    {
+        int u = stack.back();
+        stack.pop_back();
+
+        neighbors( u, nbs );
+
+        for ( int w : nbs )
+        {
+            if ( m_type[ w ] != PointType::CORE_POINT )
+            {
+                affected.push_back( w );
+            }
+            else if ( m_label[ w ] == from )
+            {
+                m_label[ w ] = to;
+                stack.push_back( w );
+            }
+        }
+    }
+}
+
+
+
+/**
+ * 从每个 seed 同时做 BFS, 轮流各走一步:
+ *      两个搜索碰到一起, 说明它们连通, 合并成一组
+ *      一组走完了 还没碰到别的组, 它就是分裂出去的一块, 改成新的簇id
+ *      只剩一组时 停止, 这一组保留原来的簇id, 不用走完
+ * 代价只和 分裂出去的小块 成正比, 不会遍历整个大簇
+ */
+void IncrementalDBSCAN::splitCluster( int label, vector<int> & seeds, vector<int> & affected )
+{
+    std::sort( seeds.begin(), seeds.end() );
+    seeds.erase( std::unique( seeds.begin(), seeds.end() ), seeds.end() );
+
+    int k = seeds.size();
+    if ( k <= 1 )
+        return;
+
+    vector<int>             group( k );             // 搜索 -> 所在组, 并查集
+    vector<int>             pending( k, 1 );        // 组里 还没展开的点的数量
+    vector<size_t>          head( k, 0 );
+    vector< vector<int> >   visited( k );           // 每个搜索 访问过的核心点, 同时也是 BFS 的队列
+    vector< vector<int> >   members( k );           // 组里的搜索
+    vector< vector<int> >   borders( k );           // 每个搜索 碰到的非核心点
+    vector<int>             nbs;
+
+    auto findGroup = [ & ]( int s ) {
+        while ( group[ s ] != s )
+        {
+            group[ s ] = group[ group[ s ] ];
+            s = group[ s ];
+        }
+        return s;
+    };
+
+    for ( int s = 0; s < k; s++ )
+    {
+        group[ s ] = s;
+        members[ s ].push_back( s );
+        visited[ s ].push_back( seeds[ s ] );
+        m_mark[ seeds[ s ] ] = s;
+    }
+
+    int active = k;
+
+    while ( active > 1 )
+    {
+        for ( int s = 0; s < k && active > 1; s++ )
+        {
+            if ( head[ s ] == visited[ s ].size() )
+                continue;
+
+            int u = visited[ s ][ head[ s ]++ ];
+            pending[ findGroup( s ) ]--;
+
+            neighbors( u, nbs );
+
+            for ( int w : nbs )
+            {
+                if ( m_type[ w ] != PointType::CORE_POINT )
+                {
+                    borders[ s ].push_back( w );
+                    continue;
+                }
+
+                if ( m_label[ w ] != label )
+                    continue;
+
+                if ( m_mark[ w ] < 0 )
+                {
+                    m_mark[ w ] = s;
+                    visited[ s ].push_back( w );
+                    pending[ findGroup( s ) ]++;
+                    continue;
+                }
+
+                int g1 = findGroup( s );
+                int g2 = findGroup( m_mark[ w ] );
+
+                if ( g1 != g2 )
+                {
+                    group[ g2 ]    = g1;
+                    pending[ g1 ] += pending[ g2 ];
+                    members[ g1 ].insert( members[ g1 ].end(), members[ g2 ].begin(), members[ g2 ].end() );
+                    active--;
+                }
+            }
+
+            // 这一组走完了, 是分裂出去的一块
+            int g = findGroup( s );
+
+            if ( 0 == pending[ g ] && active > 1 )
+            {
+                int newLabel = m_nextClusterID++;
+                int num      = 0;
+
+                for ( int m : members[ g ] )
+                {
+                    for ( int v : visited[ m ] )
+                        m_label[ v ] = newLabel;
+
+                    num += visited[ m ].size();
+                    affected.insert( affected.end(), borders[ m ].begin(), borders[ m ].end() );
+                }
+
+                m_clusterCores[ newLabel ] = num;
+                m_clusterCores[ label ]   -= num;
+                active--;
+            }
+        }
+    }
+
+    for ( int s = 0; s < k; s++ )
+        for ( int v : visited[ s ] )
+            m_mark[ v ] = -1;
+}
+
+
+
+void IncrementalDBSCAN::updateBorders( vector<int> & affected )
+{
+    vector<int> nbs;
+
+    std::sort( affected.begin(), affected.end() );
+    affected.erase( std::unique( affected.begin(), affected.end() ), affected.end() );
+
+    for ( int id : affected )
+    {
+        if ( !m_alive[ id ] || m_type[ id ] == PointType::CORE_POINT )
+            continue;
+
+        neighbors( id, nbs );
+
+        // 属于 id 最小的 核心点邻居 的簇
+        int best = INT_MAX;
+        for ( int w : nbs )
+            if ( m_type[ w ] == PointType::CORE_POINT && w < best )
+                best = w;
+
+        if ( INT_MAX == best )
+        {
+            m_label[ id ] = 0;
+            m_type[ id ]  = PointType::NOISE;
+        }
+        else
+        {
+            m_label[ id ] = m_label[ best ];
+            m_type[ id ]  = PointType::BORDER_POINT;
+        }
+    }
 }
 
 
@@ -2,6 +2,8 @@
 
 #include <vector>
 #include <cmath>
+#include <cstdint>
+#include <unordered_map>
 #include "dispatch_solver/problem_decomposition/algo/comm_def.h"
 
 
@@ -49,35 +51,121 @@ struct Point
 class DBSCAN
 {
 public:    
-    DBSCAN( int minPts, float eps, vector<Point> & points )
-    {
-        m_minPts    = minPts;
-        m_epsilon   = eps;
-        m_points    = points;
-        m_pointSize = points.size();
-    }
+    /**
+     * 复制一份 points, 结果写回到 getPoints() 里的 clusterID 和 type
+     */
+    DBSCAN( int minPts, float eps, vector<Point> & points );
+
+    /**
+     * 不复制坐标, 调用方保证 run 的时候 坐标还有效
+     *      第 i 个点的坐标是 ( (char*)x + i * stride ) 和 ( (char*)y + i * stride ) 处的 float
+     *      stride 是字节数: 两个独立的 float 数组传 sizeof(float), 结构体数组传 sizeof(结构体)
+     */
+    DBSCAN( int minPts, float eps, const float * x, const float * y, int pointSize, int stride = sizeof(float) );
+
     ~DBSCAN(){}
 
-    int run();
+    /**
+     * 聚类
+     *      threadNum:  1 单线程;  >1 多线程;  <=0 使用cpu的核数
+     *                  多线程时 邻居和类型并行计算, 簇用并发的并查集合并, 结果和单线程完全一样
+     */
+    int run( int threadNum = 1 );
+
+    /**
+     * 聚类, 结果直接写到调用方的数组里, 长度都是 pointSize, 下标就是点的id
+     *      clusterIDs: 簇id, 从1开始, 0 代表不属于任何簇;  为 NULL 时 写到内部的数组
+     *      types:      点的类型;                           为 NULL 时 写到内部的数组
+     */
+    int run( int * clusterIDs, PointType * types, int threadNum = 1 );
 
     vector<Point> & getPoints() { return m_points; }
     int getTotalPointSize() {   return m_pointSize; }
     int getMinClusterSize() {   return m_minPts;    }
     int getEpsilonSize()    {   return m_epsilon;   }
 
+    // 最近一次 run 的结果
+    const int       * getClusterIDs()   {   return m_clusterIDs;    }
+    const PointType * getTypes()        {   return m_types;         }
+
+    /**
+     * 最近一次 run 算出来的 点 id 的邻居, id 从小到大, 不包括自己
+     *      返回邻居的数量, *ids 指向内部的数组, 下一次 run 之前有效
+     */
+    int getNeighbors( int id, const int ** ids );
+
 private:
-    int expandCluster(Point & point, int clusterID);
+    // 按 m_points 设置 坐标视图 和 点的数量
+    void bindPoints();
+
+    int expandCluster( int pointId, int clusterID );
+
+    // 多线程版本的 建簇, 调用前 邻居和类型已经准备好
+    void clusterParallel( int threadNum );
+
+    // 所有点的邻居 存成 CSR, 顺带标记 核心点/噪声/边界点
+    void buildRanges( int threadNum );
+
+    // 按 eps 大小的格子 把点分桶, 找邻居时 只需要看周围 3x3 个格子
+    void buildGrid();
+
+    // 排好序的第 [begin, end) 个点里, 和 (x, y) 的距离 <= eps 的点id 追加到 range 后面, 包括自己
+    void scanRange( float x, float y, int begin, int end, vector<int> & range );
+
+    // 格子的编号, 坐标不是有限值的点 没有格子, 返回 -1
+    int64_t cellOf( float x, float y ) const;
+
+    // 格子编号 对应的 m_cellStart 的下标, 没有点的格子 返回 -1
+    int findCell( int64_t key ) const;
+
+    // 把点 pointId 的邻居 按id从小到大 追加到 range 后面
+    void buildAllRange( int pointId, vector<int> & range );
 
-    // 计算2个点之间的距离，后面这个要换成函数指针
-    inline double calculateDistance( const Point& pointCore, const Point& pointTarget, double epsilon );
+    inline float pointX( int i ) const { return *(const float *)( m_x + (size_t)i * m_stride ); }
+    inline float pointY( int i ) const { return *(const float *)( m_y + (size_t)i * m_stride ); }
 
-    vector<int> buildAllRange(Point & point);
+    // 点 i 的邻居 是 m_rangeIds[ m_rangeStart[i] .. m_rangeStart[i+1] )
+    inline const int * rangeBegin( int i ) const { return m_rangeIds.data() + m_rangeStart[ i ]; }
+    inline const int * rangeEnd( int i )   const { return m_rangeIds.data() + m_rangeStart[ i + 1 ]; }
+    inline int         rangeSize( int i )  const { return (int)( m_rangeStart[ i + 1 ] - m_rangeStart[ i ] ); }
 
 private:    
-    vector<Point>   m_points;               // 所有点的数组
+    vector<Point>   m_points;               // 用 vector<Point> 构造时 复制的点, 否则为空
+    bool            m_ownPoints;            // 是否用 vector<Point> 构造, 是的话 run 时按 m_points 重新取视图
 
-    // 每个点对应的半径范围内的 其他点的id 数组
-    vector< vector< int > >  m_pointRanges;               
+    // 坐标的只读视图
+    const char *    m_x;
+    const char *    m_y;
+    size_t          m_stride;
+
+    // 结果, 指向调用方的数组 或者 下面内部的数组
+    int *           m_clusterIDs;
+    PointType *     m_types;
+    vector<int>         m_ownClusterIDs;
+    vector<PointType>   m_ownTypes;
+
+    // 每个点对应的半径范围内的 其他点的id, CSR 存储, 所有点只有两次分配
+    vector<int64_t> m_rangeStart;
+    vector<int>     m_rangeIds;
+
+    vector<int>     m_seeds;                // expandCluster 的传导队列, 每个簇复用
+
+    // 格子索引, 按 (格子编号, 点id) 排好序的 CSR:
+    //      第 i 个格子 编号是 m_cellKeys[i], 里面的点是 m_cellPoints[ m_cellStart[i] .. m_cellStart[i+1] )
+    bool            m_useGrid;              // false: 坐标范围太大 或者 eps 不合法, 退回到 逐个比较
+    double          m_cellSize;             // 格子的边长, 比 eps 略大一点, 保证邻居不会跨过 2 个格子
+    double          m_originX;              // 所有点的 最小坐标, 格子从这里开始编号
+    double          m_originY;
+    int64_t         m_cellRows;             // y 方向的格子数量, 编号 = cx * m_cellRows + cy
+    int64_t         m_cellCols;             // x 方向的格子数量
+    vector<int64_t> m_pointCells;           // 每个点 所在的格子编号
+    vector<int64_t> m_cellKeys;
+    vector<int>     m_cellStart;
+    vector<int>     m_cellPoints;           // 按格子排好的点id; 不用格子时 是按id顺序的所有点
+    vector<float>   m_sortX;                // 和 m_cellPoints 同样顺序的坐标, 给向量化的距离计算用
+    vector<float>   m_sortY;
+    float           m_eps2;                 // eps 的平方, eps 为负数时是 -1, 没有任何点满足
+    vector<int>     m_cellTable;            // 开放寻址的hash表, 格子编号 -> m_cellKeys 的下标, -1 为空
 
     int             m_pointSize;            // 总的点的数量
     int             m_minPts;               // 直接密度可达 的点的最小数量
@@ -86,4 +174,135 @@ private:
 
 
 
+/**
+ * 增量的 DBSCAN, 点不断的加入和删除, 只更新受影响的 eps 范围内的 邻居数、核心点 和 簇id
+ *
+ *      用的是标准的 DBSCAN 定义, 和上面批量的 DBSCAN::run 不完全一样:
+ *          核心点:  eps 内的其他点 >= minPts
+ *          簇:      互为邻居的核心点 连起来的连通块
+ *          边界点:  不是核心点, 但 eps 内有核心点, 属于 id 最小的那个核心点的簇
+ *          噪声:    其他的点, 簇id 为 0
+ *
+ *      簇id 尽量保持不变: 合并时 保留核心点多的簇的id, 分裂时 没有遍历完的那一块 保留原来的id, 其他的块用新的id
+ *      点id 由 insert 分配, 删除后的 id 会被后面加入的点复用
+ *      eps 需要是正的有限值, 否则所有的点都没有邻居. 不是线程安全的
+ */
+class IncrementalDBSCAN
+{
+public:
+    IncrementalDBSCAN( int minPts, float eps );
+    ~IncrementalDBSCAN(){}
+
+    /**
+     * 加入点, 只用到 Point 的 x, y
+     *      ids: 输出每个点分到的 id, 和 points 一一对应
+     */
+    int insert( const vector<Point> & points, vector<int> & ids );
+
+    /**
+     * 删除点
+     *      返回值: -1: 有 id 不存在, 这时什么都不删;  0: 成功
+     */
+    int remove( const vector<int> & ids );
+
+    // 当前的结果, 下标是点id, 大小是 getIdCapacity(); 已经删除的 id 簇id为 0, 类型是 NOISE
+    const vector<int> &       getClusterIDs() const { return m_label; }
+    const vector<PointType> & getTypes()      const { return m_type;  }
+
+    bool isValid( int id ) const { return id >= 0 && id < (int)m_alive.size() && m_alive[ id ]; }
+
+    int getPointSize()   const { return m_pointSize;          }
+    int getIdCapacity()  const { return (int)m_alive.size();  }
+    int getClusterSize() const { return (int)m_clusterCores.size(); }
+
+private:
+    // 格子 用 (cx, cy) 做 key, 里面的点 按 SoA 存, 给向量化的距离计算用
+    struct CellKey
+    {
+        int64_t cx, cy;
+        bool operator==( const CellKey & o ) const { return cx == o.cx && cy == o.cy; }
+    };
+
+    struct Cell
+    {
+        CellKey         key;
+        vector<float>   xs;
+        vector<float>   ys;
+        vector<int>     ids;
+    };
+
+    // 开放寻址的hash表的一个位置, cell 为 -1 表示空
+    struct CellSlot
+    {
+        CellKey         key;
+        int             cell;
+    };
+
+    static size_t hashCell( const CellKey & key );
+
+    // 格子在 m_cellPool 里的下标, 没有返回 -1
+    int findCell( const CellKey & key ) const;
+
+    // 新建一个格子, 调用方保证 key 不存在
+    int createCell( const CellKey & key );
+
+    // 删除一个空的格子, 线性探测 后面的往前挪, 不留删除标记
+    void eraseCell( int cell );
+
+    void rehashCells( size_t size );
+
+    // 坐标所在的格子, 坐标不是有限值的 没有格子, 返回 false
+    bool cellOf( float x, float y, CellKey & key ) const;
+
+    // ( x, y ) 的 eps 范围内的 点id 追加到 out, 包括坐标相同的点 本身
+    void query( float x, float y, vector<int> & out );
+
+    // 点 id 的邻居, 不包括自己
+    void neighbors( int id, vector<int> & out );
+
+    void addToCell( int id );
+    void removeFromCell( int id );
+
+    // 新变成核心点的 连起来, 和已有的簇合并, 受影响的非核心点 加到 affected
+    void connectCores( const vector<int> & newCores, vector<int> & affected );
+
+    // 把簇 from 的核心点 都改成 to, 从核心点 start 开始遍历
+    void relabelCluster( int start, int from, int to, vector<int> & affected );
+
+    // 簇 label 去掉一些核心点后, seeds 是剩下的和它们相邻的核心点, 检查是否分裂
+    void splitCluster( int label, vector<int> & seeds, vector<int> & affected );
+
+    // 重新计算 非核心点的 类型和簇id
+    void updateBorders( vector<int> & affected );
+
+private:
+    vector<float>       m_x;
+    vector<float>       m_y;
+    vector<int>         m_count;            // eps 内的其他点的数量
+    vector<int>         m_label;            // 簇id
+    vector<PointType>   m_type;
+    vector<char>        m_alive;
+    vector<int>         m_cell;             // 所在的格子, -1 表示不在格子里
+    vector<int>         m_slot;             // 在格子里的下标
+    vector<int>         m_freeIds;          // 删除后 可以复用的 id
+
+    vector<Cell>        m_cellPool;         // 所有的格子, 空出来的 放到 m_freeCells 复用
+    vector<int>         m_freeCells;
+    vector<CellSlot>    m_cellTable;        // 格子的 hash表, 大小是 2 的幂, 负载不超过一半
+    size_t              m_cellCount;
+
+    unordered_map<int, int> m_clusterCores; // 簇id -> 核心点的数量
+
+    vector<int>         m_mark;             // 遍历时的标记, 下标是点id, 用完恢复成 -1
+
+    int                 m_nextClusterID;
+    int                 m_pointSize;
+    int                 m_minPts;
+    float               m_epsilon;
+    float               m_eps2;
+    double              m_cellSize;
+};
+
+
+
 ALGO_NAMESPACE_END();
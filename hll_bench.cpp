@@ -0,0 +1,412 @@
+/**
+ * HyperLogLog 的性能和误差测试
+ *
+ *      perf   : 每种编码, 基数从 1 到 -n 按 1/3/10/30... 递增, 在每个点测
+ *               add / count / merge / serialize / unSerialize / fast_merge 的 ns/op 和 ops/s
+ *      promote: 稀疏编码 在第几个元素 转成稠密, 转换那一次 add 的耗时, 转换前后的序列化大小
+ *      error  : 每种编码 -r 组不同的元素, 基数在 1/2/5/10... 各点的 平均相对误差 / 均方根误差 / 最大误差
+ *
+ *      结果每行一个 JSON 对象, 输出到标准输出, 方便做回归对比
+ *
+ *      编译: g++ -O2 -o hll_bench hll_bench.cpp hyperloglog.cpp -lpthread
+ *
+ *      用法: hll_bench [-m perf|promote|error|all] [-p precision] [-H murmur|wyhash]
+ *                      [-n perf的最大基数] [-e error的最大基数] [-r error的组数] [-t 每项最少的测试时间ms]
+ *          -n 默认 10^7, 最大 10^9
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "hyperloglog.h"
+
+
+#define HLL_BENCH_COLD_COPIES       32                          /* count 需要没有缓存的对象, 每次用一个新的副本 */
+#define HLL_BENCH_MAX_POINTS        64
+#define HLL_BENCH_MAX_N             1000000000ULL
+
+
+static const unsigned char hll_bench_encodings[] = { HLL_DENSE, HLL_DENSE_PACKED, HLL_SPARSE, HLL_SPARSE_LIST };
+static const char *        hll_bench_names[]     = { "dense", "dense_packed", "sparse", "sparse_list" };
+
+#define HLL_BENCH_ENCODINGS         ( (int)sizeof( hll_bench_encodings ) )
+
+
+typedef struct hll_bench_opt_s
+{
+    int             precision;
+    unsigned char   hash_type;
+    uint64_t        perf_max;
+    uint64_t        error_max;
+    int             trials;
+    double          min_secs;                                   /* 每一项 至少测这么久 */
+} hll_bench_opt_t;
+
+
+
+static inline double
+hll_bench_now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+/** 第 trial 组的第 i 个元素, 不同组之间 没有重复 */
+static inline uint64_t
+hll_bench_key( int trial, uint64_t i )
+{
+    return ( (uint64_t)trial << 40 ) | i;
+}
+
+
+
+static void
+hll_bench_emit( const char * bench, int encoding, int p, uint64_t n, uint64_t ops, double secs, int bytes )
+{
+    double ns = ( ops > 0 ) ? secs * 1e9 / ops : 0.0;
+
+    printf( "{\"bench\":\"%s\",\"encoding\":\"%s\",\"p\":%d,\"n\":%llu,\"ops\":%llu,"
+            "\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f",
+            bench, hll_bench_names[ encoding ], p, (unsigned long long)n, (unsigned long long)ops,
+            ns, ( ns > 0 ) ? 1e9 / ns : 0.0 );
+
+    if ( bytes >= 0 ) printf( ",\"bytes\":%d", bytes );
+    printf( "}\n" );
+}
+
+
+
+/**
+ * 重复执行 stmt, 每轮次数翻倍, 直到总时间超过 min_secs
+ *      结束后 ops 是总次数, secs 是总时间
+ */
+#define HLL_BENCH_LOOP( min_secs, ops, secs, stmt )                                     \
+    do {                                                                                \
+        uint64_t _batch = 1;                                                            \
+        (ops)  = 0;                                                                     \
+        (secs) = 0.0;                                                                   \
+        while ( (secs) < (min_secs) )                                                   \
+        {                                                                               \
+            double _t0 = hll_bench_now();                                               \
+            for ( uint64_t _i = 0; _i < _batch; _i++ ) { stmt; }                        \
+            (secs) += hll_bench_now() - _t0;                                            \
+            (ops)  += _batch;                                                           \
+            _batch *= 2;                                                                \
+        }                                                                               \
+    } while ( 0 )
+
+
+
+/** 在基数为 n 的对象 ctx 上 测除了 add 以外的各项 */
+static int
+hll_bench_point( const hll_bench_opt_t * opt, int e, hll_ctx_t * ctx, uint64_t n )
+{
+    int        p      = opt->precision;
+    int        ret    = -1;
+    int        rb;
+    uint64_t   ops;
+    double     secs;
+    hll_ctx_t * copies[ HLL_BENCH_COLD_COPIES ] = { NULL };
+
+    int       max_bytes = hll_ctx_serial_maxBytes( ctx );
+    uint8_t * blob      = (uint8_t *)malloc( max_bytes > 0 ? max_bytes : 1 );
+    hll_ctx_t * target  = hll_ctx_create_with_precision( HLL_DENSE, opt->hash_type, p );
+
+    if ( NULL == blob || NULL == target ) goto done;
+
+    {
+        // serialize
+        int len = 0;
+        HLL_BENCH_LOOP( opt->min_secs, ops, secs, len = hll_ctx_serialize( ctx, blob ) );
+        if ( len <= 0 ) goto done;
+        hll_bench_emit( "serialize", e, p, n, ops, secs, len );
+
+        // unSerialize, 包括创建和释放
+        HLL_BENCH_LOOP( opt->min_secs, ops, secs, hll_ctx_free( hll_ctx_unSerialize( blob, len, &rb ) ) );
+        hll_bench_emit( "unSerialize", e, p, n, ops, secs, len );
+
+        // count: 估算值有缓存, 每次在一个新的副本上算
+        secs = 0.0;
+        for ( int i = 0; i < HLL_BENCH_COLD_COPIES; i++ )
+        {
+            copies[ i ] = hll_ctx_unSerialize( blob, len, &rb );
+            if ( NULL == copies[ i ] ) goto done;
+        }
+        for ( int i = 0; i < HLL_BENCH_COLD_COPIES; i++ )
+        {
+            double t0 = hll_bench_now();
+            hll_ctx_count( copies[ i ] );
+            secs += hll_bench_now() - t0;
+        }
+        hll_bench_emit( "count", e, p, n, HLL_BENCH_COLD_COPIES, secs, -1 );
+
+        // merge / fast_merge 到一个稠密的对象中
+        HLL_BENCH_LOOP( opt->min_secs, ops, secs, hll_ctx_merge( target, ctx ) );
+        hll_bench_emit( "merge", e, p, n, ops, secs, -1 );
+
+        hll_ctx_reset( target );
+        HLL_BENCH_LOOP( opt->min_secs, ops, secs, hll_ctx_fast_merge( target, blob, len ) );
+        hll_bench_emit( "fast_merge", e, p, n, ops, secs, len );
+    }
+    ret = 0;
+
+done:
+    for ( int i = 0; i < HLL_BENCH_COLD_COPIES; i++ ) hll_ctx_free( copies[ i ] );
+    hll_ctx_free( target );
+    free( blob );
+
+    return ret;
+}
+
+
+
+static int
+hll_bench_perf( const hll_bench_opt_t * opt )
+{
+    for ( int e = 0; e < HLL_BENCH_ENCODINGS; e++ )
+    {
+        hll_ctx_t * ctx = hll_ctx_create_with_precision( hll_bench_encodings[ e ], opt->hash_type, opt->precision );
+        if ( NULL == ctx ) return -1;
+
+        uint64_t added = 0;
+        uint64_t prev  = 0;
+
+        // 1, 3, 10, 30, 100 ...
+        for ( uint64_t decade = 1; decade <= opt->perf_max; decade *= 10 )
+        {
+            for ( int k = 0; k < 2; k++ )
+            {
+                uint64_t n = ( 0 == k ) ? decade : decade * 3;
+                if ( n > opt->perf_max ) break;
+
+                double t0 = hll_bench_now();
+                for ( ; added < n; added++ )
+                {
+                    uint64_t key = hll_bench_key( 0, added );
+                    hll_ctx_add( ctx, (const unsigned char *)&key, sizeof( key ) );
+                }
+                double secs = hll_bench_now() - t0;
+
+                // 只计 上一个点到这个点之间的 add, 基数很小时 次数少 结果只供参考
+                hll_bench_emit( "add", e, opt->precision, n, n - prev, secs, -1 );
+                prev = n;
+
+                if ( 0 != hll_bench_point( opt, e, ctx, n ) )
+                {
+                    hll_ctx_free( ctx );
+                    return -1;
+                }
+            }
+        }
+
+        hll_ctx_free( ctx );
+        fflush( stdout );
+    }
+
+    return 0;
+}
+
+
+
+static int
+hll_bench_serial_bytes( hll_ctx_t * ctx )
+{
+    int       max_bytes = hll_ctx_serial_maxBytes( ctx );
+    uint8_t * buf       = (uint8_t *)malloc( max_bytes > 0 ? max_bytes : 1 );
+    if ( NULL == buf ) return -1;
+
+    int len = hll_ctx_serialize( ctx, buf );
+    free( buf );
+
+    return len;
+}
+
+
+
+/** 稀疏编码 转成稠密的点 */
+static int
+hll_bench_promote( const hll_bench_opt_t * opt )
+{
+    for ( int e = 0; e < HLL_BENCH_ENCODINGS; e++ )
+    {
+        unsigned char encoding = hll_bench_encodings[ e ];
+        if ( HLL_SPARSE != encoding && HLL_SPARSE_LIST != encoding ) continue;
+
+        hll_ctx_t * ctx = hll_ctx_create_with_precision( encoding, opt->hash_type, opt->precision );
+        if ( NULL == ctx ) return -1;
+
+        // 已经是稠密的: 精度太低时 创建就直接用稠密编码
+        if ( hll_ctx_encoding( ctx ) != encoding )
+        {
+            printf( "{\"bench\":\"promote\",\"encoding\":\"%s\",\"p\":%d,\"n\":0}\n", hll_bench_names[ e ], opt->precision );
+            hll_ctx_free( ctx );
+            continue;
+        }
+
+        double   before_secs = 0.0;
+        double   promote_ns  = 0.0;
+        int      bytes_before = 0;
+        uint64_t n;
+
+        for ( n = 0; n < opt->perf_max; n++ )
+        {
+            uint64_t key = hll_bench_key( 0, n );
+
+            if ( 0 == ( n & 63 ) ) bytes_before = hll_bench_serial_bytes( ctx );
+
+            double t0 = hll_bench_now();
+            hll_ctx_add( ctx, (const unsigned char *)&key, sizeof( key ) );
+            double t  = hll_bench_now() - t0;
+
+            if ( hll_ctx_encoding( ctx ) != encoding )
+            {
+                promote_ns = t * 1e9;
+                break;
+            }
+            before_secs += t;
+        }
+
+        printf( "{\"bench\":\"promote\",\"encoding\":\"%s\",\"p\":%d,\"n\":%llu,\"promote_ns\":%.0f,"
+                "\"add_ns_before\":%.2f,\"bytes_before\":%d,\"bytes_after\":%d}\n",
+                hll_bench_names[ e ], opt->precision, (unsigned long long)( n + 1 ), promote_ns,
+                ( n > 0 ) ? before_secs * 1e9 / n : 0.0, bytes_before, hll_bench_serial_bytes( ctx ) );
+
+        hll_ctx_free( ctx );
+    }
+
+    fflush( stdout );
+    return 0;
+}
+
+
+
+/** 相对误差: 每种编码 trials 组, 在 1/2/5/10... 各点统计 */
+static int
+hll_bench_error( const hll_bench_opt_t * opt )
+{
+    uint64_t points[ HLL_BENCH_MAX_POINTS ];
+    int      npoints = 0;
+
+    for ( uint64_t decade = 1; decade <= opt->error_max && npoints + 3 <= HLL_BENCH_MAX_POINTS; decade *= 10 )
+    {
+        if ( decade     <= opt->error_max ) points[ npoints++ ] = decade;
+        if ( decade * 2 <= opt->error_max ) points[ npoints++ ] = decade * 2;
+        if ( decade * 5 <= opt->error_max ) points[ npoints++ ] = decade * 5;
+    }
+
+    double theory = 1.04 / sqrt( (double)( 1ULL << opt->precision ) );
+
+    for ( int e = 0; e < HLL_BENCH_ENCODINGS; e++ )
+    {
+        double sum[ HLL_BENCH_MAX_POINTS ] = { 0 };
+        double sum2[ HLL_BENCH_MAX_POINTS ] = { 0 };
+        double worst[ HLL_BENCH_MAX_POINTS ] = { 0 };
+
+        for ( int t = 0; t < opt->trials; t++ )
+        {
+            hll_ctx_t * ctx = hll_ctx_create_with_precision( hll_bench_encodings[ e ], opt->hash_type, opt->precision );
+            if ( NULL == ctx ) return -1;
+
+            uint64_t added = 0;
+            for ( int k = 0; k < npoints; k++ )
+            {
+                for ( ; added < points[ k ]; added++ )
+                {
+                    uint64_t key = hll_bench_key( t + 1, added );   // 第 0 组留给 perf
+                    hll_ctx_add( ctx, (const unsigned char *)&key, sizeof( key ) );
+                }
+
+                double err = ( (double)hll_ctx_count( ctx ) - (double)points[ k ] ) / (double)points[ k ];
+
+                sum[ k ]  += err;
+                sum2[ k ] += err * err;
+                if ( fabs( err ) > worst[ k ] ) worst[ k ] = fabs( err );
+            }
+
+            hll_ctx_free( ctx );
+        }
+
+        for ( int k = 0; k < npoints; k++ )
+        {
+            printf( "{\"bench\":\"error\",\"encoding\":\"%s\",\"p\":%d,\"n\":%llu,\"trials\":%d,"
+                    "\"mean_rel_err\":%.6f,\"rmse\":%.6f,\"max_abs_err\":%.6f,\"theory\":%.6f}\n",
+                    hll_bench_names[ e ], opt->precision, (unsigned long long)points[ k ], opt->trials,
+                    sum[ k ] / opt->trials, sqrt( sum2[ k ] / opt->trials ), worst[ k ], theory );
+        }
+        fflush( stdout );
+    }
+
+    return 0;
+}
+
+
+
+static void
+hll_bench_usage( const char * prog )
+{
+    fprintf( stderr,
+             "usage: %s [-m perf|promote|error|all] [-p precision] [-H murmur|wyhash]\n"
+             "          [-n perf_max] [-e error_max] [-r trials] [-t min_ms]\n", prog );
+}
+
+
+
+int main( int argc, char ** argv )
+{
+    hll_bench_opt_t opt;
+    const char    * mode = "all";
+    int             c;
+
+    opt.precision = HLL_PRECISION_DEFAULT;
+    opt.hash_type = HLL_HASH_MURMUR64A;
+    opt.perf_max  = 10000000ULL;
+    opt.error_max = 1000000ULL;
+    opt.trials    = 16;
+    opt.min_secs  = 0.02;
+
+    while ( -1 != ( c = getopt( argc, argv, "m:p:H:n:e:r:t:h" ) ) )
+    {
+        switch ( c )
+        {
+        case 'm': mode          = optarg;                              break;
+        case 'p': opt.precision = atoi( optarg );                      break;
+        case 'n': opt.perf_max  = strtoull( optarg, NULL, 10 );        break;
+        case 'e': opt.error_max = strtoull( optarg, NULL, 10 );        break;
+        case 'r': opt.trials    = atoi( optarg );                      break;
+        case 't': opt.min_secs  = atoi( optarg ) / 1000.0;             break;
+        case 'H':
+            if      ( 0 == strcmp( optarg, "murmur" ) ) opt.hash_type = HLL_HASH_MURMUR64A;
+            else if ( 0 == strcmp( optarg, "wyhash" ) ) opt.hash_type = HLL_HASH_WYHASH;
+            else { hll_bench_usage( argv[0] ); return 1; }
+            break;
+        default:
+            hll_bench_usage( argv[0] );
+            return 1;
+        }
+    }
+
+    if ( opt.precision < HLL_PRECISION_MIN || opt.precision > HLL_PRECISION_MAX || opt.trials < 1
+         || opt.perf_max < 1 || opt.perf_max > HLL_BENCH_MAX_N || opt.error_max < 1 || opt.error_max > HLL_BENCH_MAX_N )
+    {
+        hll_bench_usage( argv[0] );
+        return 1;
+    }
+
+    int all = ( 0 == strcmp( mode, "all" ) );
+    int ret = 0;
+
+    if ( 0 == ret && ( all || 0 == strcmp( mode, "promote" ) ) ) ret = hll_bench_promote( &opt );
+    if ( 0 == ret && ( all || 0 == strcmp( mode, "perf" ) ) )    ret = hll_bench_perf( &opt );
+    if ( 0 == ret && ( all || 0 == strcmp( mode, "error" ) ) )   ret = hll_bench_error( &opt );
+
+    if ( 0 != ret ) fprintf( stderr, "benchmark failed\n" );
+
+    return ( 0 == ret ) ? 0 : 1;
+}
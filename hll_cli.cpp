@@ -0,0 +1,517 @@
+/**
+ * 大文件的离线基数统计工具
+ *
+ *      mmap 输入的文件, 按记录边界切成块, 多个线程各自取块 批量添加到自己的对象中, 最后一次性合并;
+ *      也可以合并已有的序列化文件, 并把结果序列化输出, 供后续再合并
+ *
+ *      编译: g++ -O2 -o hll_cli hll_cli.cpp hyperloglog.cpp -lpthread
+ *
+ *      用法: hll_cli [选项] [文件 ...]
+ *          -t N      线程数, 默认 CPU 的个数
+ *          -w N      定长记录, 每条 N 字节; 默认按换行分隔, 空行忽略
+ *          -p N      精度, 默认 14
+ *          -H NAME   hash函数: murmur / wyhash, 默认 murmur
+ *          -m FILE   合并已有的序列化文件 (可以是多个序列化数据首尾相连), 可以指定多次
+ *          -o FILE   把结果序列化输出到 FILE
+ *          -b        序列化时使用 HLL_FORMAT_BLOCK 格式
+ *          -v        在 stderr 输出记录数、耗时、吞吐
+ *
+ *      标准输出 打印估算的基数
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "hyperloglog.h"
+
+
+#define HLL_CLI_CHUNK_BYTES         ( 64ULL << 20 )             /* 一块最大 64M */
+#define HLL_CLI_CHUNK_MIN           ( 1ULL << 20 )
+#define HLL_CLI_CHUNKS_PER_THREAD   4                           /* 块数 至少是线程数的几倍, 让各线程的结束时间接近 */
+#define HLL_CLI_BATCH               256                         /* 一次 hll_ctx_add_batch 的记录数 */
+#define HLL_CLI_MAX_THREADS         256
+#define HLL_CLI_MAX_FILES           1024
+
+
+/** 映射的一个文件 */
+typedef struct hll_cli_file_s
+{
+    const char    * path;
+    const uint8_t * data;
+    uint64_t        size;
+} hll_cli_file_t;
+
+
+/** 一块: 文件中 [begin, end) 的范围, 两端都在记录边界上 */
+typedef struct hll_cli_chunk_s
+{
+    const uint8_t * begin;
+    const uint8_t * end;
+} hll_cli_chunk_t;
+
+
+typedef struct hll_cli_job_s
+{
+    hll_cli_chunk_t   * chunks;
+    uint64_t            chunk_num;
+    uint64_t            next;                                   /* 下一个要处理的块, 原子递增 */
+
+    int                 width;                                  /* 0:按换行分隔 */
+    int                 failed;
+} hll_cli_job_t;
+
+
+typedef struct hll_cli_worker_s
+{
+    pthread_t           tid;
+    hll_cli_job_t     * job;
+    hll_ctx_t         * ctx;
+    uint64_t            records;
+} hll_cli_worker_t;
+
+
+
+static double
+hll_cli_now( void )
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+
+/** 映射整个文件, 空文件 data 为 NULL */
+static int
+hll_cli_map( const char * path, hll_cli_file_t * file )
+{
+    struct stat st;
+
+    int fd = open( path, O_RDONLY );
+    if ( fd < 0 ) return -1;
+
+    if ( 0 != fstat( fd, &st ) )
+    {
+        close( fd );
+        return -1;
+    }
+
+    file->path = path;
+    file->data = NULL;
+    file->size = (uint64_t)st.st_size;
+
+    if ( file->size > 0 )
+    {
+        void * data = mmap( NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if ( MAP_FAILED == data )
+        {
+            close( fd );
+            return -1;
+        }
+
+        madvise( data, file->size, MADV_SEQUENTIAL );           // 每个线程顺序读一块, 预读能跟上带宽
+        file->data = (const uint8_t *)data;
+    }
+
+    close( fd );
+    return 0;
+}
+
+
+
+static void
+hll_cli_unmap( hll_cli_file_t * file )
+{
+    if ( NULL != file->data ) munmap( (void *)file->data, file->size );
+    file->data = NULL;
+}
+
+
+
+/** 把 pos 调整到记录的边界上: 定长的 向下取整, 按换行的 移到 pos-1 之后的第一个换行后面 */
+static uint64_t
+hll_cli_align( const hll_cli_file_t * file, uint64_t pos, int width )
+{
+    if ( 0 == pos )          return 0;
+    if ( pos >= file->size ) return file->size;
+
+    if ( width > 0 ) return pos / width * width;
+
+    const uint8_t * nl = (const uint8_t *)memchr( file->data + pos - 1, '\n', file->size - pos + 1 );
+
+    return ( NULL == nl ) ? file->size : (uint64_t)( nl - file->data ) + 1;
+}
+
+
+
+/** 所有文件切成块, 返回块的个数, -1 表示失败 */
+static int64_t
+hll_cli_split( hll_cli_file_t * files, int nfiles, int width, int nthreads, hll_cli_chunk_t ** out )
+{
+    uint64_t total = 0;
+    for ( int i = 0; i < nfiles; i++ ) total += files[ i ].size;
+
+    uint64_t chunk_bytes = total / ( (uint64_t)nthreads * HLL_CLI_CHUNKS_PER_THREAD );
+    if ( chunk_bytes > HLL_CLI_CHUNK_BYTES ) chunk_bytes = HLL_CLI_CHUNK_BYTES;
+    if ( chunk_bytes < HLL_CLI_CHUNK_MIN )   chunk_bytes = HLL_CLI_CHUNK_MIN;
+    if ( chunk_bytes < (uint64_t)width )     chunk_bytes = width;
+
+    // 定长记录 块的结尾按 width 向下取整, 块的长度 要按取整后的算
+    if ( width > 0 ) chunk_bytes = chunk_bytes / width * width;
+
+    uint64_t max_chunks = nfiles;
+    for ( int i = 0; i < nfiles; i++ ) max_chunks += files[ i ].size / chunk_bytes;
+
+    hll_cli_chunk_t * chunks = (hll_cli_chunk_t *)malloc( max_chunks * sizeof(hll_cli_chunk_t) );
+    if ( NULL == chunks ) return -1;
+
+    int64_t n = 0;
+    for ( int i = 0; i < nfiles; i++ )
+    {
+        hll_cli_file_t * f = files + i;
+        uint64_t begin = 0;
+
+        while ( begin < f->size )
+        {
+            uint64_t end = hll_cli_align( f, begin + chunk_bytes, width );
+
+            // 定长记录 末尾不完整的部分 丢弃
+            if ( width > 0 && end == f->size ) end = f->size / width * width;
+            if ( end <= begin ) break;
+
+            chunks[ n ].begin = f->data + begin;
+            chunks[ n ].end   = f->data + end;
+            n++;
+
+            begin = end;
+        }
+    }
+
+    *out = chunks;
+    return n;
+}
+
+
+
+/** 按换行分隔的一块, 攒够一批 一起添加 */
+static int
+hll_cli_add_lines( hll_cli_worker_t * w, const uint8_t * p, const uint8_t * end )
+{
+    const uint8_t * eles[ HLL_CLI_BATCH ];
+    int             lens[ HLL_CLI_BATCH ];
+    int             n = 0;
+
+    while ( p < end )
+    {
+        const uint8_t * nl = (const uint8_t *)memchr( p, '\n', end - p );
+        if ( NULL == nl ) nl = end;
+
+        if ( nl > p )
+        {
+            eles[ n ] = p;
+            lens[ n ] = (int)( nl - p );
+
+            if ( ++n == HLL_CLI_BATCH )
+            {
+                if ( 0 != hll_ctx_add_batch( w->ctx, eles, lens, n ) ) return -1;
+                w->records += n;
+                n = 0;
+            }
+        }
+
+        p = nl + 1;
+    }
+
+    if ( n > 0 )
+    {
+        if ( 0 != hll_ctx_add_batch( w->ctx, eles, lens, n ) ) return -1;
+        w->records += n;
+    }
+
+    return 0;
+}
+
+
+
+/** 定长的一块, 8/16 字节的 走 hll_ctx_add_fixed */
+static int
+hll_cli_add_fixed( hll_cli_worker_t * w, const uint8_t * p, const uint8_t * end, int width )
+{
+    uint64_t num = ( end - p ) / width;
+
+    while ( num > 0 )
+    {
+        int n = ( num > HLL_CLI_BATCH ) ? HLL_CLI_BATCH : (int)num;
+
+        if ( 8 == width || 16 == width )
+        {
+            if ( 0 != hll_ctx_add_fixed( w->ctx, p, width, n ) ) return -1;
+        }
+        else
+        {
+            const uint8_t * eles[ HLL_CLI_BATCH ];
+            int             lens[ HLL_CLI_BATCH ];
+
+            for ( int i = 0; i < n; i++ )
+            {
+                eles[ i ] = p + (uint64_t)i * width;
+                lens[ i ] = width;
+            }
+            if ( 0 != hll_ctx_add_batch( w->ctx, eles, lens, n ) ) return -1;
+        }
+
+        p          += (uint64_t)n * width;
+        num        -= n;
+        w->records += n;
+    }
+
+    return 0;
+}
+
+
+
+static void *
+hll_cli_worker( void * arg )
+{
+    hll_cli_worker_t * w   = (hll_cli_worker_t *)arg;
+    hll_cli_job_t    * job = w->job;
+
+    for ( ;; )
+    {
+        uint64_t i = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED );
+        if ( i >= job->chunk_num ) break;
+
+        const hll_cli_chunk_t * c = job->chunks + i;
+
+        int ret = ( 0 == job->width ) ? hll_cli_add_lines( w, c->begin, c->end )
+                                      : hll_cli_add_fixed( w, c->begin, c->end, job->width );
+        if ( 0 != ret )
+        {
+            __atomic_store_n( &job->failed, 1, __ATOMIC_RELAXED );
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/** 合并一个序列化文件, 文件中可以是多个序列化数据首尾相连 */
+static int
+hll_cli_merge_file( hll_ctx_t * result, const char * path )
+{
+    hll_cli_file_t file;
+    if ( 0 != hll_cli_map( path, &file ) ) return -1;
+
+    uint64_t pos = 0;
+    while ( pos < file.size )
+    {
+        uint64_t left = file.size - pos;
+        int      used = hll_ctx_fast_merge( result, file.data + pos, ( left > 0x7FFFFFFF ) ? 0x7FFFFFFF : (int)left );
+        if ( used <= 0 ) break;
+
+        pos += used;
+    }
+
+    hll_cli_unmap( &file );
+    return ( pos == file.size && pos > 0 ) ? 0 : -1;
+}
+
+
+
+static int
+hll_cli_write_file( hll_ctx_t * result, const char * path, int format )
+{
+    int max_bytes = hll_ctx_serial_maxBytes( result );
+    if ( max_bytes <= 0 ) return -1;
+
+    uint8_t * buf = (uint8_t *)malloc( max_bytes );
+    if ( NULL == buf ) return -1;
+
+    int   len = hll_ctx_serialize_format( result, buf, format );
+    FILE * fp = ( len > 0 ) ? fopen( path, "wb" ) : NULL;
+    int   ret = -1;
+
+    if ( NULL != fp )
+    {
+        if ( (size_t)len == fwrite( buf, 1, len, fp ) ) ret = 0;
+        if ( 0 != fclose( fp ) ) ret = -1;
+    }
+
+    free( buf );
+    return ret;
+}
+
+
+
+static void
+hll_cli_usage( const char * prog )
+{
+    fprintf( stderr,
+             "usage: %s [-t threads] [-w width] [-p precision] [-H murmur|wyhash]\n"
+             "          [-m sketch]... [-o out] [-b] [-v] [file ...]\n", prog );
+}
+
+
+
+int main( int argc, char ** argv )
+{
+    int           nthreads  = (int)sysconf( _SC_NPROCESSORS_ONLN );
+    int           width     = 0;
+    int           precision = HLL_PRECISION_DEFAULT;
+    unsigned char hash_type = HLL_HASH_MURMUR64A;
+    int           format    = HLL_FORMAT_DEFAULT;
+    int           verbose   = 0;
+    const char  * out_path  = NULL;
+    const char  * merges[ HLL_CLI_MAX_FILES ];
+    int           nmerges   = 0;
+    int           opt;
+
+    while ( -1 != ( opt = getopt( argc, argv, "t:w:p:H:m:o:bvh" ) ) )
+    {
+        switch ( opt )
+        {
+        case 't': nthreads  = atoi( optarg ); break;
+        case 'w': width     = atoi( optarg ); break;
+        case 'p': precision = atoi( optarg ); break;
+        case 'o': out_path  = optarg;         break;
+        case 'b': format    = HLL_FORMAT_BLOCK; break;
+        case 'v': verbose   = 1;              break;
+        case 'H':
+            if      ( 0 == strcmp( optarg, "murmur" ) ) hash_type = HLL_HASH_MURMUR64A;
+            else if ( 0 == strcmp( optarg, "wyhash" ) ) hash_type = HLL_HASH_WYHASH;
+            else { hll_cli_usage( argv[0] ); return 1; }
+            break;
+        case 'm':
+            if ( nmerges == HLL_CLI_MAX_FILES ) { fprintf( stderr, "too many -m\n" ); return 1; }
+            merges[ nmerges++ ] = optarg;
+            break;
+        default:
+            hll_cli_usage( argv[0] );
+            return 1;
+        }
+    }
+
+    int nfiles = argc - optind;
+
+    if ( width < 0 || nfiles > HLL_CLI_MAX_FILES || ( 0 == nfiles && 0 == nmerges ) )
+    {
+        hll_cli_usage( argv[0] );
+        return 1;
+    }
+    if ( nthreads < 1 )                   nthreads = 1;
+    if ( nthreads > HLL_CLI_MAX_THREADS ) nthreads = HLL_CLI_MAX_THREADS;
+
+    hll_ctx_t * result = hll_ctx_create_with_precision( HLL_DENSE, hash_type, precision );
+    if ( NULL == result )
+    {
+        fprintf( stderr, "invalid precision %d\n", precision );
+        return 1;
+    }
+
+    double            start   = hll_cli_now();
+    uint64_t          bytes   = 0;
+    uint64_t          records = 0;
+    int               ret     = 1;
+    hll_cli_file_t  * files   = (hll_cli_file_t *)calloc( nfiles + 1, sizeof(hll_cli_file_t) );
+    hll_cli_worker_t* workers = (hll_cli_worker_t *)calloc( nthreads, sizeof(hll_cli_worker_t) );
+    hll_cli_job_t     job;
+    int               mapped  = 0;
+    int               started = 0;
+
+    memset( &job, 0, sizeof( job ) );
+    job.width = width;
+
+    if ( NULL == files || NULL == workers ) goto done;
+
+    for ( ; mapped < nfiles; mapped++ )
+    {
+        if ( 0 != hll_cli_map( argv[ optind + mapped ], files + mapped ) )
+        {
+            fprintf( stderr, "cannot map %s\n", argv[ optind + mapped ] );
+            goto done;
+        }
+        bytes += files[ mapped ].size;
+    }
+
+    if ( nfiles > 0 )
+    {
+        int64_t n = hll_cli_split( files, nfiles, width, nthreads, &job.chunks );
+        if ( n < 0 ) goto done;
+        job.chunk_num = (uint64_t)n;
+
+        if ( job.chunk_num < (uint64_t)nthreads ) nthreads = ( n > 0 ) ? (int)n : 1;
+
+        // 每个线程一个稠密的对象, 只有 2^p 字节, 一直留在自己核的缓存中
+        hll_ctx_t * ctxs[ HLL_CLI_MAX_THREADS ];
+
+        for ( ; started < nthreads; started++ )
+        {
+            hll_cli_worker_t * w = workers + started;
+
+            w->job = &job;
+            w->ctx = hll_ctx_create_with_precision( HLL_DENSE, hash_type, precision );
+            if ( NULL == w->ctx ) break;
+            if ( 0 != pthread_create( &w->tid, NULL, hll_cli_worker, w ) )
+            {
+                hll_ctx_free( w->ctx );
+                w->ctx = NULL;
+                break;
+            }
+        }
+
+        for ( int i = 0; i < started; i++ )
+        {
+            pthread_join( workers[ i ].tid, NULL );
+            ctxs[ i ] = workers[ i ].ctx;
+            records  += workers[ i ].records;
+        }
+
+        if ( started < nthreads || job.failed ) goto done;
+        if ( 0 != hll_ctx_merge_many( result, ctxs, started ) ) goto done;
+    }
+
+    for ( int i = 0; i < nmerges; i++ )
+    {
+        if ( 0 != hll_cli_merge_file( result, merges[ i ] ) )
+        {
+            fprintf( stderr, "cannot merge %s\n", merges[ i ] );
+            goto done;
+        }
+    }
+
+    if ( NULL != out_path && 0 != hll_cli_write_file( result, out_path, format ) )
+    {
+        fprintf( stderr, "cannot write %s\n", out_path );
+        goto done;
+    }
+
+    printf( "%llu\n", (unsigned long long)hll_ctx_count( result ) );
+
+    if ( verbose )
+    {
+        double secs = hll_cli_now() - start;
+        fprintf( stderr, "records %llu, bytes %llu, threads %d, chunks %llu, %.3f s, %.2f GB/s\n",
+                 (unsigned long long)records, (unsigned long long)bytes, nthreads,
+                 (unsigned long long)job.chunk_num, secs, secs > 0 ? bytes / secs / 1e9 : 0.0 );
+    }
+    ret = 0;
+
+done:
+    for ( int i = 0; i < started; i++ ) hll_ctx_free( workers[ i ].ctx );
+    for ( int i = 0; i < mapped; i++ )  hll_cli_unmap( files + i );
+    free( job.chunks );
+    free( workers );
+    free( files );
+    hll_ctx_free( result );
+
+    return ret;
+}
@@ -0,0 +1,427 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hll_group.h"
+
+
+#define HLL_GROUP_SMALL         6                               /* 条目中 最多直接保存的hash值的个数 */
+#define HLL_GROUP_MIN_SIZE      64
+#define HLL_GROUP_BATCH         64                              /* 批量添加时 一批的个数 */
+
+#define HLL_GROUP_EMPTY         0
+#define HLL_GROUP_EXACT         1                               /* 保存的是 hash值的集合 */
+#define HLL_GROUP_SKETCH        2                               /* 保存的是 hll_ctx_t */
+
+
+/** 一个分组，正好 64 字节 */
+typedef struct hll_group_entry_s
+{
+    uint64_t    key;
+    uint32_t    state;
+    uint32_t    num;                                            /* HLL_GROUP_EXACT 时 hashes 中的个数 */
+
+    union
+    {
+        uint64_t    hashes[ HLL_GROUP_SMALL ];
+        hll_ctx_t * ctx;
+    } u;
+} hll_group_entry_t;
+
+
+struct hll_group_s
+{
+    hll_group_entry_t * table;
+    uint64_t            size;                                   /* 2的幂 */
+    uint64_t            used;
+
+    hll_pool_t        * pool;                                   /* 分组的对象 都从这里创建 */
+    uint8_t             hash_type;
+
+    uint8_t           * buf;                                    /* 序列化用的缓冲 */
+    int                 buf_len;
+};
+
+
+
+/** 64位整数的混合，让连续的 key 在表中 分散开 */
+static inline uint64_t
+hll_group_mix( uint64_t key )
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+
+    return key;
+}
+
+
+
+static hll_group_entry_t *
+hll_group_table_alloc( uint64_t size )
+{
+    void * mem = NULL;
+
+    if ( 0 != posix_memalign( &mem, 64, size * sizeof( hll_group_entry_t ) ) ) return NULL;
+
+    memset( mem, 0, size * sizeof( hll_group_entry_t ) );
+    return (hll_group_entry_t *)mem;
+}
+
+
+
+/** 找到 key 的条目，不存在时 返回应该插入的空条目 */
+static inline hll_group_entry_t *
+hll_group_find( hll_group_entry_t * table, uint64_t mask, uint64_t key, uint64_t mixed )
+{
+    uint64_t pos = mixed & mask;
+
+    for ( ;; )
+    {
+        hll_group_entry_t * entry = table + pos;
+
+        if ( HLL_GROUP_EMPTY == entry->state || entry->key == key ) return entry;
+
+        pos = ( pos + 1 ) & mask;
+    }
+}
+
+
+
+/** 表扩大到 size，条目整体搬过去, 对象的指针不变 */
+static int
+hll_group_resize( hll_group_t * thiz, uint64_t size )
+{
+    hll_group_entry_t * table = hll_group_table_alloc( size );
+    if ( NULL == table ) return -1;
+
+    for ( uint64_t i = 0; i < thiz->size; i++ )
+    {
+        hll_group_entry_t * entry = thiz->table + i;
+        if ( HLL_GROUP_EMPTY == entry->state ) continue;
+
+        *hll_group_find( table, size - 1, entry->key, hll_group_mix( entry->key ) ) = *entry;
+    }
+
+    free( thiz->table );
+    thiz->table = table;
+    thiz->size  = size;
+
+    return 0;
+}
+
+
+
+/** 保证再加入 n 个分组后 负载不超过 50% */
+static inline int
+hll_group_reserve( hll_group_t * thiz, uint64_t n )
+{
+    if ( ( thiz->used + n ) * 2 <= thiz->size ) return 0;
+
+    uint64_t size = thiz->size;
+    while ( ( thiz->used + n ) * 2 > size ) size *= 2;
+
+    return hll_group_resize( thiz, size );
+}
+
+
+
+/** 精确的集合满了，转成 HLL 对象 */
+static int
+hll_group_promote( hll_group_t * thiz, hll_group_entry_t * entry )
+{
+    hll_ctx_t * ctx = hll_pool_ctx_create( thiz->pool, HLL_SPARSE );
+    if ( NULL == ctx ) return -1;
+
+    for ( uint32_t i = 0; i < entry->num; i++ )
+    {
+        if ( -1 == hll_ctx_add_hash( ctx, entry->u.hashes[ i ] ) )
+        {
+            hll_ctx_free( ctx );
+            return -1;
+        }
+    }
+
+    entry->state = HLL_GROUP_SKETCH;
+    entry->num   = 0;
+    entry->u.ctx = ctx;
+
+    return 0;
+}
+
+
+
+/** 向一个已经找到的条目中 添加hash值 */
+static inline int
+hll_group_entry_add( hll_group_t * thiz, hll_group_entry_t * entry, uint64_t key, uint64_t hash )
+{
+    if ( HLL_GROUP_SKETCH == entry->state )
+        return hll_ctx_add_hash( entry->u.ctx, hash );
+
+    if ( HLL_GROUP_EMPTY == entry->state )                  // 新的分组
+    {
+        entry->key   = key;
+        entry->state = HLL_GROUP_EXACT;
+        entry->num   = 0;
+        thiz->used  += 1;
+    }
+
+    for ( uint32_t i = 0; i < entry->num; i++ )
+        if ( entry->u.hashes[ i ] == hash ) return 0;
+
+    if ( entry->num < HLL_GROUP_SMALL )
+    {
+        entry->u.hashes[ entry->num++ ] = hash;
+        return 0;
+    }
+
+    if ( -1 == hll_group_promote( thiz, entry ) ) return -1;
+
+    return hll_ctx_add_hash( entry->u.ctx, hash );
+}
+
+
+
+hll_group_t * hll_group_create( unsigned char hash_type, int precision, uint64_t expect_groups )
+{
+    hll_group_t * thiz = (hll_group_t *)calloc( 1, sizeof(hll_group_t) );
+    if ( NULL == thiz ) return NULL;
+
+    thiz->pool = hll_pool_create( hash_type, precision );
+    if ( NULL == thiz->pool ) goto failed;
+
+    thiz->hash_type = hash_type;
+    thiz->size      = HLL_GROUP_MIN_SIZE;
+    while ( thiz->size < expect_groups * 2 ) thiz->size *= 2;
+
+    thiz->table = hll_group_table_alloc( thiz->size );
+    if ( NULL == thiz->table ) goto failed;
+
+    return thiz;
+
+failed:
+    hll_group_free( thiz );
+    return NULL;
+}
+
+
+
+void hll_group_free( hll_group_t * thiz )
+{
+    if ( NULL == thiz ) return;
+
+    hll_pool_free( thiz->pool );                            // 所有分组的对象 随池一起释放
+    free( thiz->table );
+    free( thiz->buf );
+    free( thiz );
+}
+
+
+
+void hll_group_reset( hll_group_t * thiz )
+{
+    if ( NULL == thiz ) return;
+
+    hll_pool_reset( thiz->pool );
+    memset( thiz->table, 0, thiz->size * sizeof( hll_group_entry_t ) );
+    thiz->used = 0;
+}
+
+
+
+int hll_group_add( hll_group_t * thiz, uint64_t key, const unsigned char * ele, int ele_len )
+{
+    if ( NULL == thiz ) return -1;
+
+    return hll_group_add_hash( thiz, key, hll_ele_hash( thiz->hash_type, ele, ele_len ) );
+}
+
+
+
+int hll_group_add_hash( hll_group_t * thiz, uint64_t key, uint64_t hash )
+{
+    if ( NULL == thiz || -1 == hll_group_reserve( thiz, 1 ) ) return -1;
+
+    hll_group_entry_t * entry = hll_group_find( thiz->table, thiz->size - 1, key, hll_group_mix( key ) );
+
+    return hll_group_entry_add( thiz, entry, key, hash );
+}
+
+
+
+/**
+ * 一批的写入：先预取所有的条目，再逐个写入
+ * 提前预留了整批的空间，中途不会扩表，预取的位置一直有效
+ */
+static int
+hll_group_add_chunk( hll_group_t * thiz, const uint64_t * keys, const uint64_t * hashes, int n )
+{
+    uint64_t mixed[ HLL_GROUP_BATCH ];
+
+    if ( -1 == hll_group_reserve( thiz, n ) ) return -1;
+
+    uint64_t mask = thiz->size - 1;
+
+    for ( int i = 0; i < n; i++ )
+    {
+        mixed[ i ] = hll_group_mix( keys[ i ] );
+        __builtin_prefetch( thiz->table + ( mixed[ i ] & mask ), 1 );
+    }
+
+    int ret = 0;
+
+    for ( int i = 0; i < n; i++ )
+    {
+        hll_group_entry_t * entry = hll_group_find( thiz->table, mask, keys[ i ], mixed[ i ] );
+
+        if ( -1 == hll_group_entry_add( thiz, entry, keys[ i ], hashes[ i ] ) ) ret = -1;
+    }
+
+    return ret;
+}
+
+
+
+int hll_group_add_batch( hll_group_t * thiz, const uint64_t * keys, const uint8_t ** eles, const int * lens, int n )
+{
+    if ( NULL == thiz || NULL == keys || NULL == eles || NULL == lens || n < 0 ) return -1;
+
+    uint64_t hashes[ HLL_GROUP_BATCH ];
+    int      ret = 0;
+
+    for ( int base = 0; base < n; base += HLL_GROUP_BATCH )
+    {
+        int batch = ( n - base < HLL_GROUP_BATCH ) ? n - base : HLL_GROUP_BATCH;
+
+        for ( int i = 0; i < batch; i++ )
+            hashes[ i ] = hll_ele_hash( thiz->hash_type, eles[ base + i ], lens[ base + i ] );
+
+        if ( -1 == hll_group_add_chunk( thiz, keys + base, hashes, batch ) ) ret = -1;
+    }
+
+    return ret;
+}
+
+
+
+int hll_group_add_hash_batch( hll_group_t * thiz, const uint64_t * keys, const uint64_t * hashes, int n )
+{
+    if ( NULL == thiz || NULL == keys || NULL == hashes || n < 0 ) return -1;
+
+    int ret = 0;
+
+    for ( int base = 0; base < n; base += HLL_GROUP_BATCH )
+    {
+        int batch = ( n - base < HLL_GROUP_BATCH ) ? n - base : HLL_GROUP_BATCH;
+
+        if ( -1 == hll_group_add_chunk( thiz, keys + base, hashes + base, batch ) ) ret = -1;
+    }
+
+    return ret;
+}
+
+
+
+static inline uint64_t
+hll_group_entry_count( hll_group_entry_t * entry )
+{
+    if ( HLL_GROUP_SKETCH == entry->state ) return hll_ctx_count( entry->u.ctx );
+
+    return entry->num;                                      // 精确计数
+}
+
+
+
+uint64_t hll_group_count( hll_group_t * thiz, uint64_t key )
+{
+    if ( NULL == thiz ) return 0ULL;
+
+    hll_group_entry_t * entry = hll_group_find( thiz->table, thiz->size - 1, key, hll_group_mix( key ) );
+
+    return ( HLL_GROUP_EMPTY == entry->state ) ? 0ULL : hll_group_entry_count( entry );
+}
+
+
+
+uint64_t hll_group_size( hll_group_t * thiz )
+{
+    if ( NULL == thiz ) return 0ULL;
+
+    return thiz->used;
+}
+
+
+
+int hll_group_count_all( hll_group_t * thiz, hll_group_count_fn fn, void * arg )
+{
+    if ( NULL == thiz || NULL == fn ) return -1;
+
+    for ( uint64_t i = 0; i < thiz->size; i++ )
+    {
+        hll_group_entry_t * entry = thiz->table + i;
+        if ( HLL_GROUP_EMPTY == entry->state ) continue;
+
+        if ( -1 == fn( entry->key, hll_group_entry_count( entry ), arg ) ) return -1;
+    }
+
+    return 0;
+}
+
+
+
+/** 序列化一个分组，精确的集合 先放到一个临时的对象中 */
+static int
+hll_group_entry_serialize( hll_group_t * thiz, hll_group_entry_t * entry )
+{
+    hll_ctx_t * ctx = entry->u.ctx;
+
+    if ( HLL_GROUP_EXACT == entry->state )
+    {
+        ctx = hll_pool_ctx_create( thiz->pool, HLL_SPARSE );
+        if ( NULL == ctx ) return -1;
+
+        for ( uint32_t i = 0; i < entry->num; i++ )
+            hll_ctx_add_hash( ctx, entry->u.hashes[ i ] );
+    }
+
+    int len = hll_ctx_serial_maxBytes( ctx );
+
+    if ( len > thiz->buf_len )
+    {
+        uint8_t * buf = (uint8_t *)realloc( thiz->buf, len );
+
+        if ( NULL == buf ) len = -1;
+        else
+        {
+            thiz->buf     = buf;
+            thiz->buf_len = len;
+        }
+    }
+
+    if ( -1 != len ) len = hll_ctx_serialize( ctx, thiz->buf );
+
+    if ( HLL_GROUP_EXACT == entry->state ) hll_ctx_free( ctx );
+
+    return len;
+}
+
+
+
+int hll_group_serialize_all( hll_group_t * thiz, hll_group_serial_fn fn, void * arg )
+{
+    if ( NULL == thiz || NULL == fn ) return -1;
+
+    for ( uint64_t i = 0; i < thiz->size; i++ )
+    {
+        hll_group_entry_t * entry = thiz->table + i;
+        if ( HLL_GROUP_EMPTY == entry->state ) continue;
+
+        int len = hll_group_entry_serialize( thiz, entry );
+        if ( -1 == len ) return -1;
+
+        if ( -1 == fn( entry->key, thiz->buf, len, arg ) ) return -1;
+    }
+
+    return 0;
+}
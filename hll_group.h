@@ -0,0 +1,95 @@
+#ifndef INCLUDE_HLL_GROUP_H_
+#define INCLUDE_HLL_GROUP_H_
+
+#include <stdint.h>
+#include "hyperloglog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * 分组的基数统计, 相当于 COUNT(DISTINCT x) GROUP BY key
+ *
+ *      分组按 64 位的 key 放在开放寻址的表中, 每个分组占一个 64 字节的条目;
+ *      元素很少的分组 直接在条目中保存最多 6 个不同的 hash值(精确计数), 不申请任何内存;
+ *      超过以后 从内部的对象池中 创建 HLL_SPARSE 的对象, 再由它自己在需要时转成稠密编码
+ *
+ *      所有分组 使用同样的 hash函数和精度. 不是线程安全的
+ */
+typedef struct hll_group_s hll_group_t;
+
+
+/**
+ * 遍历时的回调，返回 -1 时停止遍历
+ */
+typedef int (*hll_group_count_fn)( uint64_t key, uint64_t count, void * arg );
+typedef int (*hll_group_serial_fn)( uint64_t key, const uint8_t * buf, int len, void * arg );
+
+
+/**
+ * 创建
+ *      expect_groups: 预计的分组个数，用于预先分配表的大小, 不确定时 可以填 0
+ *
+ *      返回 NULL:表示失败
+ */
+hll_group_t * hll_group_create( unsigned char hash_type, int precision, uint64_t expect_groups );
+
+/** 释放，同时释放所有分组的对象 */
+void hll_group_free( hll_group_t * group );
+
+/** 清空所有的分组，内存留着 给后面复用 */
+void hll_group_reset( hll_group_t * group );
+
+/**
+ * 给分组 key 添加一个新的值, 分组不存在时 自动创建
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_group_add( hll_group_t * group, uint64_t key, const unsigned char * ele, int ele_len );
+
+/**
+ * 给分组 key 添加一个已经算好的hash值
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_group_add_hash( hll_group_t * group, uint64_t key, uint64_t hash );
+
+/**
+ * 批量添加 n 个 (keys[i], eles[i]) , 效果等同于循环调用 hll_group_add
+ *      先算好一批的hash 并预取对应的条目，再一次性写入
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_group_add_batch( hll_group_t * group, const uint64_t * keys, const uint8_t ** eles, const int * lens, int n );
+
+/**
+ * 批量添加 n 个 (keys[i], hashes[i])
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_group_add_hash_batch( hll_group_t * group, const uint64_t * keys, const uint64_t * hashes, int n );
+
+/** 分组 key 的基数统计的值，分组不存在时 返回0 */
+uint64_t hll_group_count( hll_group_t * group, uint64_t key );
+
+/** 分组的个数 */
+uint64_t hll_group_size( hll_group_t * group );
+
+/**
+ * 遍历所有的分组 和它们的基数统计的值, 顺序不确定
+ *      返回值：-1：表示失败或者被回调停止 0:表示成功
+ */
+int hll_group_count_all( hll_group_t * group, hll_group_count_fn fn, void * arg );
+
+/**
+ * 遍历所有的分组 和它们序列化后的数据, 数据可以用 hll_ctx_unSerialize / hll_ctx_fast_merge 等使用
+ *      buf 只在回调中有效
+ *      返回值：-1：表示失败或者被回调停止 0:表示成功
+ */
+int hll_group_serialize_all( hll_group_t * group, hll_group_serial_fn fn, void * arg );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* INCLUDE_HLL_GROUP_H_ */
@@ -0,0 +1,316 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hll_store.h"
+
+
+#define HLL_STORE_MAGIC             "HLLSTORE"
+#define HLL_STORE_MAGIC_BYTES       8
+#define HLL_STORE_VERSION           1
+
+#define HLL_STORE_HDR_BYTES         4096                        /* 头部独占一个页面 */
+#define HLL_STORE_PAGE              4096
+#define HLL_STORE_ALIGN( n, a )     ( ( (n) + (a) - 1 ) / (a) * (a) )
+#define HLL_STORE_SLOT_ALIGN        64                          /* 槽位按 cache line 对齐 */
+
+
+/** 文件的头部，按原样存放在文件开头 */
+typedef struct hll_store_hdr_s
+{
+    char        magic[ HLL_STORE_MAGIC_BYTES ];
+    uint32_t    version;
+    uint8_t     encoding;
+    uint8_t     hash_type;
+    uint8_t     precision;
+    uint8_t     reserved;
+
+    uint64_t    slot_bytes;                                     /* 每个槽位的大小 */
+    uint64_t    capacity;                                       /* 槽位的个数 */
+    uint64_t    index_size;                                     /* 索引的条数，2的幂, 至少是 capacity 的2倍 */
+    uint64_t    index_off;
+    uint64_t    slots_off;
+    uint64_t    file_bytes;
+
+    uint64_t    num;                                            /* 已经使用的槽位的个数，槽位按顺序分配 */
+} hll_store_hdr_t;
+
+
+/** 索引的一条，slot 是槽位的下标+1, 0 表示空 */
+typedef struct hll_store_entry_s
+{
+    uint64_t    key;
+    uint64_t    slot;
+} hll_store_entry_t;
+
+
+struct hll_store_s
+{
+    int                  fd;
+    uint8_t            * base;                                  /* 整个文件的映射 */
+    uint64_t             file_bytes;
+
+    hll_store_hdr_t    * hdr;
+    hll_store_entry_t  * index;
+    uint8_t            * slots;
+};
+
+
+
+/** 64位整数的混合，让连续的 key 在索引中 分散开 */
+static inline uint64_t
+hll_store_mix( uint64_t key )
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+
+    return key;
+}
+
+
+
+/** 映射 fd 对应的整个文件，并设置好各部分的位置 */
+static hll_store_t *
+hll_store_map( int fd, uint64_t file_bytes )
+{
+    hll_store_t * store = (hll_store_t *)calloc( 1, sizeof(hll_store_t) );
+    if ( NULL == store ) return NULL;
+
+    void * base = mmap( NULL, file_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( MAP_FAILED == base )
+    {
+        free( store );
+        return NULL;
+    }
+
+    madvise( base, file_bytes, MADV_RANDOM );                   // 按 key 随机访问，不需要预读
+
+    store->fd         = fd;
+    store->base       = (uint8_t *)base;
+    store->file_bytes = file_bytes;
+    store->hdr        = (hll_store_hdr_t *)base;
+    store->index      = (hll_store_entry_t *)( store->base + store->hdr->index_off );
+    store->slots      = store->base + store->hdr->slots_off;
+
+    return store;
+}
+
+
+
+hll_store_t * hll_store_create( const char * path, uint64_t capacity, unsigned char encoding,
+                                unsigned char hash_type, int precision )
+{
+    if ( NULL == path || 0 == capacity ) return NULL;
+
+    int slot_bytes = hll_ctx_inplace_bytes( encoding, precision );
+    if ( -1 == slot_bytes ) return NULL;
+
+    uint64_t index_size = 2;
+    while ( index_size < capacity * 2 ) index_size *= 2;        // 负载不超过 50%
+
+    hll_store_hdr_t hdr;
+    memset( &hdr, 0, sizeof( hdr ) );
+
+    memcpy( hdr.magic, HLL_STORE_MAGIC, HLL_STORE_MAGIC_BYTES );
+    hdr.version    = HLL_STORE_VERSION;
+    hdr.encoding   = encoding;
+    hdr.hash_type  = hash_type;
+    hdr.precision  = precision;
+    hdr.slot_bytes = HLL_STORE_ALIGN( (uint64_t)slot_bytes, HLL_STORE_SLOT_ALIGN );
+    hdr.capacity   = capacity;
+    hdr.index_size = index_size;
+    hdr.index_off  = HLL_STORE_HDR_BYTES;
+    hdr.slots_off  = HLL_STORE_ALIGN( hdr.index_off + index_size * sizeof(hll_store_entry_t), HLL_STORE_PAGE );
+    hdr.file_bytes = hdr.slots_off + capacity * hdr.slot_bytes;
+
+    // 提前检查一下 hash函数 等参数
+    hll_ctx_t * probe = hll_ctx_create_with_precision( encoding, hash_type, precision );
+    if ( NULL == probe ) return NULL;
+    hll_ctx_free( probe );
+
+    int fd = open( path, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if ( fd < 0 ) return NULL;
+
+    // ftruncate 扩展出来的部分 都是0，不占磁盘
+    if ( 0 != ftruncate( fd, (off_t)hdr.file_bytes ) ) goto failed;
+
+    {
+        hll_store_t * store = hll_store_map( fd, hdr.file_bytes );
+        if ( NULL == store ) goto failed;
+
+        memcpy( store->hdr, &hdr, sizeof( hdr ) );
+        store->index = (hll_store_entry_t *)( store->base + hdr.index_off );
+        store->slots = store->base + hdr.slots_off;
+
+        return store;
+    }
+
+failed:
+    close( fd );
+    return NULL;
+}
+
+
+
+hll_store_t * hll_store_open( const char * path )
+{
+    if ( NULL == path ) return NULL;
+
+    int fd = open( path, O_RDWR );
+    if ( fd < 0 ) return NULL;
+
+    struct stat st;
+    hll_store_hdr_t hdr;
+
+    if ( 0 != fstat( fd, &st ) || st.st_size < HLL_STORE_HDR_BYTES ) goto failed;
+    if ( (ssize_t)sizeof( hdr ) != pread( fd, &hdr, sizeof( hdr ), 0 ) ) goto failed;
+
+    // 校验头部，槽位大小对不上的 说明是别的版本写的
+    if ( 0 != memcmp( hdr.magic, HLL_STORE_MAGIC, HLL_STORE_MAGIC_BYTES ) ) goto failed;
+    if ( HLL_STORE_VERSION != hdr.version )                                 goto failed;
+    if ( hdr.file_bytes != (uint64_t)st.st_size )                           goto failed;
+    if ( hdr.num > hdr.capacity )                                           goto failed;
+
+    {
+        int slot_bytes = hll_ctx_inplace_bytes( hdr.encoding, hdr.precision );
+
+        if ( -1 == slot_bytes ) goto failed;
+        if ( hdr.slot_bytes != HLL_STORE_ALIGN( (uint64_t)slot_bytes, HLL_STORE_SLOT_ALIGN ) ) goto failed;
+
+        // 索引要能当探测的掩码用: 2的幂, 负载不超过 50%
+        if ( 0 == hdr.index_size || 0 != ( hdr.index_size & ( hdr.index_size - 1 ) ) )        goto failed;
+        if ( hdr.index_size / 2 < hdr.capacity )                                              goto failed;
+
+        // 各段的边界 用除法检查, 损坏的头部 乘法可能溢出
+        if ( hdr.index_off < HLL_STORE_HDR_BYTES || hdr.index_off > hdr.slots_off )           goto failed;
+        if ( 0 != ( hdr.index_off & 7 ) || hdr.slots_off > hdr.file_bytes )                   goto failed;
+        if ( hdr.capacity > ( hdr.file_bytes - hdr.slots_off ) / hdr.slot_bytes )             goto failed;
+        if ( hdr.index_size > ( hdr.slots_off - hdr.index_off ) / sizeof(hll_store_entry_t) ) goto failed;
+
+        hll_store_t * store = hll_store_map( fd, hdr.file_bytes );
+        if ( NULL == store ) goto failed;
+
+        return store;
+    }
+
+failed:
+    close( fd );
+    return NULL;
+}
+
+
+
+void hll_store_close( hll_store_t * store )
+{
+    if ( NULL == store ) return;
+
+    munmap( store->base, store->file_bytes );
+    close( store->fd );
+    free( store );
+}
+
+
+
+int hll_store_sync( hll_store_t * store, int async )
+{
+    if ( NULL == store ) return -1;
+
+    return ( 0 == msync( store->base, store->file_bytes, async ? MS_ASYNC : MS_SYNC ) ) ? 0 : -1;
+}
+
+
+
+hll_ctx_t * hll_store_get( hll_store_t * store, uint64_t key, int create )
+{
+    if ( NULL == store ) return NULL;
+
+    hll_store_hdr_t   * hdr  = store->hdr;
+    uint64_t            mask = hdr->index_size - 1;
+    uint64_t            pos  = hll_store_mix( key ) & mask;
+
+    // 线性探测，负载不超过 50%，一般 1~2 次就能找到
+    for ( ;; )
+    {
+        hll_store_entry_t * entry = store->index + pos;
+
+        if ( 0 == entry->slot ) break;
+
+        if ( entry->key == key )
+        {
+            if ( entry->slot > hdr->num ) return NULL;          // 文件损坏了
+
+            return hll_ctx_attach_inplace( store->slots + ( entry->slot - 1 ) * hdr->slot_bytes, (int)hdr->slot_bytes );
+        }
+
+        pos = ( pos + 1 ) & mask;
+    }
+
+    if ( !create || hdr->num >= hdr->capacity ) return NULL;
+
+    // 新的 key，顺序分配一个槽位, 先初始化槽位 再写索引
+    uint8_t   * mem  = store->slots + hdr->num * hdr->slot_bytes;
+    hll_ctx_t * thiz = hll_ctx_init_inplace( mem, (int)hdr->slot_bytes, hdr->encoding, hdr->hash_type, hdr->precision );
+    if ( NULL == thiz ) return NULL;
+
+    hdr->num += 1;
+
+    store->index[ pos ].key  = key;
+    store->index[ pos ].slot = hdr->num;
+
+    return thiz;
+}
+
+
+
+int hll_store_add( hll_store_t * store, uint64_t key, const unsigned char * ele, int ele_len )
+{
+    hll_ctx_t * thiz = hll_store_get( store, key, 1 );
+    if ( NULL == thiz ) return -1;
+
+    return hll_ctx_add( thiz, ele, ele_len );
+}
+
+
+
+int hll_store_add_hash( hll_store_t * store, uint64_t key, uint64_t hash )
+{
+    hll_ctx_t * thiz = hll_store_get( store, key, 1 );
+    if ( NULL == thiz ) return -1;
+
+    return hll_ctx_add_hash( thiz, hash );
+}
+
+
+
+uint64_t hll_store_count( hll_store_t * store, uint64_t key )
+{
+    hll_ctx_t * thiz = hll_store_get( store, key, 0 );
+    if ( NULL == thiz ) return 0ULL;
+
+    return hll_ctx_count( thiz );
+}
+
+
+
+int hll_store_merge( hll_store_t * store, uint64_t key, hll_ctx_t * for_merge )
+{
+    hll_ctx_t * thiz = hll_store_get( store, key, 1 );
+    if ( NULL == thiz ) return -1;
+
+    return hll_ctx_merge( thiz, for_merge );
+}
+
+
+
+uint64_t hll_store_size( hll_store_t * store )
+{
+    if ( NULL == store ) return 0ULL;
+
+    return store->hdr->num;
+}
@@ -0,0 +1,91 @@
+#ifndef INCLUDE_HLL_STORE_H_
+#define INCLUDE_HLL_STORE_H_
+
+#include <stdint.h>
+#include "hyperloglog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * 基于 mmap 文件的 HyperLogLog 存储，按 64 位的 key 存放大量的对象
+ *
+ *      文件 = 头部 + 开放寻址的索引 + 定长的槽位, 每个槽位是一个 hll_ctx_init_inplace 的对象
+ *      添加/计数/合并 都直接在映射的页面上进行，不需要序列化和反序列化;
+ *      重新打开 只需要 mmap，只有访问到的槽位 才会被读入内存
+ *
+ *      文件是稀疏文件，没写过的页面不占磁盘. HLL_SPARSE 的槽位 在转成稠密前 只会写 1.5K 左右
+ *      容量在创建时确定，满了以后 新的 key 会添加失败
+ *      文件和编译版本相关(槽位中是 hll_ctx_t 结构体)，不能跨版本、跨平台使用
+ *      不是线程安全的
+ */
+typedef struct hll_store_s hll_store_t;
+
+
+/**
+ * 创建，已经存在的文件 会被清空
+ *      capacity : 最多存放的 key 的个数
+ *      encoding : 槽位的编码, HLL_DENSE / HLL_SPARSE / HLL_DENSE_PACKED
+ *
+ *      返回 NULL:表示失败
+ */
+hll_store_t * hll_store_create( const char * path, uint64_t capacity, unsigned char encoding,
+                                unsigned char hash_type, int precision );
+
+/**
+ * 打开一个已经存在的文件
+ *      返回 NULL:表示失败
+ */
+hll_store_t * hll_store_open( const char * path );
+
+/** 关闭，不会主动刷盘, 需要落盘的 先调用 hll_store_sync */
+void hll_store_close( hll_store_t * store );
+
+/**
+ * 检查点: 把修改过的页面 刷到磁盘
+ *      async: 0 等待写完再返回, 1 只发起写 立即返回
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_store_sync( hll_store_t * store, int async );
+
+/**
+ * 获得 key 对应的对象，直接指向映射的页面，关闭之前都有效, 不要调用 hll_ctx_free
+ *      create: 1 不存在时创建
+ *
+ *      返回 NULL:表示 不存在 或者 失败
+ */
+hll_ctx_t * hll_store_get( hll_store_t * store, uint64_t key, int create );
+
+/**
+ * 给 key 添加一个新的值，key 不存在时 自动创建
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_store_add( hll_store_t * store, uint64_t key, const unsigned char * ele, int ele_len );
+
+/**
+ * 给 key 添加一个已经算好的hash值
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_store_add_hash( hll_store_t * store, uint64_t key, uint64_t hash );
+
+/** key 的基数统计的值，key 不存在时 返回0 */
+uint64_t hll_store_count( hll_store_t * store, uint64_t key );
+
+/**
+ * 把 for_merge 合并到 key 中，key 不存在时 自动创建
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_store_merge( hll_store_t * store, uint64_t key, hll_ctx_t * for_merge );
+
+/** 已经存放的 key 的个数 */
+uint64_t hll_store_size( hll_store_t * store );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* INCLUDE_HLL_STORE_H_ */
@@ -0,0 +1,547 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hll_window.h"
+
+
+#define HLL_WINDOW_MAGIC            0x57                        /* 'W' */
+#define HLL_WINDOW_VERSION          1
+
+#define HLL_WINDOW_RANK_BITS        6                           /* 一条记录 = 时间<<6 | 值 */
+#define HLL_WINDOW_RANK_MASK        ( ( 1ULL << HLL_WINDOW_RANK_BITS ) - 1 )
+#define HLL_WINDOW_TS_MAX           ( ( 1ULL << ( 64 - HLL_WINDOW_RANK_BITS ) ) - 1 )
+#define HLL_WINDOW_POOL_MIN         1024
+
+#define HLL_WINDOW_TS( e )          ( (e) >> HLL_WINDOW_RANK_BITS )
+#define HLL_WINDOW_RANK( e )        ( (uint8_t)( (e) & HLL_WINDOW_RANK_MASK ) )
+#define HLL_WINDOW_ENTRY( ts, r )   ( ( (uint64_t)(ts) << HLL_WINDOW_RANK_BITS ) | (r) )
+
+
+/** 一个桶的列表 在 pool 中的位置 */
+typedef struct hll_window_reg_s
+{
+    uint32_t    off;
+    uint8_t     len;
+    uint8_t     cap;                                            /* 0 或者 2的幂 */
+    uint16_t    reserved;
+} hll_window_reg_t;
+
+
+struct hll_window_s
+{
+    uint8_t             hash_type;
+    uint8_t             precision;
+    uint64_t            max_window;
+    uint64_t            last_ts;                                /* 添加过的最新的时间 */
+
+    hll_window_reg_t  * regs;                                   /* 2^p 个桶 */
+
+    uint64_t          * pool;                                   /* 所有桶的列表 连续存放, 列表变长时 挪到末尾 */
+    uint32_t            pool_used;
+    uint32_t            pool_cap;
+    uint32_t            pool_garbage;                           /* 挪走后 留下的空位 */
+};
+
+
+
+/** 和 hyperloglog.cpp 中的 hll_hash_pattern 一样: 桶号 和 末尾连续0的个数+1 */
+static inline uint8_t
+hll_window_pattern( uint64_t hash, int p, uint64_t * index )
+{
+    *index =   hash & ( ( 1ULL << p ) - 1 );
+    hash   >>= p;
+    hash   |=  ( 1ULL << ( 64 - p ) );
+
+    return (uint8_t)( __builtin_ctzll( hash ) + 1 );
+}
+
+
+
+/** 比这个时间更早的记录 已经不在任何窗口内 */
+static inline uint64_t
+hll_window_cutoff( uint64_t now, uint64_t window )
+{
+    return ( now > window ) ? now - window : 0;
+}
+
+
+
+static int
+varint_encode_uint64( uint64_t value, uint8_t * buf )
+{
+    int n = 0;
+
+    while ( value >= 0x80 )
+    {
+        buf[ n++ ] = (uint8_t)( value | 0x80 );
+        value >>= 7;
+    }
+    buf[ n++ ] = (uint8_t)value;
+
+    return n;
+}
+
+
+
+/** 返回读取的字节数，0 表示数据不完整或者超长 */
+static int
+varint_decode_uint64( const uint8_t * buf, int len, uint64_t * value )
+{
+    uint64_t v = 0;
+
+    for ( int i = 0; i < len && i < 10; i++ )
+    {
+        v |= (uint64_t)( buf[ i ] & 0x7F ) << ( 7 * i );
+        if ( 0 == ( buf[ i ] & 0x80 ) )
+        {
+            *value = v;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/**
+ * 把所有桶的列表 按桶号重新紧凑地排一遍, 去掉挪走后留下的空位
+ *      shrink: 1 容量同时收缩到 刚好放下现有的记录
+ */
+static int
+hll_window_compact( hll_window_t * thiz, int shrink )
+{
+    uint32_t  m    = 1U << thiz->precision;
+    uint64_t  need = 0;
+
+    for ( uint32_t i = 0; i < m; i++ )
+    {
+        hll_window_reg_t * reg = thiz->regs + i;
+        uint32_t cap = reg->cap;
+
+        if ( shrink )
+        {
+            cap = 0;
+            if ( reg->len > 0 )
+                for ( cap = 1; cap < reg->len; cap *= 2 ) ;
+        }
+        need += cap;
+    }
+
+    uint32_t  pool_cap = HLL_WINDOW_POOL_MIN;
+    while ( pool_cap < need * 2 ) pool_cap *= 2;                // 留一半 给后面挪动的列表
+
+    uint64_t * pool = (uint64_t *)malloc( (size_t)pool_cap * sizeof(uint64_t) );
+    if ( NULL == pool ) return -1;
+
+    uint32_t used = 0;
+    for ( uint32_t i = 0; i < m; i++ )
+    {
+        hll_window_reg_t * reg = thiz->regs + i;
+
+        if ( shrink )
+        {
+            reg->cap = 0;
+            if ( reg->len > 0 )
+                for ( reg->cap = 1; reg->cap < reg->len; reg->cap *= 2 ) ;
+        }
+
+        memcpy( pool + used, thiz->pool + reg->off, reg->len * sizeof(uint64_t) );
+        reg->off = used;
+        used    += reg->cap;
+    }
+
+    free( thiz->pool );
+    thiz->pool         = pool;
+    thiz->pool_used    = used;
+    thiz->pool_cap     = pool_cap;
+    thiz->pool_garbage = 0;
+
+    return 0;
+}
+
+
+
+/** 给桶的列表 换一个 cap 条的位置, 原来的位置 成为空位 */
+static int
+hll_window_grow( hll_window_t * thiz, hll_window_reg_t * reg, uint32_t cap )
+{
+    if ( thiz->pool_used + cap > thiz->pool_cap )
+    {
+        // 空位较多时 先整理，整理后 pool 至少还剩一半
+        if ( thiz->pool_garbage * 2 >= thiz->pool_used )
+        {
+            if ( 0 != hll_window_compact( thiz, 0 ) ) return -1;
+        }
+        else
+        {
+            uint32_t   pool_cap = thiz->pool_cap * 2;
+            uint64_t * pool     = (uint64_t *)realloc( thiz->pool, (size_t)pool_cap * sizeof(uint64_t) );
+            if ( NULL == pool ) return -1;
+
+            thiz->pool     = pool;
+            thiz->pool_cap = pool_cap;
+        }
+    }
+
+    memcpy( thiz->pool + thiz->pool_used, thiz->pool + reg->off, reg->len * sizeof(uint64_t) );
+
+    thiz->pool_garbage += reg->cap;
+    reg->off            = thiz->pool_used;
+    reg->cap            = (uint8_t)cap;
+    thiz->pool_used    += cap;
+
+    return 0;
+}
+
+
+
+/**
+ * 桶 index 在时间 ts 出现了值 rank
+ *      列表按时间从旧到新、值严格递减, 插入后 去掉被它覆盖的(更早而且值不更大的) 和 已经过期的
+ *      按时间顺序添加时 只需要看列表的末尾
+ */
+static int
+hll_window_insert( hll_window_t * thiz, uint64_t index, uint8_t rank, uint64_t ts )
+{
+    if ( ts > thiz->last_ts ) thiz->last_ts = ts;
+
+    uint64_t cutoff = hll_window_cutoff( thiz->last_ts, thiz->max_window );
+    if ( ts < cutoff ) return 0;                                // 已经不在任何窗口内
+
+    hll_window_reg_t * reg = thiz->regs + index;
+    uint64_t         * e   = thiz->pool + reg->off;
+    int                len = reg->len;
+
+    // i: 第一条 时间不早于 ts 的; 它之后的值都比它小, 只需要和它比
+    int i = len;
+    while ( i > 0 && HLL_WINDOW_TS( e[ i - 1 ] ) >= ts ) i--;
+
+    if ( i < len && HLL_WINDOW_RANK( e[ i ] ) >= rank ) return 0;
+
+    // [k, i) 比 ts 早而且值不更大, 被覆盖; [0, s) 已经过期
+    int k = i;
+    while ( k > 0 && HLL_WINDOW_RANK( e[ k - 1 ] ) <= rank ) k--;
+
+    int s = 0;
+    while ( s < k && HLL_WINDOW_TS( e[ s ] ) < cutoff ) s++;
+
+    int nlen = ( k - s ) + 1 + ( len - i );
+
+    if ( nlen > reg->cap )
+    {
+        if ( 0 != hll_window_grow( thiz, reg, reg->cap ? reg->cap * 2U : 2U ) ) return -1;
+        e = thiz->pool + reg->off;
+    }
+
+    if ( s > 0 )      memmove( e, e + s, ( k - s ) * sizeof(uint64_t) );
+    if ( i < len )    memmove( e + ( k - s ) + 1, e + i, ( len - i ) * sizeof(uint64_t) );
+
+    e[ k - s ] = HLL_WINDOW_ENTRY( ts, rank );
+    reg->len   = (uint8_t)nlen;
+
+    return 0;
+}
+
+
+
+static hll_window_t *
+hll_window_alloc( unsigned char hash_type, int precision, uint64_t max_window, uint32_t pool_cap )
+{
+    if ( precision < HLL_PRECISION_MIN || precision > HLL_PRECISION_MAX ) return NULL;
+
+    // 提前检查一下 hash函数
+    hll_ctx_t * probe = hll_ctx_create_with_precision( HLL_SPARSE, hash_type, precision );
+    if ( NULL == probe ) return NULL;
+    hll_ctx_free( probe );
+
+    hll_window_t * thiz = (hll_window_t *)calloc( 1, sizeof(hll_window_t) );
+    if ( NULL == thiz ) return NULL;
+
+    thiz->hash_type  = hash_type;
+    thiz->precision  = (uint8_t)precision;
+    thiz->max_window = max_window;
+
+    thiz->regs = (hll_window_reg_t *)calloc( 1U << precision, sizeof(hll_window_reg_t) );
+    if ( NULL == thiz->regs ) goto failed;
+
+    thiz->pool_cap = HLL_WINDOW_POOL_MIN;
+    while ( thiz->pool_cap < pool_cap ) thiz->pool_cap *= 2;
+
+    thiz->pool = (uint64_t *)malloc( (size_t)thiz->pool_cap * sizeof(uint64_t) );
+    if ( NULL == thiz->pool ) goto failed;
+
+    return thiz;
+
+failed:
+    hll_window_free( thiz );
+    return NULL;
+}
+
+
+
+hll_window_t * hll_window_create( unsigned char hash_type, int precision, uint64_t max_window )
+{
+    return hll_window_alloc( hash_type, precision, max_window, 0 );
+}
+
+
+
+void hll_window_free( hll_window_t * thiz )
+{
+    if ( NULL == thiz ) return;
+
+    free( thiz->regs );
+    free( thiz->pool );
+    free( thiz );
+}
+
+
+
+void hll_window_reset( hll_window_t * thiz )
+{
+    if ( NULL == thiz ) return;
+
+    memset( thiz->regs, 0, ( 1U << thiz->precision ) * sizeof(hll_window_reg_t) );
+
+    thiz->last_ts      = 0;
+    thiz->pool_used    = 0;
+    thiz->pool_garbage = 0;
+}
+
+
+
+int hll_window_add( hll_window_t * thiz, const unsigned char * ele, int ele_len, uint64_t ts )
+{
+    if ( NULL == thiz ) return -1;
+
+    return hll_window_add_hash( thiz, hll_ele_hash( thiz->hash_type, ele, ele_len ), ts );
+}
+
+
+
+int hll_window_add_hash( hll_window_t * thiz, uint64_t hash, uint64_t ts )
+{
+    if ( NULL == thiz || ts > HLL_WINDOW_TS_MAX ) return -1;
+
+    uint64_t index;
+    uint8_t  rank = hll_window_pattern( hash, thiz->precision, &index );
+
+    return hll_window_insert( thiz, index, rank, ts );
+}
+
+
+
+void hll_window_expire( hll_window_t * thiz, uint64_t now )
+{
+    if ( NULL == thiz ) return;
+
+    if ( now > thiz->last_ts && now <= HLL_WINDOW_TS_MAX ) thiz->last_ts = now;
+
+    uint64_t cutoff = hll_window_cutoff( thiz->last_ts, thiz->max_window );
+    uint32_t m      = 1U << thiz->precision;
+
+    for ( uint32_t i = 0; i < m; i++ )
+    {
+        hll_window_reg_t * reg = thiz->regs + i;
+        uint64_t         * e   = thiz->pool + reg->off;
+
+        int s = 0;
+        while ( s < reg->len && HLL_WINDOW_TS( e[ s ] ) < cutoff ) s++;
+
+        if ( 0 == s ) continue;
+
+        memmove( e, e + s, ( reg->len - s ) * sizeof(uint64_t) );
+        reg->len -= (uint8_t)s;
+    }
+
+    // 过期后 大部分列表都变短了, 失败时保持原样 不影响使用
+    hll_window_compact( thiz, 1 );
+}
+
+
+
+uint64_t hll_window_count( hll_window_t * thiz, uint64_t now, uint64_t window )
+{
+    if ( NULL == thiz || 0 == window ) return 0ULL;
+
+    if ( window > thiz->max_window ) window = thiz->max_window;
+
+    int      reghisto[ 64 ] = { 0 };
+    uint64_t lo = ( now >= window ) ? now - window + 1 : 0;     // ( now - window, now ]
+    uint32_t m  = 1U << thiz->precision;
+
+    // 每个桶 窗口内的第一条 就是窗口内最大的值
+    for ( uint32_t i = 0; i < m; i++ )
+    {
+        const hll_window_reg_t * reg  = thiz->regs + i;
+        const uint64_t         * e    = thiz->pool + reg->off;
+        uint8_t                  rank = 0;
+
+        for ( int j = 0; j < reg->len; j++ )
+        {
+            if ( HLL_WINDOW_TS( e[ j ] ) >= lo )
+            {
+                rank = HLL_WINDOW_RANK( e[ j ] );
+                break;
+            }
+        }
+
+        reghisto[ rank ]++;
+    }
+
+    return hll_histo_count( reghisto, thiz->precision );
+}
+
+
+
+/**
+ * 序列化的格式:
+ *      magic, version, hash_type, precision, varint(max_window), varint(last_ts), varint(非空的桶数)
+ *      每个非空的桶: varint(和上一个非空桶的 桶号差), 条数,
+ *                   每条 varint(时间差: 第一条和 last_ts 比, 其余和上一条比), 值
+ */
+int hll_window_serial_maxBytes( hll_window_t * thiz )
+{
+    if ( NULL == thiz ) return -1;
+
+    uint32_t m     = 1U << thiz->precision;
+    uint64_t bytes = 4 + 10 + 10 + 5;
+
+    for ( uint32_t i = 0; i < m; i++ )
+    {
+        uint8_t len = thiz->regs[ i ].len;
+        if ( len > 0 ) bytes += 5 + 1 + len * 11ULL;
+    }
+
+    return ( bytes > 0x7FFFFFFF ) ? -1 : (int)bytes;
+}
+
+
+
+int hll_window_serialize( hll_window_t * thiz, uint8_t * buf )
+{
+    if ( NULL == thiz || NULL == buf ) return -1;
+
+    uint32_t m   = 1U << thiz->precision;
+    uint64_t num = 0;
+    int      pos = 0;
+
+    for ( uint32_t i = 0; i < m; i++ )
+        if ( thiz->regs[ i ].len > 0 ) num++;
+
+    buf[ pos++ ] = HLL_WINDOW_MAGIC;
+    buf[ pos++ ] = HLL_WINDOW_VERSION;
+    buf[ pos++ ] = thiz->hash_type;
+    buf[ pos++ ] = thiz->precision;
+    pos += varint_encode_uint64( thiz->max_window, buf + pos );
+    pos += varint_encode_uint64( thiz->last_ts,    buf + pos );
+    pos += varint_encode_uint64( num,              buf + pos );
+
+    uint32_t prev = 0;
+    for ( uint32_t i = 0; i < m; i++ )
+    {
+        const hll_window_reg_t * reg = thiz->regs + i;
+        const uint64_t         * e   = thiz->pool + reg->off;
+
+        if ( 0 == reg->len ) continue;
+
+        pos += varint_encode_uint64( i - prev, buf + pos );
+        buf[ pos++ ] = reg->len;
+        prev = i;
+
+        uint64_t last = thiz->last_ts;
+        for ( int j = 0; j < reg->len; j++ )
+        {
+            uint64_t ts = HLL_WINDOW_TS( e[ j ] );
+
+            pos += varint_encode_uint64( ( 0 == j ) ? last - ts : ts - last, buf + pos );
+            buf[ pos++ ] = HLL_WINDOW_RANK( e[ j ] );
+            last = ts;
+        }
+    }
+
+    return pos;
+}
+
+
+
+hll_window_t * hll_window_unSerialize( const uint8_t * buf, int buf_len, int * read_bytes )
+{
+    if ( NULL == buf || buf_len < 4 ) return NULL;
+    if ( HLL_WINDOW_MAGIC != buf[ 0 ] || HLL_WINDOW_VERSION != buf[ 1 ] ) return NULL;
+
+    int      pos = 4;
+    int      n;
+    uint64_t max_window, last_ts, num;
+
+    if ( 0 == ( n = varint_decode_uint64( buf + pos, buf_len - pos, &max_window ) ) ) return NULL;
+    pos += n;
+    if ( 0 == ( n = varint_decode_uint64( buf + pos, buf_len - pos, &last_ts ) ) )    return NULL;
+    pos += n;
+    if ( 0 == ( n = varint_decode_uint64( buf + pos, buf_len - pos, &num ) ) )        return NULL;
+    pos += n;
+
+    int precision = buf[ 3 ];
+    if ( precision < HLL_PRECISION_MIN || precision > HLL_PRECISION_MAX ) return NULL;
+    if ( last_ts > HLL_WINDOW_TS_MAX || num > ( 1ULL << precision ) )    return NULL;
+
+    hll_window_t * thiz = hll_window_alloc( buf[ 2 ], precision, max_window, (uint32_t)num * 4 );
+    if ( NULL == thiz ) return NULL;
+
+    thiz->last_ts = last_ts;
+
+    uint32_t m       = 1U << precision;
+    uint8_t  max_len = (uint8_t)( 64 - precision + 1 );
+    uint64_t index   = 0;
+
+    for ( uint64_t r = 0; r < num; r++ )
+    {
+        uint64_t gap;
+
+        if ( 0 == ( n = varint_decode_uint64( buf + pos, buf_len - pos, &gap ) ) ) goto failed;
+        pos += n;
+
+        index += gap;
+        if ( index >= m || ( r > 0 && 0 == gap ) || pos >= buf_len ) goto failed;
+
+        hll_window_reg_t * reg = thiz->regs + index;
+        uint8_t            len = buf[ pos++ ];
+        if ( 0 == len || len > max_len ) goto failed;
+
+        uint32_t cap;
+        for ( cap = 1; cap < len; cap *= 2 ) ;
+        if ( 0 != hll_window_grow( thiz, reg, cap ) ) goto failed;
+
+        uint64_t * e    = thiz->pool + reg->off;
+        uint64_t   last = last_ts;
+
+        for ( int j = 0; j < len; j++ )
+        {
+            uint64_t d, ts;
+
+            if ( 0 == ( n = varint_decode_uint64( buf + pos, buf_len - pos, &d ) ) ) goto failed;
+            pos += n;
+            if ( pos >= buf_len ) goto failed;
+
+            // 时间递增 不超过 last_ts, 值严格递减
+            if ( 0 == j ) { if ( d > last ) goto failed;  ts = last - d; }
+            else          { if ( d > last_ts - last ) goto failed;  ts = last + d; }
+
+            uint8_t rank = buf[ pos++ ];
+            if ( 0 == rank || rank > max_len ) goto failed;
+            if ( j > 0 && rank >= HLL_WINDOW_RANK( e[ j - 1 ] ) ) goto failed;
+
+            e[ j ] = HLL_WINDOW_ENTRY( ts, rank );
+            last   = ts;
+        }
+        reg->len = len;
+    }
+
+    if ( NULL != read_bytes ) *read_bytes = pos;
+    return thiz;
+
+failed:
+    hll_window_free( thiz );
+    return NULL;
+}
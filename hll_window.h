@@ -0,0 +1,88 @@
+#ifndef INCLUDE_HLL_WINDOW_H_
+#define INCLUDE_HLL_WINDOW_H_
+
+#include <stdint.h>
+#include "hyperloglog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * 滑动窗口的基数统计, 例如 最近 5/15/60 分钟内的不同元素个数
+ *
+ *      每个桶保存一个 (时间, 末尾0的个数) 的列表: 按时间从旧到新, 值严格递减,
+ *      比它新而且值不小于它的 会把它覆盖掉, 所以列表很短(一般只有几条, 最多 64 - p + 1 条);
+ *      查询窗口 w 时 每个桶取 时间在窗口内的第一条的值 就是窗口内的桶值, 统计一遍直方图即可估算,
+ *      同一个对象 可以回答不超过 max_window 的任意窗口, 不需要按分钟保存对象再合并
+ *
+ *      时间的单位由调用方决定(秒、毫秒都可以), 不能超过 2^58
+ *      时间基本按顺序添加时最快, 乱序的也可以. 不是线程安全的
+ */
+typedef struct hll_window_s hll_window_t;
+
+
+/**
+ * 创建
+ *      max_window: 最长的查询窗口, 比 最新的时间 - max_window 更早的记录 会被淘汰
+ *
+ *      返回 NULL:表示失败
+ */
+hll_window_t * hll_window_create( unsigned char hash_type, int precision, uint64_t max_window );
+
+/** 释放 */
+void hll_window_free( hll_window_t * win );
+
+/** 清空，内存留着 给后面复用 */
+void hll_window_reset( hll_window_t * win );
+
+/**
+ * 在时间 ts 添加一个新的值
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_window_add( hll_window_t * win, const unsigned char * ele, int ele_len, uint64_t ts );
+
+/**
+ * 在时间 ts 添加一个已经算好的hash值
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_window_add_hash( hll_window_t * win, uint64_t hash, uint64_t ts );
+
+/**
+ * 淘汰 早于 now - max_window 的记录, 并收缩内部的内存
+ *      添加时只会顺带淘汰被修改的桶, 长时间运行的 可以定期调用
+ */
+void hll_window_expire( hll_window_t * win, uint64_t now );
+
+/**
+ * 时间在 ( now - window, now ] 内的 不同元素个数的估算值
+ *      window 超过 max_window 时 按 max_window 计算
+ *      now 应该不早于已经添加过的时间, 更晚的记录 可能已经覆盖了更早的
+ */
+uint64_t hll_window_count( hll_window_t * win, uint64_t now, uint64_t window );
+
+/** 获得序列化后的字节最大长度，用于提前准备内存 */
+int hll_window_serial_maxBytes( hll_window_t * win );
+
+/**
+ * 序列化，内部不会检查buf的可写部分，请调用 hll_window_serial_maxBytes 进行保障
+ *      返回值：-1:表示失败  >=0:表示实际输出的字节数
+ */
+int hll_window_serialize( hll_window_t * win, uint8_t * buf );
+
+/**
+ * 反序列化
+ *      read_bytes: 不为 NULL 时 输出读取的字节数
+ *
+ *      返回 NULL:表示失败
+ */
+hll_window_t * hll_window_unSerialize( const uint8_t * buf, int buf_len, int * read_bytes );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* INCLUDE_HLL_WINDOW_H_ */
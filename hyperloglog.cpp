@@ -2,8 +2,14 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "hyperloglog.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HLL_X86_SIMD    1                                       /* 运行时根据cpu选择 sse2/avx2 的实现 */
+#include <immintrin.h>
+#endif
+
 
 #pragma pack(1)
 typedef struct hll_regi_s
@@ -14,50 +20,138 @@ typedef struct hll_regi_s
 #pragma pack()
 
 
+typedef struct hll_slist_s hll_slist_t;
+
+
 struct hll_ctx_s
 {
-    uint8_t     encoding;                                       /* HLL_DENSE or HLL_SPARSE. */
+    uint8_t     encoding;                                       /* HLL_DENSE, HLL_SPARSE, HLL_DENSE_PACKED or HLL_SPARSE_LIST. */
+    uint8_t     dense_encoding;                                 /* 稀疏转稠密时 用哪种布局: HLL_DENSE or HLL_DENSE_PACKED */
+    uint8_t     hash_type;                                      /* HLL_HASH_MURMUR64A or HLL_HASH_WYHASH */
+    uint8_t     precision;                                      /* 精度 p, 桶的个数是 2^p */
+    uint8_t     concurrent;                                     /* 1: 多线程并发写入, 桶用CAS更新, 不缓存估算值 */
     int         ele_num;
-    uint8_t   * registers;
+    uint8_t   * registers;                                      /* HLL_DENSE 每个桶一个字节, HLL_DENSE_PACKED 每个桶6bit, 共 2^p 个桶 */
+
+    /* 开启后, 每次修改桶 同步维护直方图, 计数时不再扫描所有桶. 未开启时为 NULL */
+    int       * reghisto;
+
+    /* 开启增量序列化后, 每 HLL_DIRTY_BLOCK 个桶一位, 记录上次检查点之后 被改过的块. 未开启时为 NULL */
+    uint64_t  * dirty;
+
+    uint64_t    card;                                           /* 上一次估算的结果 */
+    uint8_t     card_valid;                                     /* 0: 桶被修改过，需要重新估算 */
 
     /* 总长 512*sizeof(hll_regi_t) ，
      * 拆分成32个子区域，每条放16个元素，只要有一个满了，就转成稠密
      * 假设：hash值是很均匀的 */
     hll_regi_t * regi_arr;
+
+    hll_slist_t * slist;                                        /* HLL_SPARSE_LIST 时使用 */
+
+    uint8_t       mem_type;                                     /* 内存从哪里来: HLL_MEM_HEAP, HLL_MEM_POOL or HLL_MEM_INPLACE */
+    uint8_t       inplace_layout;                               /* HLL_MEM_INPLACE 时 创建时的编码，决定了各部分的位置 */
+    hll_pool_t  * pool;                                         /* HLL_MEM_POOL 时 所属的池 */
 };
 
 
-#define HLL_P                       14                          /* The greater is P, the smaller the error. */
-#define HLL_Q                       50                          /* (64-HLL_P) The number of bits of the hash value used for
+#define HLL_P                       HLL_PRECISION_DEFAULT       /* The greater is P, the smaller the error. */
+#define HLL_Q( p )                  ( 64 - (p) )                /* The number of bits of the hash value used for
                                                                     determining the number of leading zeros. */
-#define HLL_REGISTERS               16384                       /* (1<<HLL_P) With P=14, 16384 registers. */
-#define HLL_P_MASK                  16383                       /* (HLL_REGISTERS-1) Mask to index register. */
+#define HLL_REGISTERS( p )          ( 1L << (p) )               /* With P=14, 16384 registers. */
+#define HLL_P_MASK( p )             ( HLL_REGISTERS( p ) - 1 )  /* Mask to index register. */
+#define HLL_HISTO_SIZE              ( HLL_Q( HLL_PRECISION_MIN ) + 2 )  /* 直方图的长度 按最小的精度准备 */
+#define HLL_RAW_HISTO_SIZE          256                         /* 直接统计外部的数据时 每个字节的值都可能出现 */
 
 #define HLL_BITS                    6                           /* Enough to count up to 63 leading zeroes. */
 #define HLL_REGISTER_MAX            63                          /* ((1<<HLL_BITS)-1) */
 
 #define HLL_ALPHA_INF               0.721347520444481703680     /* constant for 0.5/ln(2) */
 
-#define HLL_SERIAL_SPARSE_MIN       3000
+#define HLL_PACKED_BYTES( p )       ( HLL_REGISTERS( p ) / 4 * 3 )                  /* 每个桶 6bit */
+#define HLL_DENSE_BYTES( enc, p )   ( (enc) == HLL_DENSE_PACKED ? HLL_PACKED_BYTES( p ) : HLL_REGISTERS( p ) )
+
+#define HLL_SERIAL_SPARSE_MIN( p )  ( ( 3000L << (p) ) >> HLL_P )  /* p=14 时是 3000, 按桶的个数等比缩放 */
 #define HLL_SERIAL_SPARSE_BYTES     6144
-#define HLL_SERIAL_DENSE_BYTES      HLL_REGISTERS               /* HLL_REGISTERS * 6 / 8 = 12288 */
 
 #define HLL_MAGIC                   "HLL"
 #define HLL_MAGIC_BYTES             3
 
+/* 序列化头部的编码字节：低4位是编码方式，高4位是hash函数，老数据高4位都是0, 即 MurmurHash64A */
+#define HLL_HDR_ENCODING( b )       ( (b) & 0x0F )
+#define HLL_HDR_HASH( b )           ( ( (b) >> 4 ) & 0x07 )
+#define HLL_HDR_BYTE( enc, hash )   (uint8_t)( (enc) | ( (hash) << 4 ) )
+#define HLL_HDR_PRECISION           0x80                        /* 最高位置1 表示后面跟着1个字节的精度, 默认精度不写 */
+
 #define VARINT32_MAX_BYTES          5
 
+#define HLL_MERGE_TILE              2048                        /* 多路合并时 每次处理的桶数，保证在L1中 */
+#define HLL_TILE( p )               ( HLL_REGISTERS( p ) < HLL_MERGE_TILE ? HLL_REGISTERS( p ) : HLL_MERGE_TILE )
+#define HLL_BATCH_SIZE              64                          /* 批量添加时，每批先算好的hash个数 */
+#define HLL_MURMUR_M                0xc6a4a7935bd1e995ULL
+
 #define HLL_REGI_MAX                512                         /* 总共512个位置 */
 #define HLL_REGI_MAX_BYTES          1536                        /* 总共 1.5K */
 #define HLL_REGI_AREA_NUM           16                          /* 拆成16个子区域 */
 #define HLL_REGI_AREA_SIZE          32                          /* 每个区域32个位置 */
 
+#define HLL_SPARSE_P                25                          /* HLL_SPARSE_LIST 默认的稀疏精度 p' */
+#define HLL_SLIST_TMP               32                          /* 攒够这么多条 再排序合并 */
+#define HLL_SLIST_INIT_BYTES        64                          /* 初始容量，不够时翻倍 */
+#define HLL_SLIST_KEY( e )          ( (e) >> 6 )                /* 条目中的 idx' */
+#define HLL_SLIST_RANK( e )         ( (e) & 0x3F )              /* 条目中的 r' */
+
+#define HLL_IS_DENSE( enc )         ( (enc) == HLL_DENSE || (enc) == HLL_DENSE_PACKED )
+
+#define HLL_MEM_HEAP                0                           /* calloc / free */
+#define HLL_MEM_POOL                1                           /* 从对象池的 slab 中分配 */
+#define HLL_MEM_INPLACE             2                           /* 调用方提供的一整块内存, 各部分的位置是固定的 */
+
+#define HLL_BLK_REGISTERS           0                           /* 对象中 需要单独申请的几块内存 */
+#define HLL_BLK_REGI_ARR            1
+#define HLL_BLK_HISTO               2
+
+#define HLL_ENC_DELTA               4                           /* 序列化头部中的编码: 增量数据, 不是对象的编码 */
+#define HLL_ENC_BLOCK               5                           /* 序列化头部中的编码: 分块的稠密数据, HLL_FORMAT_BLOCK */
+#define HLL_BLOCK_VERSION           1                           /* 分块格式的版本, 紧跟在头部之后 */
+#define HLL_BLOCK_REGS( p )         ( HLL_REGISTERS( p ) < 64 ? HLL_REGISTERS( p ) : 64 )  /* 每块的桶数 */
+#define HLL_BLOCK_SPARSE            7                           /* 块头的位宽是7: 块中只列出非0的桶 */
+#define HLL_BLOCK_BASE_MAX          31                          /* 块头 低5位是基准值 */
+#define HLL_DIRTY_SHIFT             3                           /* 每 8 个桶 一个脏标记 */
+#define HLL_DIRTY_BLOCK             ( 1 << HLL_DIRTY_SHIFT )
+#define HLL_DIRTY_BLOCKS( p )       ( HLL_REGISTERS( p ) >> HLL_DIRTY_SHIFT )
+#define HLL_DIRTY_WORDS( p )        ( ( HLL_DIRTY_BLOCKS( p ) + 63 ) / 64 )
+#define HLL_DIRTY_MARK( d, index )  ( (d)[ (index) >> ( HLL_DIRTY_SHIFT + 6 ) ] |= 1ULL << ( ( (index) >> HLL_DIRTY_SHIFT ) & 63 ) )
+
+#define HLL_ALIGN16( n )            ( ( (n) + 15 ) & ~(long)15 )
+#define HLL_SLAB_CHUNK_BYTES        ( 256 * 1024 )              /* slab 每次向系统申请的大小 */
+
+
+/**
+ * HLL_SPARSE_LIST: HLL++ 风格的稀疏编码
+ *      用更高的精度 p'(默认25) 记录每个元素的 (idx', r')，编码成一个 uint32: idx' << 6 | r'
+ *      data 中按 idx' 有序存放，每条只存和上一条的差值，用 varint 压缩，同一个 idx' 只保留最大的 r'
+ *      新加入的先放在 tmp 中，满了再排序合并进 data; 压缩后超过稠密编码的大小 才转成稠密编码
+ */
+struct hll_slist_s
+{
+    uint8_t     sparse_p;                                       /* 稀疏精度 p' */
+    int         num;                                            /* data 中的条数 */
+    int         bytes;                                          /* data 已使用的字节数 */
+    int         cap;                                            /* data 的容量 */
+    uint8_t   * data;
+
+    int         tmp_num;
+    uint32_t    tmp[ HLL_SLIST_TMP ];                           /* 还没有合并进 data 的条目 */
+};
+
 
 
 /** 私有inline函数，提前做一下声明 */
 int varint_decode_uint32( const uint8_t * buffer, uint32_t * value );
 int varint_encode_uint32 ( uint32_t value, uint8_t * target );
 uint64_t MurmurHash64A( const uint8_t * data, int len );
+uint64_t WyHash64( const uint8_t * data, int len );
 
 
 inline uint64_t
@@ -101,6 +195,95 @@ MurmurHash64A( const uint8_t * data, int len )
 }
 
 
+
+/** 64x64 -> 128 的乘法, 返回高64位和低64位的异或 */
+static inline uint64_t
+wy_mix( uint64_t a, uint64_t b )
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)( r >> 64 );
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t  = rl + ( rm0 << 32 );
+    uint64_t c  = t < rl;
+    uint64_t lo = t + ( rm1 << 32 );
+    c += lo < t;
+    uint64_t hi = rh + ( rm0 >> 32 ) + ( rm1 >> 32 ) + c;
+    return lo ^ hi;
+#endif
+}
+
+
+static inline uint64_t wy_r8( const uint8_t * p ) { uint64_t v; memcpy( &v, p, 8 ); return v; }
+static inline uint64_t wy_r4( const uint8_t * p ) { uint32_t v; memcpy( &v, p, 4 ); return v; }
+
+
+/**
+ * wyhash 风格的hash，短key(<=16字节)只需要 2 次128位乘法，比 MurmurHash64A 快不少
+ * 长key按16字节一轮处理
+ */
+inline uint64_t
+WyHash64( const uint8_t * data, int len )
+{
+    const uint64_t s0 = 0xa0761d6478bd642fULL;
+    const uint64_t s1 = 0xe7037ed1a0b428dbULL;
+
+    uint64_t seed = wy_mix( s0, s1 );
+    uint64_t a, b;
+
+    if ( len <= 16 )
+    {
+        if ( len >= 4 )
+        {
+            int off = ( len >> 3 ) << 2;
+
+            a = ( wy_r4( data ) << 32 )           | wy_r4( data + off );
+            b = ( wy_r4( data + len - 4 ) << 32 ) | wy_r4( data + len - 4 - off );
+        }
+        else if ( len > 0 )
+        {
+            a = ( (uint64_t)data[ 0 ] << 16 ) | ( (uint64_t)data[ len >> 1 ] << 8 ) | data[ len - 1 ];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        const uint8_t * p = data;
+        int             i = len;
+
+        while ( i > 16 )
+        {
+            seed = wy_mix( wy_r8( p ) ^ s1, wy_r8( p + 8 ) ^ seed );
+            p += 16;
+            i -= 16;
+        }
+
+        a = wy_r8( p + i - 16 );
+        b = wy_r8( p + i - 8 );
+    }
+
+    return wy_mix( s1 ^ (uint64_t)len, wy_mix( a ^ s1, b ^ seed ) );
+}
+
+
+
+/** 根据hash类型计算hash，循环中调用时编译器会把这个分支提到循环外 */
+static inline uint64_t
+hll_hash( uint8_t hash_type, const uint8_t * data, int len )
+{
+    if ( HLL_HASH_WYHASH == hash_type )
+        return WyHash64( data, len );
+
+    return MurmurHash64A( data, len );
+}
+
+
 /**
  * 将一个uint32整数 做 varint 编码 输出到 buf中
  *
@@ -236,602 +419,4367 @@ double hllTau( double x )
 }
 
 
-int hll_ctx_regi_arr_to_registers( uint8_t * registers, hll_regi_t * regi_arr )
+/**
+ * 合并的核心函数, 按字节取 max
+ *      merge_count: 写回 dst, 返回被改大的桶的个数
+ *      merge_max  : 只写回 dst, 不统计个数, 用于多路合并时 先在L1里累加
+ *
+ * 有 scalar / sse2 / avx2 三个版本，第一次使用时根据cpu选择，len 不要求对齐
+ *
+ * 6bit紧凑编码的 解包/打包, 每 4 个桶 占 3 个字节, 第 i 个桶占用 [6i, 6i+6) 位
+ *      unpack: 紧凑编码 -> 每个桶一个字节
+ *      pack  : 每个桶一个字节 -> 紧凑编码
+ *
+ * 有 scalar / ssse3 两个版本, nregs 需要是 4 的倍数, 不会越界读写
+ *
+ * 任意位宽的解包, 分块序列化格式中使用, 每 8 个桶 占 width 个字节, 第 i 个桶占用 [width*i, width*i+width) 位
+ *      unpack_bits: 每个桶解出来后 再加上 base, avail 是 src 开始 可以读的字节数(>= nregs*width/8), 多出来的部分可以用来整块的读
+ *
+ * 有 scalar / ssse3 两个版本, nregs 需要是 8 的倍数, width 范围 [1, 6], 不会越界读
+ */
+typedef int  (*hll_merge_count_fn)( uint8_t * dst, const uint8_t * src, long len );
+typedef void (*hll_merge_max_fn)( uint8_t * dst, const uint8_t * src, long len );
+typedef void (*hll_unpack_fn)( uint8_t * dst, const uint8_t * src, long nregs );
+typedef void (*hll_pack_fn)( uint8_t * dst, const uint8_t * src, long nregs );
+typedef void (*hll_unpack_bits_fn)( uint8_t * dst, const uint8_t * src, long nregs, int width, uint8_t base, long avail );
+
+typedef struct hll_kernel_s
 {
-    int  ele_num = 0;
+    hll_merge_count_fn  merge_count;
+    hll_merge_max_fn    merge_max;
+    hll_unpack_fn       unpack;
+    hll_unpack_bits_fn  unpack_bits;
+    hll_pack_fn         pack;
+} hll_kernel_t;
 
-    for ( int i = 0; i < HLL_REGI_MAX; i++ )
+
+static int
+hll_merge_count_scalar( uint8_t * dst, const uint8_t * src, long len )
+{
+    int ele_num0 = 0;
+    int ele_num1 = 0;
+    int ele_num2 = 0;
+    int ele_num3 = 0;
+    long i = 0;
+
+    for ( ; i + 4 <= len; i += 4 )
     {
-        hll_regi_t curr = regi_arr[ i ];
+        uint8_t max0 = dst[ i ];
+        uint8_t val0 = src[ i ];
 
-        if ( curr.count == 0 )             continue;       /* count 一定是大于0的 */
-        if ( curr.index >= HLL_REGISTERS ) continue;
-        if ( curr.count <= registers[ curr.index ] ) continue;
+        if ( val0 > max0 )
+        {
+            dst[ i ] = val0;
+            ele_num0 += 1;
+        }
 
-        registers[ curr.index ] = curr.count;
-        ele_num++;
-    }
+        uint8_t max1 = dst[ i + 1 ];
+        uint8_t val1 = src[ i + 1 ];
 
-    return ele_num;
-}
+        if ( val1 > max1 )
+        {
+            dst[ i + 1 ] = val1;
+            ele_num1 += 1;
+        }
 
+        uint8_t max2 = dst[ i + 2 ];
+        uint8_t val2 = src[ i + 2 ];
 
-int hll_ctx_sparse_to_dense( hll_ctx_t * thiz )
-{
-    if ( thiz->encoding == HLL_DENSE ) return 0;
-    if ( thiz->regi_arr == NULL )      return -1;
+        if ( val2 > max2 )
+        {
+            dst[ i + 2 ] = val2;
+            ele_num2 += 1;
+        }
 
-    // 准备一下内存
-    if ( NULL != thiz->registers )
-    {
-        memset( thiz->registers, 0, HLL_REGISTERS );
+        uint8_t max3 = dst[ i + 3 ];
+        uint8_t val3 = src[ i + 3 ];
+
+        if ( val3 > max3 )
+        {
+            dst[ i + 3 ] = val3;
+            ele_num3 += 1;
+        }
     }
-    else
+
+    for ( ; i < len; i++ )
     {
-        thiz->registers = (uint8_t *)calloc( HLL_REGISTERS, sizeof(uint8_t) );
-        if ( NULL == thiz->registers ) goto failed;
+        if ( src[ i ] > dst[ i ] )
+        {
+            dst[ i ] = src[ i ];
+            ele_num0 += 1;
+        }
     }
 
-    // 把已经有的 转换到 registers 里面
-    hll_regi_t * regi_arr = thiz->regi_arr;
-
-    thiz->ele_num  = hll_ctx_regi_arr_to_registers( thiz->registers, regi_arr );
-    thiz->encoding = HLL_DENSE;
-    thiz->regi_arr = NULL;
-
-    free( regi_arr );                                       /* 释放 regi_arr */
-    return 0;
-
-failed:
-    return -1;
+    return ele_num0 + ele_num1 + ele_num2 + ele_num3;
 }
 
 
-
-
-int hll_ctx_add( hll_ctx_t * thiz, const unsigned char * ele, int ele_len )
+static void
+hll_merge_max_scalar( uint8_t * dst, const uint8_t * src, long len )
 {
-    uint64_t hash, index;
-
-    hash = MurmurHash64A( ele, ele_len );
+    for ( long i = 0; i < len; i++ )
+        dst[ i ] = ( src[ i ] > dst[ i ] ) ? src[ i ] : dst[ i ];       // 无分支，编译器可以自动向量化
+}
 
-    index =   hash & HLL_P_MASK;          /* Register index. */
-    hash  >>= HLL_P;                      /* Remove bits used to address the register. */
-    hash  |=  ((uint64_t)1<<HLL_Q);       /* Make sure the loop terminates
-                                             and count will be <= Q+1. */
-    uint64_t  count = 1;                  /* Initialized to 1 since we count the "00000...1" pattern. */
-
-#if __x86_64__
-    __asm__(
-            "bsfq %1, %0\n\t"
-            "jnz 1f\n\t"
-            "movq $-1,%0\n\t"
-            "1:"
-            :"=q"(count):"q"(hash) );
-    count++;
-#else
-    uint64_t bit = 1ULL;
 
-    while ( ( hash & bit) == 0)
-    {
-        count++;
-        bit <<= 1;
-    }
-#endif
+#ifdef HLL_X86_SIMD
 
+__attribute__((target("sse2"))) static int
+hll_merge_count_sse2( uint8_t * dst, const uint8_t * src, long len )
+{
+    int  ele_num = 0;
+    long i       = 0;
 
-set_regi:
-    if ( HLL_DENSE == thiz->encoding )                      // 稠密编码
+    for ( ; i + 16 <= len; i += 16 )
     {
-        uint8_t * registers = thiz->registers;
-        uint8_t   oldcount = registers[ index ];
+        __m128i d = _mm_loadu_si128( (const __m128i *)( dst + i ) );
+        __m128i s = _mm_loadu_si128( (const __m128i *)( src + i ) );
+        __m128i m = _mm_max_epu8( d, s );
 
-        if ( count > oldcount )
-        {
-            registers[ index ] = count;
-            thiz->ele_num += 1;                             // 这里的值，基于hash是很平均的，表达桶被设置值的次数
-        }
+        // max 和 dst 不相等的位置，就是被改大的桶
+        ele_num += 16 - __builtin_popcount( _mm_movemask_epi8( _mm_cmpeq_epi8( m, d ) ) );
+        _mm_storeu_si128( (__m128i *)( dst + i ), m );
     }
-    else                                                    // 稀疏编码
-    {
-        hll_regi_t * regi_arr = thiz->regi_arr;
-
-        regi_arr += ( index % HLL_REGI_AREA_NUM ) * HLL_REGI_AREA_SIZE;  // 计算出对应的子区域的第一个起始位置
 
-        int i = 0;
-        for ( ; i < HLL_REGI_AREA_SIZE; i++ )               // 顺序检测这32个位置
-        {
-            hll_regi_t curr = regi_arr[ i ];
+    return ele_num + hll_merge_count_scalar( dst + i, src + i, len - i );
+}
 
-            if ( curr.count == 0 )                          // 空的，追加
-            {
-                regi_arr[ i ].index = index;
-                regi_arr[ i ].count = count;
-                break;
-            }
 
-            if ( curr.index == index )                      // 非空 判断index
-            {
-                if ( curr.count < count )  regi_arr[ i ].count = count;
-                break;
-            }
-        }
+__attribute__((target("sse2"))) static void
+hll_merge_max_sse2( uint8_t * dst, const uint8_t * src, long len )
+{
+    long i = 0;
 
-        if ( i == HLL_REGI_AREA_SIZE )                      // 如果32个位置都满了，这时候需要转换编码方式。
-        {
-            if ( -1 == hll_ctx_sparse_to_dense( thiz ) )
-                return -1;
+    for ( ; i + 16 <= len; i += 16 )
+    {
+        __m128i d = _mm_loadu_si128( (const __m128i *)( dst + i ) );
+        __m128i s = _mm_loadu_si128( (const __m128i *)( src + i ) );
 
-            goto set_regi;
-        }
+        _mm_storeu_si128( (__m128i *)( dst + i ), _mm_max_epu8( d, s ) );
     }
 
-    return 0;
+    hll_merge_max_scalar( dst + i, src + i, len - i );
 }
 
 
-
-uint64_t hll_ctx_count( hll_ctx_t * thiz )
+/** 每轮 64 个桶, 2条 vpmaxub */
+__attribute__((target("avx2"))) static int
+hll_merge_count_avx2( uint8_t * dst, const uint8_t * src, long len )
 {
-    if ( thiz == NULL ) return 0ULL;
-
-    int reghisto[ HLL_Q + 2 ] = {0};
+    int  ele_num = 0;
+    long i       = 0;
 
-    if ( thiz->encoding == HLL_DENSE )                      // 稠密编码
+    for ( ; i + 64 <= len; i += 64 )
     {
-        register uint8_t * registers = thiz->registers;
+        __m256i d0 = _mm256_loadu_si256( (const __m256i *)( dst + i ) );
+        __m256i d1 = _mm256_loadu_si256( (const __m256i *)( dst + i + 32 ) );
+        __m256i m0 = _mm256_max_epu8( d0, _mm256_loadu_si256( (const __m256i *)( src + i ) ) );
+        __m256i m1 = _mm256_max_epu8( d1, _mm256_loadu_si256( (const __m256i *)( src + i + 32 ) ) );
 
-        for ( long i = 0; i < 1024; i++ )                   // 1024 * 16 = HLL_REGISTERS
-        {
-            reghisto[ registers[ 0 ] ]++;
-            reghisto[ registers[ 1 ] ]++;
-            reghisto[ registers[ 2 ] ]++;
-            reghisto[ registers[ 3 ] ]++;
-            reghisto[ registers[ 4 ] ]++;
-            reghisto[ registers[ 5 ] ]++;
-            reghisto[ registers[ 6 ] ]++;
-            reghisto[ registers[ 7 ] ]++;
-            reghisto[ registers[ 8 ] ]++;
-            reghisto[ registers[ 9 ] ]++;
-            reghisto[ registers[ 10 ] ]++;
-            reghisto[ registers[ 11 ] ]++;
-            reghisto[ registers[ 12 ] ]++;
-            reghisto[ registers[ 13 ] ]++;
-            reghisto[ registers[ 14 ] ]++;
-            reghisto[ registers[ 15 ] ]++;
+        uint64_t same = (uint32_t)_mm256_movemask_epi8( _mm256_cmpeq_epi8( m0, d0 ) )
+                      | ( (uint64_t)(uint32_t)_mm256_movemask_epi8( _mm256_cmpeq_epi8( m1, d1 ) ) << 32 );
 
-            registers += 16;
-        }
+        ele_num += 64 - __builtin_popcountll( same );
+
+        _mm256_storeu_si256( (__m256i *)( dst + i ),      m0 );
+        _mm256_storeu_si256( (__m256i *)( dst + i + 32 ), m1 );
     }
-    else                                                        // 稀疏编码
-    {
-        register  hll_regi_t * regi_arr = thiz->regi_arr;
 
-        for ( long i = 0; i < 128; i++ )                        // 128 * 4 = HLL_REGI_MAX
-        {
-            reghisto[ regi_arr[ 0 ].count ]++;
-            reghisto[ regi_arr[ 1 ].count ]++;
-            reghisto[ regi_arr[ 2 ].count ]++;
-            reghisto[ regi_arr[ 3 ].count ]++;
+    return ele_num + hll_merge_count_sse2( dst + i, src + i, len - i );
+}
 
-            regi_arr += 4;
-        }
 
-        reghisto[0] += ( HLL_REGISTERS - HLL_REGI_MAX );
-    }
+__attribute__((target("avx2"))) static void
+hll_merge_max_avx2( uint8_t * dst, const uint8_t * src, long len )
+{
+    long i = 0;
 
-    double E;
-    register double m = HLL_REGISTERS;
-    register double z = m * hllTau( (m - reghisto[ HLL_Q + 1 ]) / (double)m );
+    for ( ; i + 64 <= len; i += 64 )
+    {
+        __m256i m0 = _mm256_max_epu8( _mm256_loadu_si256( (const __m256i *)( dst + i ) ),
+                                      _mm256_loadu_si256( (const __m256i *)( src + i ) ) );
+        __m256i m1 = _mm256_max_epu8( _mm256_loadu_si256( (const __m256i *)( dst + i + 32 ) ),
+                                      _mm256_loadu_si256( (const __m256i *)( src + i + 32 ) ) );
 
-    for (int j = HLL_Q; j >= 1; --j) {
-        z += reghisto[j];
-        z *= 0.5L;
+        _mm256_storeu_si256( (__m256i *)( dst + i ),      m0 );
+        _mm256_storeu_si256( (__m256i *)( dst + i + 32 ), m1 );
     }
 
-    z += m * hllSigma( reghisto[0] / (double)m );
-    E = llroundl( HLL_ALPHA_INF * m * m / z );
-
-    return (uint64_t) E;
+    hll_merge_max_sse2( dst + i, src + i, len - i );
 }
 
+#endif  /* __x86_64__ */
 
 
-hll_ctx_t * hll_ctx_create( unsigned char encoding )
+static void
+hll_unpack_scalar( uint8_t * dst, const uint8_t * src, long nregs )
 {
-    if ( encoding != HLL_DENSE && encoding != HLL_SPARSE )
-        return NULL;
-
-    hll_ctx_t * thiz = (hll_ctx_t *)calloc( 1, sizeof(hll_ctx_t) );
-
-    thiz->ele_num    = 0;
-    thiz->encoding   = encoding;
-    thiz->registers  = NULL;
-    thiz->regi_arr = NULL;
-
-    if ( HLL_SPARSE == encoding )
-    {
-        thiz->regi_arr = (hll_regi_t *)calloc( HLL_REGI_MAX, sizeof(hll_regi_t) );
-        if ( NULL == thiz->regi_arr ) goto failed;
-    }
-
-    if ( HLL_DENSE == encoding )
+    for ( long i = 0; i < nregs; i += 4 )
     {
-        thiz->registers = (uint8_t *)calloc( HLL_REGISTERS, sizeof(uint8_t) );
-        if ( NULL == thiz->registers ) goto failed;
-    }
-
-    return thiz;
+        uint32_t w = src[ 0 ] | ( (uint32_t)src[ 1 ] << 8 ) | ( (uint32_t)src[ 2 ] << 16 );
 
-failed:
-    if ( NULL != thiz->regi_arr )   free( thiz->regi_arr );
-    if ( NULL != thiz->registers )  free( thiz->registers );
-    if ( NULL != thiz )             free( thiz );
+        dst[ 0 ] =   w         & HLL_REGISTER_MAX;
+        dst[ 1 ] = ( w >> 6  ) & HLL_REGISTER_MAX;
+        dst[ 2 ] = ( w >> 12 ) & HLL_REGISTER_MAX;
+        dst[ 3 ] = ( w >> 18 ) & HLL_REGISTER_MAX;
 
-    return NULL;
+        src += 3;
+        dst += 4;
+    }
 }
 
 
-void  hll_ctx_free( hll_ctx_t * thiz )
+static void
+hll_pack_scalar( uint8_t * dst, const uint8_t * src, long nregs )
 {
-    if ( thiz == NULL ) return;
+    for ( long i = 0; i < nregs; i += 4 )
+    {
+        uint32_t w =   (uint32_t)src[ 0 ]
+                   | ( (uint32_t)src[ 1 ] << 6 )
+                   | ( (uint32_t)src[ 2 ] << 12 )
+                   | ( (uint32_t)src[ 3 ] << 18 );
 
-    if ( NULL != thiz->registers ) free( thiz->registers );
-    if ( NULL != thiz->regi_arr )  free( thiz->regi_arr );
+        dst[ 0 ] = (uint8_t)( w );
+        dst[ 1 ] = (uint8_t)( w >> 8 );
+        dst[ 2 ] = (uint8_t)( w >> 16 );
 
-    free( thiz );
+        src += 4;
+        dst += 3;
+    }
 }
 
 
-void  hll_ctx_reset( hll_ctx_t * thiz )
+static void
+hll_unpack_bits_scalar( uint8_t * dst, const uint8_t * src, long nregs, int width, uint8_t base, long avail )
 {
-    if ( thiz == NULL ) return;
+    (void)avail;
 
-    thiz->ele_num = 0;
+    uint64_t mask = ( 1ULL << width ) - 1;
 
-    if ( NULL != thiz->registers )
-        memset( thiz->registers, 0, HLL_REGISTERS );
+    for ( long i = 0; i < nregs; i += 8 )
+    {
+        uint64_t w = 0;
 
-    if ( NULL != thiz->regi_arr )
-        memset( thiz->regi_arr, 0, HLL_REGI_MAX_BYTES );
+        for ( int k = 0; k < width; k++ )                   // 按小端拼起来，和机器的字节序无关
+            w |= (uint64_t)src[ k ] << ( k * 8 );
+
+        for ( int j = 0; j < 8; j++ )
+            dst[ j ] = (uint8_t)( ( ( w >> ( j * width ) ) & mask ) + base );
+
+        src += width;
+        dst += 8;
+    }
+}
+
+
+#ifdef HLL_X86_SIMD
+
+/**
+ * 任意位宽的解包 每个位宽一组常量, 8 个桶的位置 每 width 个字节重复一次
+ *      shuf: 第 j 个桶 所在的 2 个字节, 放到第 j 个 16 位里
+ *      mul : 乘以 2^(16-s-width) 把桶左移到 16 位的最高处(s 是桶在第一个字节中的位置), 再统一右移 16-width 位
+ */
+static const uint8_t hll_bits_shuf[ 7 ][ 16 ] =
+{
+    { 0 },
+    { 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1 },
+    { 0, 1, 0, 1, 0, 1, 0, 1, 1, 2, 1, 2, 1, 2, 1, 2 },
+    { 0, 1, 0, 1, 0, 1, 1, 2, 1, 2, 1, 2, 2, 3, 2, 3 },
+    { 0, 1, 0, 1, 1, 2, 1, 2, 2, 3, 2, 3, 3, 4, 3, 4 },
+    { 0, 1, 0, 1, 1, 2, 1, 2, 2, 3, 3, 4, 3, 4, 4, 5 },
+    { 0, 1, 0, 1, 1, 2, 2, 3, 3, 4, 3, 4, 4, 5, 5, 6 },
+};
+
+static const uint16_t hll_bits_mul[ 7 ][ 8 ] =
+{
+    { 0 },
+    { 32768, 16384, 8192, 4096, 2048, 1024,  512,  256 },
+    { 16384,  4096, 1024,  256, 16384, 4096, 1024,  256 },
+    {  8192,  1024,  128, 4096,  512,   64, 2048,  256 },
+    {  4096,   256, 4096,  256, 4096,  256, 4096,  256 },
+    {  2048,    64,  512,   16,  128, 1024,   32,  256 },
+    {  1024,    16,   64,  256, 1024,   16,   64,  256 },
+};
+
+
+/**
+ * 每轮 16 个桶 <- 2*width 个字节
+ *      一次读 16 个字节，前后两组 8 个桶 用两个 pshufb 分别展开成 16 位，乘法+移位 取出每个桶, 再压回字节
+ *      后面不够 16 个字节可读时，先拷贝到临时的缓冲中 避免越界读
+ */
+__attribute__((target("ssse3"))) static void
+hll_unpack_bits_ssse3( uint8_t * dst, const uint8_t * src, long nregs, int width, uint8_t base, long avail )
+{
+    const __m128i shuf_lo = _mm_loadu_si128( (const __m128i *)hll_bits_shuf[ width ] );
+    const __m128i shuf_hi = _mm_add_epi8( shuf_lo, _mm_set1_epi8( (char)width ) );
+    const __m128i mul     = _mm_loadu_si128( (const __m128i *)hll_bits_mul[ width ] );
+    const __m128i cnt     = _mm_cvtsi32_si128( 16 - width );
+    const __m128i vbase   = _mm_set1_epi8( (char)base );
+    long          i       = 0;
+
+    for ( ; i + 16 <= nregs; i += 16 )
+    {
+        __m128i v;
+
+        if ( avail >= 16 )
+        {
+            v = _mm_loadu_si128( (const __m128i *)src );
+        }
+        else
+        {
+            uint8_t tmp[ 16 ] = { 0 };
+
+            memcpy( tmp, src, 2 * width );
+            v = _mm_loadu_si128( (const __m128i *)tmp );
+        }
+
+        __m128i lo = _mm_srl_epi16( _mm_mullo_epi16( _mm_shuffle_epi8( v, shuf_lo ), mul ), cnt );
+        __m128i hi = _mm_srl_epi16( _mm_mullo_epi16( _mm_shuffle_epi8( v, shuf_hi ), mul ), cnt );
+
+        _mm_storeu_si128( (__m128i *)dst, _mm_add_epi8( _mm_packus_epi16( lo, hi ), vbase ) );
+
+        src   += 2 * width;
+        dst   += 16;
+        avail -= 2 * width;
+    }
+
+    hll_unpack_bits_scalar( dst, src, nregs - i, width, base, avail );
+}
+
+
+/**
+ * 每轮 16 个桶 <-> 12 个字节
+ *      解包: pshufb 把每3个字节放到一个32位里，再用移位把4个6bit分别挪到4个字节上
+ *      打包: 反过来，移位拼成24位, 再用 pshufb 去掉每个32位的最高字节
+ */
+__attribute__((target("ssse3"))) static void
+hll_unpack_ssse3( uint8_t * dst, const uint8_t * src, long nregs )
+{
+    const __m128i shuf = _mm_setr_epi8( 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1 );
+    const __m128i m0   = _mm_set1_epi32( 0x0000003F );
+    const __m128i m1   = _mm_set1_epi32( 0x00003F00 );
+    const __m128i m2   = _mm_set1_epi32( 0x003F0000 );
+    const __m128i m3   = _mm_set1_epi32( 0x3F000000 );
+    long          i    = 0;
+
+    for ( ; i + 16 <= nregs; i += 16 )
+    {
+        uint32_t tail;
+        memcpy( &tail, src + 8, 4 );
+
+        __m128i v = _mm_unpacklo_epi64( _mm_loadl_epi64( (const __m128i *)src ), _mm_cvtsi32_si128( (int)tail ) );
+        __m128i w = _mm_shuffle_epi8( v, shuf );
+
+        __m128i r = _mm_or_si128( _mm_or_si128( _mm_and_si128( w, m0 ),
+                                                _mm_and_si128( _mm_slli_epi32( w, 2 ), m1 ) ),
+                                  _mm_or_si128( _mm_and_si128( _mm_slli_epi32( w, 4 ), m2 ),
+                                                _mm_and_si128( _mm_slli_epi32( w, 6 ), m3 ) ) );
+
+        _mm_storeu_si128( (__m128i *)dst, r );
+
+        src += 12;
+        dst += 16;
+    }
+
+    hll_unpack_scalar( dst, src, nregs - i );
+}
+
+
+__attribute__((target("ssse3"))) static void
+hll_pack_ssse3( uint8_t * dst, const uint8_t * src, long nregs )
+{
+    const __m128i shuf = _mm_setr_epi8( 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1 );
+    const __m128i m0   = _mm_set1_epi32( 0x0000003F );
+    const __m128i m1   = _mm_set1_epi32( 0x00003F00 );
+    const __m128i m2   = _mm_set1_epi32( 0x003F0000 );
+    const __m128i m3   = _mm_set1_epi32( 0x3F000000 );
+    long          i    = 0;
+
+    for ( ; i + 16 <= nregs; i += 16 )
+    {
+        __m128i x = _mm_loadu_si128( (const __m128i *)src );
+
+        __m128i w = _mm_or_si128( _mm_or_si128( _mm_and_si128( x, m0 ),
+                                                _mm_srli_epi32( _mm_and_si128( x, m1 ), 2 ) ),
+                                  _mm_or_si128( _mm_srli_epi32( _mm_and_si128( x, m2 ), 4 ),
+                                                _mm_srli_epi32( _mm_and_si128( x, m3 ), 6 ) ) );
+        __m128i r = _mm_shuffle_epi8( w, shuf );
+
+        uint32_t tail = (uint32_t)_mm_cvtsi128_si32( _mm_srli_si128( r, 8 ) );
+
+        _mm_storel_epi64( (__m128i *)dst, r );
+        memcpy( dst + 8, &tail, 4 );
+
+        src += 16;
+        dst += 12;
+    }
+
+    hll_pack_scalar( dst, src, nregs - i );
+}
+
+#endif  /* HLL_X86_SIMD */
+
+
+/** 第一次调用时按cpu能力选择，多线程同时初始化写入的也是同样的值 */
+static const hll_kernel_t *
+hll_kernel( void )
+{
+    static hll_kernel_t kernel = { NULL, NULL, NULL, NULL, NULL };
+
+    if ( NULL != __atomic_load_n( &kernel.pack, __ATOMIC_ACQUIRE ) )
+        return &kernel;
+
+    hll_kernel_t k = { hll_merge_count_scalar, hll_merge_max_scalar, hll_unpack_scalar, hll_unpack_bits_scalar, hll_pack_scalar };
+
+#ifdef HLL_X86_SIMD
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports( "avx2" ) )
+    {
+        k.merge_count = hll_merge_count_avx2;
+        k.merge_max   = hll_merge_max_avx2;
+    }
+    else if ( __builtin_cpu_supports( "sse2" ) )
+    {
+        k.merge_count = hll_merge_count_sse2;
+        k.merge_max   = hll_merge_max_sse2;
+    }
+
+    if ( __builtin_cpu_supports( "ssse3" ) )
+    {
+        k.unpack      = hll_unpack_ssse3;
+        k.unpack_bits = hll_unpack_bits_ssse3;
+        k.pack        = hll_pack_ssse3;
+    }
+#endif
+
+    kernel.merge_count = k.merge_count;
+    kernel.merge_max   = k.merge_max;
+    kernel.unpack      = k.unpack;
+    kernel.unpack_bits = k.unpack_bits;
+
+    __atomic_store_n( &kernel.pack, k.pack, __ATOMIC_RELEASE );           // 最后写，作为初始化完成的标记
+
+    return &kernel;
+}
+
+
+
+/** 紧凑编码下 读一个桶，4个桶在同一个3字节的组里，不会越界读 */
+static inline uint8_t
+hll_packed_get( const uint8_t * packed, long index )
+{
+    const uint8_t * p = packed + ( index >> 2 ) * 3;
+    uint32_t        w = p[ 0 ] | ( (uint32_t)p[ 1 ] << 8 ) | ( (uint32_t)p[ 2 ] << 16 );
+
+    return ( w >> ( ( index & 3 ) * HLL_BITS ) ) & HLL_REGISTER_MAX;
+}
+
+
+/** 紧凑编码下 写一个桶 */
+static inline void
+hll_packed_set( uint8_t * packed, long index, uint8_t val )
+{
+    uint8_t * p     = packed + ( index >> 2 ) * 3;
+    int       shift = ( index & 3 ) * HLL_BITS;
+    uint32_t  w     = p[ 0 ] | ( (uint32_t)p[ 1 ] << 8 ) | ( (uint32_t)p[ 2 ] << 16 );
+
+    w = ( w & ~( (uint32_t)HLL_REGISTER_MAX << shift ) ) | ( (uint32_t)val << shift );
+
+    p[ 0 ] = (uint8_t)( w );
+    p[ 1 ] = (uint8_t)( w >> 8 );
+    p[ 2 ] = (uint8_t)( w >> 16 );
+}
+
+
+/**
+ * 取出 [off, off+len) 这一块的桶，每个桶一个字节, len 一般是 HLL_TILE( p )
+ *      HLL_DENSE 直接返回 registers 中的位置，HLL_DENSE_PACKED 解包到 tile 中返回
+ *      修改了 tile 的，需要调用 hll_dense_tile_store 写回
+ */
+static inline uint8_t *
+hll_dense_tile( const uint8_t * registers, uint8_t encoding, long off, uint8_t * tile, long len )
+{
+    if ( HLL_DENSE_PACKED != encoding )
+        return (uint8_t *)registers + off;
+
+    hll_kernel()->unpack( tile, registers + off / 4 * 3, len );
+    return tile;
+}
+
+
+static inline void
+hll_dense_tile_store( uint8_t * registers, uint8_t encoding, long off, const uint8_t * tile, long len )
+{
+    if ( HLL_DENSE_PACKED == encoding )
+        hll_kernel()->pack( registers + off / 4 * 3, tile, len );
+}
+
+
+/** 统计 n 个桶的值 到直方图中, n 需要是 16 的倍数 */
+static inline void
+hll_histo_add( int * reghisto, const uint8_t * registers, long n )
+{
+    for ( long i = 0; i < n; i += 16 )
+    {
+        reghisto[ registers[ 0 ] ]++;
+        reghisto[ registers[ 1 ] ]++;
+        reghisto[ registers[ 2 ] ]++;
+        reghisto[ registers[ 3 ] ]++;
+        reghisto[ registers[ 4 ] ]++;
+        reghisto[ registers[ 5 ] ]++;
+        reghisto[ registers[ 6 ] ]++;
+        reghisto[ registers[ 7 ] ]++;
+        reghisto[ registers[ 8 ] ]++;
+        reghisto[ registers[ 9 ] ]++;
+        reghisto[ registers[ 10 ] ]++;
+        reghisto[ registers[ 11 ] ]++;
+        reghisto[ registers[ 12 ] ]++;
+        reghisto[ registers[ 13 ] ]++;
+        reghisto[ registers[ 14 ] ]++;
+        reghisto[ registers[ 15 ] ]++;
+
+        registers += 16;
+    }
+}
+
+
+/** 统计每个值出现的次数，reghisto 需要有 HLL_HISTO_SIZE 个位置 */
+static void
+hll_ctx_histo_build( hll_ctx_t * thiz, int * reghisto )
+{
+    long m    = HLL_REGISTERS( thiz->precision );
+    long tlen = HLL_TILE( thiz->precision );
+
+    memset( reghisto, 0, sizeof(int) * HLL_HISTO_SIZE );
+
+    if ( thiz->concurrent )                                 // 并发写入中，按 64 位的字 原子的读
+    {
+        const uint64_t * words = (const uint64_t *)thiz->registers;
+
+        for ( long i = 0; i < m / 8; i++ )
+        {
+            uint64_t w = __atomic_load_n( words + i, __ATOMIC_RELAXED );
+
+            for ( int j = 0; j < 8; j++, w >>= 8 )
+                reghisto[ w & 0xFF ]++;
+        }
+    }
+    else if ( thiz->encoding == HLL_DENSE )                 // 稠密编码
+    {
+        hll_histo_add( reghisto, thiz->registers, m );
+    }
+    else if ( thiz->encoding == HLL_DENSE_PACKED )          // 紧凑编码，按块解包到L1中统计
+    {
+        uint8_t tile[ HLL_MERGE_TILE ];
+
+        for ( long off = 0; off < m; off += tlen )
+            hll_histo_add( reghisto, hll_dense_tile( thiz->registers, HLL_DENSE_PACKED, off, tile, tlen ), tlen );
+    }
+    else if ( thiz->encoding == HLL_SPARSE_LIST )           // 稀疏列表 用线性计数，不需要直方图
+    {
+        reghisto[ 0 ] = m;
+    }
+    else                                                        // 稀疏编码
+    {
+        register  hll_regi_t * regi_arr = thiz->regi_arr;
+
+        for ( long i = 0; i < 128; i++ )                        // 128 * 4 = HLL_REGI_MAX
+        {
+            reghisto[ regi_arr[ 0 ].count ]++;
+            reghisto[ regi_arr[ 1 ].count ]++;
+            reghisto[ regi_arr[ 2 ].count ]++;
+            reghisto[ regi_arr[ 3 ].count ]++;
+
+            regi_arr += 4;
+        }
+
+        reghisto[0] += ( m - HLL_REGI_MAX );                    // 稀疏编码 只在 m > HLL_REGI_MAX 时使用
+    }
+
+}
+
+
+
+/** 根据直方图 估算基数 */
+static uint64_t
+hll_histo_estimate( const int * reghisto, int p )
+{
+    double E;
+    register int    q = HLL_Q( p );
+    register double m = HLL_REGISTERS( p );
+    register double z = m * hllTau( (m - reghisto[ q + 1 ]) / (double)m );
+
+    for (int j = q; j >= 1; --j) {
+        z += reghisto[j];
+        z *= 0.5L;
+    }
+
+    z += m * hllSigma( reghisto[0] / (double)m );
+    E = llroundl( HLL_ALPHA_INF * m * m / z );
+
+    return (uint64_t) E;
+}
+
+
+
+/** 桶被批量修改后调用：缓存的估算值失效，开启了直方图的 重新统计一遍 */
+static void
+hll_ctx_invalidate( hll_ctx_t * thiz )
+{
+    thiz->card_valid = 0;
+
+    if ( NULL != thiz->reghisto )
+        hll_ctx_histo_build( thiz, thiz->reghisto );
+}
+
+
+
+/**
+ * 精度 src_p 的一个桶 (index, count) 折叠到 较低的精度 dst_p 上
+ *      index 中 dst_p 以上的位 就是原hash中紧接着低精度桶号的那几位, 不全为0 时 count 由它们决定,
+ *      否则 count = (src_p - dst_p) + count. 结果和直接用 dst_p 计算hash的完全一致, count 需要 > 0
+ */
+static inline uint8_t
+hll_fold_regi( uint64_t index, uint8_t count, int src_p, int dst_p, uint64_t * dst_index )
+{
+    uint64_t hi = index >> dst_p;
+
+    *dst_index = index & HLL_P_MASK( dst_p );
+
+    if ( 0 != hi ) return (uint8_t)( __builtin_ctzll( hi ) + 1 );
+
+    return (uint8_t)( src_p - dst_p + count );
+}
+
+
+/** 稠密编码下 取 max 写一个桶，不维护直方图. 返回值：1 被改大了 0 没变 */
+static inline int
+hll_ctx_dense_max( hll_ctx_t * thiz, uint64_t index, uint8_t count )
+{
+    if ( HLL_DENSE == thiz->encoding )
+    {
+        if ( count <= thiz->registers[ index ] ) return 0;
+
+        thiz->registers[ index ] = count;
+        if ( NULL != thiz->dirty ) HLL_DIRTY_MARK( thiz->dirty, index );
+        return 1;
+    }
+
+    if ( count <= hll_packed_get( thiz->registers, index ) ) return 0;
+
+    hll_packed_set( thiz->registers, index, count );
+    if ( NULL != thiz->dirty ) HLL_DIRTY_MARK( thiz->dirty, index );
+    return 1;
+}
+
+
+/** 一块桶被批量修改后, 对比修改前后的值 标记被改过的块, off 和 len 都是 HLL_DIRTY_BLOCK 的倍数 */
+static void
+hll_ctx_dirty_diff( hll_ctx_t * thiz, long off, const uint8_t * old, const uint8_t * cur, long len )
+{
+    for ( long i = 0; i < len; i += HLL_DIRTY_BLOCK )
+        if ( 0 != memcmp( old + i, cur + i, HLL_DIRTY_BLOCK ) )
+            HLL_DIRTY_MARK( thiz->dirty, off + i );
+}
+
+
+/**
+ * 并发写入时 取 max 写一个桶
+ *      桶所在的 64 位的字 用 CAS 更新，只有真的要改大时才写，热点桶写满后 就只剩读了
+ *      返回值：1 被改大了 0 没变
+ */
+static inline int
+hll_atomic_max( uint8_t * registers, uint64_t index, uint8_t count )
+{
+    uint64_t * word  = (uint64_t *)registers + ( index >> 3 );
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    int        shift = ( 7 - ( index & 7 ) ) * 8;
+#else
+    int        shift = ( index & 7 ) * 8;
+#endif
+    uint64_t   old   = __atomic_load_n( word, __ATOMIC_RELAXED );
+
+    for ( ;; )
+    {
+        if ( count <= (uint8_t)( old >> shift ) ) return 0;
+
+        uint64_t val = ( old & ~( (uint64_t)0xFF << shift ) ) | ( (uint64_t)count << shift );
+
+        // 失败时 old 会被更新成最新的值，重新比较
+        if ( __atomic_compare_exchange_n( word, &old, val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+            return 1;
+    }
+}
+
+
+/** 并发写入时 写一个桶, ele_num 用 relaxed 的原子计数 */
+static inline void
+hll_ctx_atomic_set( hll_ctx_t * thiz, uint64_t index, uint8_t count )
+{
+    if ( hll_atomic_max( thiz->registers, index, count ) )
+        __atomic_fetch_add( &thiz->ele_num, 1, __ATOMIC_RELAXED );
+}
+
+
+int hll_ctx_regi_arr_to_registers( uint8_t * registers, hll_regi_t * regi_arr, long m )
+{
+    int  ele_num = 0;
+
+    for ( int i = 0; i < HLL_REGI_MAX; i++ )
+    {
+        hll_regi_t curr = regi_arr[ i ];
+
+        if ( curr.count == 0 )             continue;       /* count 一定是大于0的 */
+        if ( curr.index >= m )             continue;
+        if ( curr.count <= registers[ curr.index ] ) continue;
+
+        registers[ curr.index ] = curr.count;
+        ele_num++;
+    }
+
+    return ele_num;
+}
+
+
+/**
+ * 把精度为 src_p 的稀疏数组 合并到 稠密的 thiz 中，兼容两种稠密布局, 精度更高的 折叠后合并
+ *      返回值：被改大的桶的个数
+ */
+static int
+hll_ctx_merge_regi_arr( hll_ctx_t * thiz, hll_regi_t * regi_arr, int src_p )
+{
+    if ( HLL_DENSE == thiz->encoding && src_p == thiz->precision && NULL == thiz->dirty )
+        return hll_ctx_regi_arr_to_registers( thiz->registers, regi_arr, HLL_REGISTERS( src_p ) );
+
+    int ele_num = 0;
+
+    for ( int i = 0; i < HLL_REGI_MAX; i++ )
+    {
+        hll_regi_t curr  = regi_arr[ i ];
+        uint64_t   index = curr.index;
+        uint8_t    count = curr.count;
+
+        if ( count == 0 )                        continue;
+        if ( index >= (uint64_t)HLL_REGISTERS( src_p ) ) continue;
+
+        if ( src_p != thiz->precision )
+            count = hll_fold_regi( curr.index, curr.count, src_p, thiz->precision, &index );
+
+        ele_num += hll_ctx_dense_max( thiz, index, count );
+    }
+
+    return ele_num;
+}
+
+
+/** 由hash值 计算稀疏列表的条目 */
+static inline uint32_t
+hll_slist_entry( uint64_t hash, int sparse_p )
+{
+    uint64_t idx = hash & ( ( 1ULL << sparse_p ) - 1 );
+    uint64_t w   = ( hash >> sparse_p ) | ( 1ULL << ( 64 - sparse_p ) );       /* 和 hll_hash_pattern 一样 保证不为0 */
+
+    return (uint32_t)( idx << 6 ) | (uint32_t)( __builtin_ctzll( w ) + 1 );
+}
+
+
+/**
+ * 条目 转成 精度为 p 的 (index, count)
+ *      条目就是精度 p' 下的一个桶, 折叠到 p 上即可, 结果和直接用hash计算的完全一致
+ */
+static inline uint8_t
+hll_slist_to_regi( uint32_t entry, int sparse_p, int p, uint64_t * index )
+{
+    return hll_fold_regi( HLL_SLIST_KEY( entry ), HLL_SLIST_RANK( entry ), sparse_p, p, index );
+}
+
+
+/** 构造一个 折叠到精度 p 后 正好是 (index, count) 的条目，用于没有完整hash的场合 */
+static inline uint32_t
+hll_slist_from_regi( uint64_t index, uint8_t count, int sparse_p, int p )
+{
+    if ( count > sparse_p - p )
+        return (uint32_t)( index << 6 ) | (uint32_t)( count - ( sparse_p - p ) );
+
+    return (uint32_t)( ( index | ( 1ULL << ( p + count - 1 ) ) ) << 6 ) | 1;
+}
+
+
+static hll_slist_t *
+hll_slist_create( int sparse_p )
+{
+    hll_slist_t * sl = (hll_slist_t *)calloc( 1, sizeof(hll_slist_t) );
+    if ( NULL == sl ) return NULL;
+
+    sl->data = (uint8_t *)malloc( HLL_SLIST_INIT_BYTES );
+    if ( NULL == sl->data )
+    {
+        free( sl );
+        return NULL;
+    }
+
+    sl->sparse_p = sparse_p;
+    sl->cap      = HLL_SLIST_INIT_BYTES;
+
+    return sl;
+}
+
+
+static void
+hll_slist_free( hll_slist_t * sl )
+{
+    if ( NULL == sl ) return;
+
+    if ( NULL != sl->data ) free( sl->data );
+    free( sl );
+}
+
+
+/**
+ * 把 tmp 排序去重后 和 data 归并，写到一块新的内存中
+ *      返回值：-1：表示失败 0:表示成功
+ */
+static int
+hll_slist_flush( hll_slist_t * sl )
+{
+    int tmp_num = sl->tmp_num;
+
+    if ( 0 == tmp_num ) return 0;
+
+    uint32_t * tmp = sl->tmp;
+
+    for ( int i = 1; i < tmp_num; i++ )                     // 数量很少，插入排序就够了
+    {
+        uint32_t cur = tmp[ i ];
+        int      j   = i - 1;
+
+        while ( j >= 0 && tmp[ j ] > cur )
+        {
+            tmp[ j + 1 ] = tmp[ j ];
+            j--;
+        }
+
+        tmp[ j + 1 ] = cur;
+    }
+
+    int uniq = 0;                                           // 同一个 idx' 排序后 r' 最大的在最后
+    for ( int i = 0; i < tmp_num; i++ )
+    {
+        if ( i + 1 < tmp_num && HLL_SLIST_KEY( tmp[ i ] ) == HLL_SLIST_KEY( tmp[ i + 1 ] ) )
+            continue;
+
+        tmp[ uniq++ ] = tmp[ i ];
+    }
+
+    int cap = sl->cap;
+    while ( cap < sl->bytes + uniq * VARINT32_MAX_BYTES )
+        cap *= 2;
+
+    uint8_t * out = (uint8_t *)malloc( cap );
+    if ( NULL == out ) return -1;
+
+    int      rpos = 0, wpos = 0, left = sl->num, k = 0, num = 0;
+    uint32_t cur  = 0, prev_out = 0, delta = 0;
+
+    if ( left > 0 )
+    {
+        rpos += varint_decode_uint32( sl->data + rpos, &delta );
+        cur   = delta;
+    }
+
+    while ( left > 0 || k < uniq )
+    {
+        uint32_t e;
+
+        if ( left > 0 && ( k >= uniq || HLL_SLIST_KEY( cur ) <= HLL_SLIST_KEY( tmp[ k ] ) ) )
+        {
+            e = cur;
+
+            if ( k < uniq && HLL_SLIST_KEY( cur ) == HLL_SLIST_KEY( tmp[ k ] ) )
+            {
+                if ( tmp[ k ] > e ) e = tmp[ k ];
+                k++;
+            }
+
+            if ( --left > 0 )
+            {
+                rpos += varint_decode_uint32( sl->data + rpos, &delta );
+                cur  += delta;
+            }
+        }
+        else
+        {
+            e = tmp[ k++ ];
+        }
+
+        wpos     += varint_encode_uint32( e - prev_out, out + wpos );
+        prev_out  = e;
+        num++;
+    }
+
+    free( sl->data );
+
+    sl->data    = out;
+    sl->cap     = cap;
+    sl->bytes   = wpos;
+    sl->num     = num;
+    sl->tmp_num = 0;
+
+    return 0;
+}
+
+
+/**
+ * 把稀疏列表 合并到 稠密的 thiz 中, sparse_p 需要 >= thiz 的精度
+ *      data/bytes/num: 压缩的部分, 读到 bytes 为止
+ *      tmp/tmp_num   : 还没有合并的部分, 可以为空
+ *
+ *      返回值：被改大的桶的个数
+ */
+static int
+hll_ctx_merge_slist( hll_ctx_t * thiz, int sparse_p, const uint8_t * data, int bytes, int num,
+                     const uint32_t * tmp, int tmp_num )
+{
+    int      ele_num = 0;
+    int      pos     = 0;
+    uint32_t entry   = 0;
+    uint64_t index;
+
+    for ( int i = 0; i < num && pos < bytes; i++ )
+    {
+        uint32_t delta = 0;
+
+        pos   += varint_decode_uint32( data + pos, &delta );
+        entry += delta;
+
+        uint8_t count = hll_slist_to_regi( entry, sparse_p, thiz->precision, &index );
+        ele_num += hll_ctx_dense_max( thiz, index, count );
+    }
+
+    for ( int i = 0; i < tmp_num; i++ )
+    {
+        uint8_t count = hll_slist_to_regi( tmp[ i ], sparse_p, thiz->precision, &index );
+        ele_num += hll_ctx_dense_max( thiz, index, count );
+    }
+
+    return ele_num;
+}
+
+
+/**
+ * slab: 固定大小的内存块
+ *      向系统按 chunk 申请，chunk 内顺序切分; 释放的块 挂到空闲链表上 优先复用
+ *      reset 时 不归还 chunk，从第一个 chunk 重新开始切分
+ */
+typedef struct hll_slab_s
+{
+    long        size;                                           /* 每块的大小，16字节对齐 */
+    long        chunk_bytes;                                    /* 每个 chunk 可切分的大小 */
+    void      * free_list;                                      /* 释放的块，块的头部存放下一块的指针 */
+    uint8_t   * head;                                           /* chunk 链表, 头部16字节 存放下一个 chunk */
+    uint8_t   * cur;                                            /* 正在切分的 chunk */
+    long        used;                                           /* cur 中已经切分出去的字节数 */
+} hll_slab_t;
+
+
+struct hll_pool_s
+{
+    uint8_t     hash_type;
+    uint8_t     precision;
+
+    hll_slab_t  ctx;                                            /* hll_ctx_t */
+    hll_slab_t  regi_arr;                                       /* 1.5K 的稀疏数组 */
+    hll_slab_t  dense;                                          /* HLL_DENSE 的桶 */
+    hll_slab_t  packed;                                         /* HLL_DENSE_PACKED 的桶 */
+    hll_slab_t  histo;                                          /* 直方图 */
+};
+
+
+#define HLL_CHUNK_NEXT( chunk )     ( *(uint8_t **)(chunk) )
+#define HLL_CHUNK_DATA( chunk )     ( (chunk) + 16 )
+
+
+static void
+hll_slab_init( hll_slab_t * slab, long size )
+{
+    memset( slab, 0, sizeof( hll_slab_t ) );
+
+    slab->size        = HLL_ALIGN16( size );
+    slab->chunk_bytes = ( slab->size > HLL_SLAB_CHUNK_BYTES ) ? slab->size
+                                                              : HLL_SLAB_CHUNK_BYTES / slab->size * slab->size;
+}
+
+
+/** 分配一块清零的内存 */
+static void *
+hll_slab_alloc( hll_slab_t * slab )
+{
+    uint8_t * p = (uint8_t *)slab->free_list;
+
+    if ( NULL != p )
+    {
+        slab->free_list = *(void **)p;
+        memset( p, 0, slab->size );
+        return p;
+    }
+
+    if ( NULL == slab->cur || slab->used + slab->size > slab->chunk_bytes )
+    {
+        uint8_t * next = ( NULL == slab->cur ) ? slab->head : HLL_CHUNK_NEXT( slab->cur );
+
+        if ( NULL == next )                                     // 没有可以复用的 chunk 了
+        {
+            next = (uint8_t *)malloc( 16 + slab->chunk_bytes );
+            if ( NULL == next ) return NULL;
+
+            HLL_CHUNK_NEXT( next ) = NULL;
+
+            if ( NULL == slab->cur ) slab->head = next;
+            else                     HLL_CHUNK_NEXT( slab->cur ) = next;
+        }
+
+        slab->cur  = next;
+        slab->used = 0;
+    }
+
+    p = HLL_CHUNK_DATA( slab->cur ) + slab->used;
+    slab->used += slab->size;
+
+    memset( p, 0, slab->size );
+    return p;
+}
+
+
+static void
+hll_slab_release( hll_slab_t * slab, void * p )
+{
+    *(void **)p     = slab->free_list;
+    slab->free_list = p;
+}
+
+
+/** 所有的块都作废，chunk 留着复用 */
+static void
+hll_slab_reset( hll_slab_t * slab )
+{
+    slab->free_list = NULL;
+    slab->cur       = NULL;
+    slab->used      = 0;
+}
+
+
+static void
+hll_slab_destroy( hll_slab_t * slab )
+{
+    uint8_t * chunk = slab->head;
+
+    while ( NULL != chunk )
+    {
+        uint8_t * next = HLL_CHUNK_NEXT( chunk );
+
+        free( chunk );
+        chunk = next;
+    }
+
+    memset( slab, 0, sizeof( hll_slab_t ) );
+}
+
+
+/** 池中 这一类内存 对应的 slab */
+static hll_slab_t *
+hll_pool_slab( hll_pool_t * pool, int blk, uint8_t encoding )
+{
+    if ( HLL_BLK_REGI_ARR == blk ) return &pool->regi_arr;
+    if ( HLL_BLK_HISTO == blk )    return &pool->histo;
+
+    return ( HLL_DENSE_PACKED == encoding ) ? &pool->packed : &pool->dense;
+}
+
+
+/**
+ * in-place 对象的内存布局: [hll_ctx_t][直方图][稀疏数组 HLL_SPARSE 才有][桶]
+ *      返回值：blk 这一块 相对于开头的偏移
+ */
+static long
+hll_inplace_offset( int blk, uint8_t encoding )
+{
+    long off = HLL_ALIGN16( sizeof( hll_ctx_t ) );
+
+    if ( HLL_BLK_HISTO == blk ) return off;
+    off += HLL_ALIGN16( sizeof(int) * HLL_HISTO_SIZE );
+
+    if ( HLL_BLK_REGI_ARR == blk ) return off;
+    if ( HLL_SPARSE == encoding ) off += HLL_ALIGN16( HLL_REGI_MAX_BYTES );
+
+    return off;
+}
+
+
+/**
+ * 为对象申请一块清零的内存，按对象的来源 分别从 堆/池/预留的位置 获得
+ *      blk: HLL_BLK_REGISTERS 时 encoding 是桶的布局
+ */
+static void *
+hll_ctx_mem_alloc( hll_ctx_t * thiz, int blk, uint8_t encoding, long bytes )
+{
+    if ( HLL_MEM_POOL == thiz->mem_type )
+        return hll_slab_alloc( hll_pool_slab( thiz->pool, blk, encoding ) );
+
+    if ( HLL_MEM_INPLACE == thiz->mem_type )
+    {
+        uint8_t * p = (uint8_t *)thiz + hll_inplace_offset( blk, thiz->inplace_layout );
+
+        memset( p, 0, bytes );
+        return p;
+    }
+
+    return calloc( bytes, sizeof(uint8_t) );
+}
+
+
+static void
+hll_ctx_mem_free( hll_ctx_t * thiz, int blk, uint8_t encoding, void * p )
+{
+    if ( NULL == p ) return;
+
+    if ( HLL_MEM_POOL == thiz->mem_type )
+        hll_slab_release( hll_pool_slab( thiz->pool, blk, encoding ), p );
+    else if ( HLL_MEM_HEAP == thiz->mem_type )
+        free( p );
+}
+
+
+
+int hll_ctx_sparse_to_dense( hll_ctx_t * thiz )
+{
+    if ( HLL_IS_DENSE( thiz->encoding ) ) return 0;
+
+    if ( HLL_SPARSE_LIST == thiz->encoding )
+    {
+        hll_slist_t * sl = thiz->slist;
+
+        thiz->registers = (uint8_t *)hll_ctx_mem_alloc( thiz, HLL_BLK_REGISTERS, thiz->dense_encoding,
+                                                        HLL_DENSE_BYTES( thiz->dense_encoding, thiz->precision ) );
+        if ( NULL == thiz->registers ) return -1;
+
+        thiz->encoding = thiz->dense_encoding;
+        thiz->ele_num  = hll_ctx_merge_slist( thiz, sl->sparse_p, sl->data, sl->bytes, sl->num, sl->tmp, sl->tmp_num );
+        thiz->slist    = NULL;
+
+        hll_slist_free( sl );
+        hll_ctx_invalidate( thiz );                         // 稀疏列表 不维护直方图，这里重建一下
+        return 0;
+    }
+
+    if ( thiz->regi_arr == NULL )       return -1;
+
+    uint8_t      dense    = thiz->dense_encoding;
+    hll_regi_t * regi_arr = thiz->regi_arr;
+
+    // 准备一下内存
+    if ( NULL != thiz->registers )
+    {
+        memset( thiz->registers, 0, HLL_DENSE_BYTES( dense, thiz->precision ) );
+    }
+    else
+    {
+        thiz->registers = (uint8_t *)hll_ctx_mem_alloc( thiz, HLL_BLK_REGISTERS, dense, HLL_DENSE_BYTES( dense, thiz->precision ) );
+        if ( NULL == thiz->registers ) return -1;
+    }
+
+    // 把已经有的 转换到 registers 里面
+    thiz->encoding = dense;
+    thiz->ele_num  = hll_ctx_merge_regi_arr( thiz, regi_arr, thiz->precision );
+    thiz->regi_arr = NULL;
+
+    hll_ctx_mem_free( thiz, HLL_BLK_REGI_ARR, 0, regi_arr );   /* 释放 regi_arr */
+    return 0;
+}
+
+
+
+
+/**
+ * 由hash值 计算出 精度 p 下的 桶号 和 末尾连续0的个数+1
+ *      hash 右移后把第 HLL_Q(p) 位置1，保证一定不为0，count <= HLL_Q(p)+1
+ *      x86上 __builtin_ctzll 在开启 -mbmi 时编译为 tzcnt，否则为 bsf，结果一致
+ */
+static inline uint8_t
+hll_hash_pattern( uint64_t hash, int p, uint64_t * index )
+{
+    *index =   hash & HLL_P_MASK( p );    /* Register index. */
+    hash   >>= p;                         /* Remove bits used to address the register. */
+    hash   |=  ((uint64_t)1<<HLL_Q( p )); /* Make sure the loop terminates
+                                             and count will be <= Q+1. */
+#if defined(__GNUC__)
+    return (uint8_t)( __builtin_ctzll( hash ) + 1 );
+#else
+    uint8_t  count = 1;                   /* Initialized to 1 since we count the "00000...1" pattern. */
+    uint64_t bit   = 1ULL;
+
+    while ( ( hash & bit) == 0)
+    {
+        count++;
+        bit <<= 1;
+    }
+
+    return count;
+#endif
+}
+
+
+
+/**
+ * 稀疏列表中 加入一个条目，攒够了合并一次，超过稠密编码的大小时 转成稠密编码
+ *      返回值：-1：表示失败 0:表示成功
+ */
+static int
+hll_ctx_slist_add( hll_ctx_t * thiz, uint32_t entry )
+{
+    hll_slist_t * sl = thiz->slist;
+
+    sl->tmp[ sl->tmp_num++ ] = entry;
+    thiz->card_valid = 0;
+
+    if ( sl->tmp_num < HLL_SLIST_TMP ) return 0;
+
+    if ( -1 == hll_slist_flush( sl ) ) return -1;
+
+    thiz->ele_num = sl->num;
+
+    if ( sl->bytes > HLL_DENSE_BYTES( thiz->dense_encoding, thiz->precision ) )
+        return hll_ctx_sparse_to_dense( thiz );
+
+    return 0;
+}
+
+
+
+/**
+ * 设置一个桶的值，稀疏编码的子区域满了 会自动转换成稠密编码
+ *      返回值：-1：表示失败 0:表示成功
+ */
+static int
+hll_ctx_set_regi( hll_ctx_t * thiz, uint64_t index, uint8_t count )
+{
+    if ( HLL_SPARSE_LIST == thiz->encoding )                // 没有完整的hash，构造一个等价的条目
+        return hll_ctx_slist_add( thiz, hll_slist_from_regi( index, count, thiz->slist->sparse_p, thiz->precision ) );
+
+    if ( thiz->concurrent )                                 // 并发写入
+    {
+        hll_ctx_atomic_set( thiz, index, count );
+        return 0;
+    }
+
+set_regi:
+    if ( HLL_IS_DENSE( thiz->encoding ) )                   // 稠密编码
+    {
+        uint8_t * registers = thiz->registers;
+        uint8_t   oldcount  = ( HLL_DENSE == thiz->encoding ) ? registers[ index ]
+                                                              : hll_packed_get( registers, index );
+
+        if ( count > oldcount )
+        {
+            if ( HLL_DENSE == thiz->encoding ) registers[ index ] = count;
+            else                               hll_packed_set( registers, index, count );
+
+            thiz->ele_num += 1;                             // 这里的值，基于hash是很平均的，表达桶被设置值的次数
+            thiz->card_valid = 0;
+
+            if ( NULL != thiz->dirty ) HLL_DIRTY_MARK( thiz->dirty, index );
+
+            if ( NULL != thiz->reghisto )
+            {
+                thiz->reghisto[ oldcount ]--;
+                thiz->reghisto[ count ]++;
+            }
+        }
+    }
+    else                                                    // 稀疏编码
+    {
+        hll_regi_t * regi_arr = thiz->regi_arr;
+
+        regi_arr += ( index % HLL_REGI_AREA_NUM ) * HLL_REGI_AREA_SIZE;  // 计算出对应的子区域的第一个起始位置
+
+        int i = 0;
+        for ( ; i < HLL_REGI_AREA_SIZE; i++ )               // 顺序检测这32个位置
+        {
+            hll_regi_t curr = regi_arr[ i ];
+
+            if ( curr.count == 0 || curr.index == index )   // 空的，追加; 非空 判断index
+            {
+                if ( curr.count >= count ) break;
+
+                regi_arr[ i ].index = index;
+                regi_arr[ i ].count = count;
+                thiz->card_valid    = 0;
+
+                if ( NULL != thiz->reghisto )               // 空位置 对应的桶值就是0
+                {
+                    thiz->reghisto[ curr.count ]--;
+                    thiz->reghisto[ count ]++;
+                }
+                break;
+            }
+        }
+
+        if ( i == HLL_REGI_AREA_SIZE )                      // 如果32个位置都满了，这时候需要转换编码方式。
+        {
+            if ( -1 == hll_ctx_sparse_to_dense( thiz ) )
+                return -1;
+
+            goto set_regi;
+        }
+    }
+
+    return 0;
+}
+
+
+
+int hll_ctx_add( hll_ctx_t * thiz, const unsigned char * ele, int ele_len )
+{
+    return hll_ctx_add_hash( thiz, hll_hash( thiz->hash_type, ele, ele_len ) );
+}
+
+
+
+uint64_t hll_ele_hash( unsigned char hash_type, const unsigned char * ele, int ele_len )
+{
+    return hll_hash( hash_type, ele, ele_len );
+}
+
+
+
+uint64_t hll_histo_count( const int * reghisto, int precision )
+{
+    if ( NULL == reghisto ) return 0ULL;
+    if ( precision < HLL_PRECISION_MIN || precision > HLL_PRECISION_MAX ) return 0ULL;
+
+    return hll_histo_estimate( reghisto, precision );
+}
+
+
+
+int hll_ctx_add_hash( hll_ctx_t * thiz, uint64_t hash )
+{
+    if ( HLL_SPARSE_LIST == thiz->encoding )                // 稀疏列表 需要完整的hash
+        return hll_ctx_slist_add( thiz, hll_slist_entry( hash, thiz->slist->sparse_p ) );
+
+    uint64_t index;
+    uint8_t  count = hll_hash_pattern( hash, thiz->precision, &index );
+
+    return hll_ctx_set_regi( thiz, index, count );
+}
+
+
+
+/**
+ * 批量写入桶：先把一批 (index,count) 都算好，再一次性的写进去
+ * 稠密编码走无分支的紧凑循环；稀疏编码逐个写，一旦中途转成了稠密，剩余部分也走稠密的循环
+ */
+static int
+hll_ctx_scatter( hll_ctx_t * thiz, const uint16_t * idx, const uint8_t * cnt, int n )
+{
+    int i = 0;
+
+    if ( thiz->concurrent )                                 // 并发写入，逐个CAS
+    {
+        for ( ; i < n; i++ )
+            hll_ctx_atomic_set( thiz, idx[ i ], cnt[ i ] );
+
+        return 0;
+    }
+
+    while ( i < n && ( HLL_DENSE != thiz->encoding || NULL != thiz->reghisto || NULL != thiz->dirty ) )   // 直方图和脏标记 需要逐个维护
+    {
+        if ( -1 == hll_ctx_set_regi( thiz, idx[ i ], cnt[ i ] ) )
+            return -1;
+
+        i++;
+    }
+
+    uint8_t * registers = thiz->registers;
+    int       ele_num   = 0;
+
+    for ( ; i < n; i++ )
+    {
+        uint8_t old = registers[ idx[ i ] ];
+        uint8_t cur = cnt[ i ];
+
+        ele_num += ( cur > old );
+        registers[ idx[ i ] ] = ( cur > old ) ? cur : old;
+    }
+
+    thiz->ele_num += ele_num;
+    if ( ele_num > 0 ) thiz->card_valid = 0;
+
+    return 0;
+}
+
+
+
+/**
+ * 批量计算 (index, count), 常用的精度 用宏展开成常量移位的版本, 其余的走通用版本
+ *      p <= 16, 桶号用 uint16_t 存放
+ */
+#define HLL_DEFINE_PATTERN_BATCH( name, P )                                             \
+    static void                                                                         \
+    name( int p, const uint64_t * hash, uint16_t * idx, uint8_t * cnt, int n )          \
+    {                                                                                   \
+        (void)p;                                                                        \
+        for ( int i = 0; i < n; i++ )                                                   \
+        {                                                                               \
+            uint64_t index;                                                             \
+                                                                                        \
+            cnt[ i ] = hll_hash_pattern( hash[ i ], (P), &index );                      \
+            idx[ i ] = (uint16_t)index;                                                 \
+        }                                                                               \
+    }
+
+HLL_DEFINE_PATTERN_BATCH( hll_pattern_batch_p10, 10 )
+HLL_DEFINE_PATTERN_BATCH( hll_pattern_batch_p12, 12 )
+HLL_DEFINE_PATTERN_BATCH( hll_pattern_batch_p14, 14 )
+HLL_DEFINE_PATTERN_BATCH( hll_pattern_batch_p16, 16 )
+HLL_DEFINE_PATTERN_BATCH( hll_pattern_batch_any, p )
+
+
+static inline void
+hll_pattern_batch( int p, const uint64_t * hash, uint16_t * idx, uint8_t * cnt, int n )
+{
+    switch ( p )
+    {
+        case 10: hll_pattern_batch_p10( p, hash, idx, cnt, n ); break;
+        case 12: hll_pattern_batch_p12( p, hash, idx, cnt, n ); break;
+        case 14: hll_pattern_batch_p14( p, hash, idx, cnt, n ); break;
+        case 16: hll_pattern_batch_p16( p, hash, idx, cnt, n ); break;
+        default: hll_pattern_batch_any( p, hash, idx, cnt, n ); break;
+    }
+}
+
+
+
+/** 批量写入 一批hash值 */
+static int
+hll_ctx_scatter_hash( hll_ctx_t * thiz, const uint64_t * hash, int n )
+{
+    int i = 0;
+
+    while ( i < n && HLL_SPARSE_LIST == thiz->encoding )    // 稀疏列表 逐个加入，中途可能转成稠密
+    {
+        if ( -1 == hll_ctx_slist_add( thiz, hll_slist_entry( hash[ i ], thiz->slist->sparse_p ) ) )
+            return -1;
+
+        i++;
+    }
+
+    uint16_t idx[ HLL_BATCH_SIZE ];
+    uint8_t  cnt[ HLL_BATCH_SIZE ];
+
+    hll_pattern_batch( thiz->precision, hash + i, idx, cnt, n - i );
+
+    return hll_ctx_scatter( thiz, idx, cnt, n - i );
+}
+
+
+
+int hll_ctx_add_batch( hll_ctx_t * thiz, const uint8_t ** eles, const int * lens, int n )
+{
+    if ( NULL == thiz || NULL == eles || NULL == lens ) return -1;
+
+    uint8_t  hash_type = thiz->hash_type;
+    uint64_t hash[ HLL_BATCH_SIZE ];
+
+    for ( int base = 0; base < n; base += HLL_BATCH_SIZE )
+    {
+        int num = ( n - base < HLL_BATCH_SIZE ) ? ( n - base ) : HLL_BATCH_SIZE;
+        int i   = 0;
+
+        // 4路一组，4个hash之间没有依赖，乘法的延迟可以相互掩盖
+        for ( ; i + 4 <= num; i += 4 )
+        {
+            const uint8_t ** e = eles + base + i;
+            const int      * l = lens + base + i;
+
+            hash[ i     ] = hll_hash( hash_type, e[ 0 ], l[ 0 ] );
+            hash[ i + 1 ] = hll_hash( hash_type, e[ 1 ], l[ 1 ] );
+            hash[ i + 2 ] = hll_hash( hash_type, e[ 2 ], l[ 2 ] );
+            hash[ i + 3 ] = hll_hash( hash_type, e[ 3 ], l[ 3 ] );
+        }
+
+        for ( ; i < num; i++ )
+            hash[ i ] = hll_hash( hash_type, eles[ base + i ], lens[ base + i ] );
+
+        if ( -1 == hll_ctx_scatter_hash( thiz, hash, num ) )
+            return -1;
+    }
+
+    return 0;
+}
+
+
+
+/** MurmurHash64A 的一轮 8字节 混合 */
+#define HLL_MURMUR_MIX( h, k )                                  \
+    do {                                                        \
+        (k) *= HLL_MURMUR_M;                                    \
+        (k) ^= (k) >> 47;                                       \
+        (k) *= HLL_MURMUR_M;                                    \
+        (h) ^= (k);                                             \
+        (h) *= HLL_MURMUR_M;                                    \
+    } while ( 0 )
+
+/** MurmurHash64A 的收尾 */
+#define HLL_MURMUR_FINAL( h )                                   \
+    do {                                                        \
+        (h) ^= (h) >> 47;                                       \
+        (h) *= HLL_MURMUR_M;                                    \
+        (h) ^= (h) >> 47;                                       \
+    } while ( 0 )
+
+
+/**
+ * 定长key的 MurmurHash64A, 4路交错计算, 结果和 MurmurHash64A( key, key_len ) 完全一致
+ *      key_len 只支持 8 和 16
+ */
+static inline void
+hll_murmur_fixed_x4( const uint8_t * keys, int key_len, uint64_t * out )
+{
+    const uint64_t seed = 0xadc83b19ULL ^ ( (uint64_t)key_len * HLL_MURMUR_M );
+
+    uint64_t h0 = seed, h1 = seed, h2 = seed, h3 = seed;
+    uint64_t k0, k1, k2, k3;
+
+    for ( int off = 0; off < key_len; off += 8 )
+    {
+        memcpy( &k0, keys + off,               8 );
+        memcpy( &k1, keys + off + key_len,     8 );
+        memcpy( &k2, keys + off + key_len * 2, 8 );
+        memcpy( &k3, keys + off + key_len * 3, 8 );
+
+        HLL_MURMUR_MIX( h0, k0 );
+        HLL_MURMUR_MIX( h1, k1 );
+        HLL_MURMUR_MIX( h2, k2 );
+        HLL_MURMUR_MIX( h3, k3 );
+    }
+
+    HLL_MURMUR_FINAL( h0 );
+    HLL_MURMUR_FINAL( h1 );
+    HLL_MURMUR_FINAL( h2 );
+    HLL_MURMUR_FINAL( h3 );
+
+    out[ 0 ] = h0; out[ 1 ] = h1; out[ 2 ] = h2; out[ 3 ] = h3;
+}
+
+
+
+int hll_ctx_add_fixed( hll_ctx_t * thiz, const uint8_t * keys, int key_len, int n )
+{
+    if ( NULL == thiz || NULL == keys )  return -1;
+    if ( key_len != 8 && key_len != 16 ) return -1;
+
+    uint8_t  hash_type = thiz->hash_type;
+    uint64_t hash[ HLL_BATCH_SIZE ];
+
+    for ( int base = 0; base < n; base += HLL_BATCH_SIZE )
+    {
+        int             num = ( n - base < HLL_BATCH_SIZE ) ? ( n - base ) : HLL_BATCH_SIZE;
+        const uint8_t * cur = keys + (long)base * key_len;
+        int             i   = 0;
+
+        for ( ; i + 4 <= num; i += 4 )
+        {
+            const uint8_t * k = cur + (long)i * key_len;
+
+            if ( HLL_HASH_MURMUR64A == hash_type )
+            {
+                hll_murmur_fixed_x4( k, key_len, hash + i );
+            }
+            else
+            {
+                hash[ i     ] = hll_hash( hash_type, k,               key_len );
+                hash[ i + 1 ] = hll_hash( hash_type, k + key_len,     key_len );
+                hash[ i + 2 ] = hll_hash( hash_type, k + key_len * 2, key_len );
+                hash[ i + 3 ] = hll_hash( hash_type, k + key_len * 3, key_len );
+            }
+        }
+
+        for ( ; i < num; i++ )
+            hash[ i ] = hll_hash( hash_type, cur + (long)i * key_len, key_len );
+
+        if ( -1 == hll_ctx_scatter_hash( thiz, hash, num ) )
+            return -1;
+    }
+
+    return 0;
+}
+
+
+
+int hll_ctx_add_hash_batch( hll_ctx_t * thiz, const uint64_t * hashes, int n )
+{
+    if ( NULL == thiz || NULL == hashes ) return -1;
+
+    for ( int base = 0; base < n; base += HLL_BATCH_SIZE )
+    {
+        int num = ( n - base < HLL_BATCH_SIZE ) ? ( n - base ) : HLL_BATCH_SIZE;
+
+        if ( -1 == hll_ctx_scatter_hash( thiz, hashes + base, num ) )
+            return -1;
+    }
+
+    return 0;
+}
+
+
+
+/**
+ * 稀疏列表的计数，用 m' = 2^p' 个桶的线性计数
+ *      p'=25 时，桶的数量远大于稀疏列表能容纳的条数，结果接近精确值
+ */
+static inline uint64_t
+hll_slist_estimate( int sparse_p, uint32_t num )
+{
+    double m = (double)( 1ULL << sparse_p );
+
+    return (uint64_t)llround( m * log( m / ( m - num ) ) );
+}
+
+
+static uint64_t
+hll_ctx_slist_count( hll_ctx_t * thiz )
+{
+    hll_slist_t * sl = thiz->slist;
+
+    hll_slist_flush( sl );                                  // 失败时 按已经合并的部分计算
+
+    return hll_slist_estimate( sl->sparse_p, sl->num );
+}
+
+
+
+uint64_t hll_ctx_count( hll_ctx_t * thiz )
+{
+    if ( thiz == NULL ) return 0ULL;
+
+    if ( thiz->concurrent )                                 // 并发写入中，不缓存，每次都重新估算
+    {
+        int reghisto[ HLL_HISTO_SIZE ];
+
+        hll_ctx_histo_build( thiz, reghisto );
+        return hll_histo_estimate( reghisto, thiz->precision );
+    }
+
+    if ( thiz->card_valid )                                 // 上次估算后 没有桶被修改过
+        return thiz->card;
+
+    if ( HLL_SPARSE_LIST == thiz->encoding )
+    {
+        thiz->card       = hll_ctx_slist_count( thiz );
+        thiz->card_valid = 1;
+
+        return thiz->card;
+    }
+
+    int   reghisto_local[ HLL_HISTO_SIZE ];
+    int * reghisto = thiz->reghisto;
+
+    if ( NULL == reghisto )                                 // 没有开启直方图，需要扫描一遍
+    {
+        reghisto = reghisto_local;
+        hll_ctx_histo_build( thiz, reghisto );
+    }
+
+    thiz->card       = hll_histo_estimate( reghisto, thiz->precision );
+    thiz->card_valid = 1;
+
+    return thiz->card;
+}
+
+
+
+hll_ctx_t * hll_ctx_create( unsigned char encoding )
+{
+    return hll_ctx_create_with_hash( encoding, HLL_HASH_MURMUR64A );
+}
+
+
+
+hll_ctx_t * hll_ctx_create_with_hash( unsigned char encoding, unsigned char hash_type )
+{
+    return hll_ctx_create_with_precision( encoding, hash_type, HLL_P );
+}
+
+
+
+/** 检查创建参数, 返回实际使用的编码. 返回值：-1：表示失败 */
+static int
+hll_ctx_check_args( unsigned char encoding, unsigned char hash_type, int precision )
+{
+    if ( encoding != HLL_DENSE && encoding != HLL_SPARSE && encoding != HLL_DENSE_PACKED && encoding != HLL_SPARSE_LIST )
+        return -1;
+
+    if ( hash_type != HLL_HASH_MURMUR64A && hash_type != HLL_HASH_WYHASH )
+        return -1;
+
+    if ( precision < HLL_PRECISION_MIN || precision > HLL_PRECISION_MAX )
+        return -1;
+
+    uint8_t dense_encoding = ( HLL_DENSE_PACKED == encoding ) ? HLL_DENSE_PACKED : HLL_DENSE;
+
+    // 精度很低时 稠密编码比 1.5K 的稀疏数组还小，直接用稠密
+    if ( HLL_SPARSE == encoding && HLL_DENSE_BYTES( dense_encoding, precision ) <= HLL_REGI_MAX_BYTES )
+        encoding = dense_encoding;
+
+    return encoding;
+}
+
+
+/**
+ * 初始化 thiz 的各个字段 并申请编码需要的内存, thiz 需要是清零的, mem_type/pool 已经设置好
+ *      返回值：-1：表示失败 0:表示成功, 失败时 已经申请的内存 都释放了
+ */
+static int
+hll_ctx_init( hll_ctx_t * thiz, unsigned char encoding, unsigned char hash_type, int precision )
+{
+    thiz->ele_num    = 0;
+    thiz->encoding   = encoding;
+    thiz->hash_type  = hash_type;
+    thiz->precision  = precision;
+    thiz->dense_encoding = ( HLL_DENSE_PACKED == encoding ) ? HLL_DENSE_PACKED : HLL_DENSE;
+    thiz->registers  = NULL;
+    thiz->regi_arr = NULL;
+
+    if ( HLL_SPARSE == encoding )
+    {
+        thiz->regi_arr = (hll_regi_t *)hll_ctx_mem_alloc( thiz, HLL_BLK_REGI_ARR, 0, HLL_REGI_MAX_BYTES );
+        if ( NULL == thiz->regi_arr ) goto failed;
+    }
+
+    if ( HLL_SPARSE_LIST == encoding )
+    {
+        thiz->slist = hll_slist_create( HLL_SPARSE_P );
+        if ( NULL == thiz->slist ) goto failed;
+    }
+
+    if ( HLL_IS_DENSE( encoding ) )
+    {
+        thiz->registers = (uint8_t *)hll_ctx_mem_alloc( thiz, HLL_BLK_REGISTERS, encoding, HLL_DENSE_BYTES( encoding, precision ) );
+        if ( NULL == thiz->registers ) goto failed;
+    }
+
+    return 0;
+
+failed:
+    hll_ctx_mem_free( thiz, HLL_BLK_REGI_ARR, 0, thiz->regi_arr );
+    hll_ctx_mem_free( thiz, HLL_BLK_REGISTERS, encoding, thiz->registers );
+    if ( NULL != thiz->slist )      hll_slist_free( thiz->slist );
+
+    return -1;
+}
+
+
+
+hll_ctx_t * hll_ctx_create_with_precision( unsigned char encoding, unsigned char hash_type, int precision )
+{
+    int enc = hll_ctx_check_args( encoding, hash_type, precision );
+    if ( -1 == enc ) return NULL;
+
+    hll_ctx_t * thiz = (hll_ctx_t *)calloc( 1, sizeof(hll_ctx_t) );
+    if ( NULL == thiz ) return NULL;
+
+    thiz->mem_type = HLL_MEM_HEAP;
+
+    if ( -1 == hll_ctx_init( thiz, enc, hash_type, precision ) )
+    {
+        free( thiz );
+        return NULL;
+    }
+
+    return thiz;
+}
+
+
+
+int hll_ctx_inplace_bytes( unsigned char encoding, int precision )
+{
+    int enc = hll_ctx_check_args( encoding, HLL_HASH_MURMUR64A, precision );
+
+    if ( -1 == enc || HLL_SPARSE_LIST == enc ) return -1;
+
+    // 稀疏的 预留 HLL_DENSE 的大小，转成哪种稠密布局都够用
+    uint8_t dense = ( HLL_SPARSE == enc ) ? HLL_DENSE : enc;
+
+    return (int)( hll_inplace_offset( HLL_BLK_REGISTERS, enc ) + HLL_DENSE_BYTES( dense, precision ) );
+}
+
+
+
+hll_ctx_t * hll_ctx_init_inplace( void * mem, int mem_len, unsigned char encoding, unsigned char hash_type, int precision )
+{
+    if ( NULL == mem || 0 != ( (uintptr_t)mem & 7 ) ) return NULL;
+
+    int need = hll_ctx_inplace_bytes( encoding, precision );
+    if ( -1 == need || mem_len < need ) return NULL;
+
+    int         enc  = hll_ctx_check_args( encoding, hash_type, precision );
+    hll_ctx_t * thiz = (hll_ctx_t *)mem;
+
+    memset( thiz, 0, sizeof( hll_ctx_t ) );
+    thiz->mem_type       = HLL_MEM_INPLACE;
+    thiz->inplace_layout = enc;
+
+    if ( -1 == hll_ctx_init( thiz, enc, hash_type, precision ) ) return NULL;
+
+    return thiz;
+}
+
+
+
+hll_ctx_t * hll_ctx_attach_inplace( void * mem, int mem_len )
+{
+    if ( NULL == mem || 0 != ( (uintptr_t)mem & 7 ) ) return NULL;
+    if ( mem_len < (int)sizeof( hll_ctx_t ) )          return NULL;
+
+    hll_ctx_t * thiz = (hll_ctx_t *)mem;
+
+    if ( HLL_MEM_INPLACE != thiz->mem_type ) return NULL;
+
+    int need = hll_ctx_inplace_bytes( thiz->inplace_layout, thiz->precision );
+    if ( -1 == need || mem_len < need ) return NULL;
+
+    if ( !HLL_IS_DENSE( thiz->encoding ) && HLL_SPARSE != thiz->encoding ) return NULL;
+
+    // 数据都在 mem 中，只有指针需要按现在的地址 重新计算
+    uint8_t     * base      = (uint8_t *)mem;
+    uint8_t     * registers = HLL_IS_DENSE( thiz->encoding ) ? base + hll_inplace_offset( HLL_BLK_REGISTERS, thiz->inplace_layout ) : NULL;
+    hll_regi_t  * regi_arr  = ( HLL_SPARSE == thiz->encoding ) ? (hll_regi_t *)( base + hll_inplace_offset( HLL_BLK_REGI_ARR, thiz->inplace_layout ) ) : NULL;
+    int         * reghisto  = ( NULL != thiz->reghisto ) ? (int *)( base + hll_inplace_offset( HLL_BLK_HISTO, thiz->inplace_layout ) ) : NULL;
+
+    // 地址没变的 不写，只读的访问 不会把 MAP_SHARED 的页 弄脏
+    if ( thiz->registers != registers ) thiz->registers = registers;
+    if ( thiz->regi_arr  != regi_arr  ) thiz->regi_arr  = regi_arr;
+    if ( thiz->reghisto  != reghisto  ) thiz->reghisto  = reghisto;     // 开启了直方图的，直方图的内容也在 mem 中
+    if ( NULL != thiz->slist )          thiz->slist     = NULL;
+    if ( NULL != thiz->pool )           thiz->pool      = NULL;
+    if ( NULL != thiz->dirty )          thiz->dirty     = NULL;
+
+    return thiz;
+}
+
+
+hll_ctx_t * hll_ctx_create_concurrent( unsigned char hash_type, int precision )
+{
+    hll_ctx_t * thiz = hll_ctx_create_with_precision( HLL_DENSE, hash_type, precision );
+    if ( NULL == thiz ) return NULL;
+
+    thiz->concurrent = 1;                                   // calloc 的内存 按 8 字节对齐，2^p 是 8 的倍数
+    return thiz;
+}
+
+
+
+int hll_ctx_precision( hll_ctx_t * thiz )
+{
+    if ( NULL == thiz ) return -1;
+
+    return thiz->precision;
+}
+
+
+
+int hll_ctx_encoding( hll_ctx_t * thiz )
+{
+    if ( NULL == thiz ) return -1;
+
+    return thiz->encoding;
+}
+
+
+void  hll_ctx_free( hll_ctx_t * thiz )
+{
+    if ( thiz == NULL ) return;
+
+    hll_ctx_mem_free( thiz, HLL_BLK_REGISTERS, thiz->encoding, thiz->registers );
+    hll_ctx_mem_free( thiz, HLL_BLK_REGI_ARR, 0, thiz->regi_arr );
+    hll_ctx_mem_free( thiz, HLL_BLK_HISTO, 0, thiz->reghisto );
+    if ( NULL != thiz->slist )     hll_slist_free( thiz->slist );
+    if ( NULL != thiz->dirty )     free( thiz->dirty );
+
+    if ( HLL_MEM_POOL == thiz->mem_type )
+        hll_slab_release( &thiz->pool->ctx, thiz );
+    else if ( HLL_MEM_HEAP == thiz->mem_type )
+        free( thiz );
+}
+
+
+void  hll_ctx_reset( hll_ctx_t * thiz )
+{
+    if ( thiz == NULL ) return;
+
+    thiz->ele_num = 0;
+
+    if ( NULL != thiz->registers )
+        memset( thiz->registers, 0, HLL_DENSE_BYTES( thiz->encoding, thiz->precision ) );
+
+    if ( NULL != thiz->regi_arr )
+        memset( thiz->regi_arr, 0, HLL_REGI_MAX_BYTES );
+
+    if ( NULL != thiz->slist )
+    {
+        thiz->slist->num     = 0;
+        thiz->slist->bytes   = 0;
+        thiz->slist->tmp_num = 0;
+    }
+
+    if ( NULL != thiz->dirty )                              // 变小的桶 没法用增量表达, 需要重新全量同步
+        memset( thiz->dirty, 0, HLL_DIRTY_WORDS( thiz->precision ) * sizeof(uint64_t) );
+
+    hll_ctx_invalidate( thiz );
+}
+
+
+
+int hll_ctx_set_sparse_precision( hll_ctx_t * thiz, int sparse_p )
+{
+    if ( NULL == thiz ) return -1;
+    if ( HLL_SPARSE_LIST != thiz->encoding ) return -1;
+    if ( sparse_p < thiz->precision || sparse_p > HLL_SPARSE_P ) return -1;
+
+    hll_slist_t * sl = thiz->slist;
+
+    if ( sl->num > 0 || sl->tmp_num > 0 ) return -1;        // 只能在加入元素之前设置
+
+    sl->sparse_p = sparse_p;
+    return 0;
+}
+
+
+
+int hll_ctx_set_dense_encoding( hll_ctx_t * thiz, unsigned char dense_encoding )
+{
+    if ( NULL == thiz ) return -1;
+
+    if ( dense_encoding != HLL_DENSE && dense_encoding != HLL_DENSE_PACKED )
+        return -1;
+
+    if ( thiz->concurrent && HLL_DENSE != dense_encoding )  // 并发写入 只支持 HLL_DENSE
+        return -1;
+
+    if ( !HLL_IS_DENSE( thiz->encoding ) || dense_encoding == thiz->encoding )
+    {
+        thiz->dense_encoding = dense_encoding;
+        return 0;                                           // 稀疏的 等转换成稠密时 再用新的布局
+    }
+
+    if ( HLL_MEM_INPLACE == thiz->mem_type )                // 预留的位置 只有一份，不能边读边写
+        return -1;
+
+    // 已经是稠密的，直接转换布局
+    uint8_t * registers = (uint8_t *)hll_ctx_mem_alloc( thiz, HLL_BLK_REGISTERS, dense_encoding,
+                                                        HLL_DENSE_BYTES( dense_encoding, thiz->precision ) );
+    if ( NULL == registers ) return -1;
+
+    thiz->dense_encoding = dense_encoding;
+
+    if ( HLL_DENSE_PACKED == dense_encoding )
+        hll_kernel()->pack( registers, thiz->registers, HLL_REGISTERS( thiz->precision ) );
+    else
+        hll_kernel()->unpack( registers, thiz->registers, HLL_REGISTERS( thiz->precision ) );
+
+    hll_ctx_mem_free( thiz, HLL_BLK_REGISTERS, thiz->encoding, thiz->registers );
+
+    thiz->registers = registers;
+    thiz->encoding  = dense_encoding;
+
+    return 0;
+}
+
+
+
+int hll_ctx_enable_histo( hll_ctx_t * thiz, int enable )
+{
+    if ( thiz == NULL ) return -1;
+
+    if ( !enable )
+    {
+        hll_ctx_mem_free( thiz, HLL_BLK_HISTO, 0, thiz->reghisto );
+        thiz->reghisto = NULL;
+
+        return 0;
+    }
+
+    if ( NULL != thiz->reghisto ) return 0;
+
+    if ( thiz->concurrent ) return -1;                      // 直方图没法并发的维护
+
+    thiz->reghisto = (int *)hll_ctx_mem_alloc( thiz, HLL_BLK_HISTO, 0, sizeof(int) * HLL_HISTO_SIZE );
+    if ( NULL == thiz->reghisto ) return -1;
+
+    hll_ctx_histo_build( thiz, thiz->reghisto );
+    return 0;
+}
+
+
+
+int hll_ctx_enable_delta( hll_ctx_t * thiz, int enable )
+{
+    if ( NULL == thiz ) return -1;
+
+    if ( !enable )
+    {
+        free( thiz->dirty );
+        thiz->dirty = NULL;
+        return 0;
+    }
+
+    if ( NULL != thiz->dirty ) return 0;
+
+    if ( thiz->concurrent )                  return -1;    // 脏标记没法并发的维护
+    if ( HLL_MEM_HEAP != thiz->mem_type )    return -1;    // 池和调用方的内存 不能单独申请
+
+    long bytes = HLL_DIRTY_WORDS( thiz->precision ) * sizeof(uint64_t);
+
+    thiz->dirty = (uint64_t *)malloc( bytes );
+    if ( NULL == thiz->dirty ) return -1;
+
+    memset( thiz->dirty, 0xFF, bytes );                     // 全部标记成脏的，第一次的增量 就是完整的数据
+    return 0;
 }
 
 
 
 int hll_ctx_serial_maxBytes( hll_ctx_t * thiz )
 {
-    if ( NULL == thiz ) return -1;
+    if ( NULL == thiz ) return -1;
+
+    int bytes = 0;
+
+    if ( NULL != thiz->registers )                          /* 稠密 */
+    {
+        /* val:num 的格式 在 ele_num < HLL_SERIAL_SPARSE_MIN 时 最多约 0.74*2^p 字节(p=14 时 12.2K)，
+         * 不会超过 HLL_DENSE 的 2^p 和 HLL_DENSE_PACKED 的 0.75*2^p */
+        bytes = HLL_DENSE_BYTES( thiz->encoding, thiz->precision );
+
+        /* HLL_FORMAT_BLOCK: 版本+编码 2个字节, 每块最多 1 个字节的块头 + 6bit 的桶 */
+        long block = 2 + HLL_REGISTERS( thiz->precision ) / HLL_BLOCK_REGS( thiz->precision )
+                         * ( 1 + HLL_BLOCK_REGS( thiz->precision ) * HLL_BITS / 8 );
+
+        if ( block > bytes ) bytes = (int)block;
+    }
+    else if ( NULL != thiz->slist )                         /* 稀疏列表: p', 条数, 字节数, 数据 */
+    {
+        bytes = 1 + VARINT32_MAX_BYTES * 2 + thiz->slist->bytes + thiz->slist->tmp_num * VARINT32_MAX_BYTES;
+    }
+    else
+    {
+        if ( NULL != thiz->regi_arr )                       /* 稀疏 */
+            bytes = HLL_REGI_MAX_BYTES;
+    }
+
+    bytes += sizeof( uint8_t );
+    bytes += sizeof( uint8_t );                             /* 精度 */
+    bytes += VARINT32_MAX_BYTES;
+    bytes += HLL_MAGIC_BYTES;
+
+    return bytes;
+}
+
+
+
+/**
+ * 转换成 val:num;val:num;val:num的格式，注意：不是 index:val;index:val的格式 ,
+ *  原因是:
+ *      超过128的index在varint中基本都要2个字节来表示, 如果用index:val的方式，一个pair需要2个字节
+ *      num超过128是很少见的，一般1个字节就够了，用val:num的方式，这样一个pair只需要2个字节
+ *
+ *  返回值：写入的字节数
+ */
+static int
+hll_ctx_write_rle( hll_ctx_t * thiz, uint8_t * buf )
+{
+    uint8_t   tile[ HLL_MERGE_TILE ];
+    int       write_len = 0;
+    uint8_t   val       = 0;
+    int       num       = 0;
+    long      tlen      = HLL_TILE( thiz->precision );
+
+    for ( long off = 0; off < HLL_REGISTERS( thiz->precision ); off += tlen )
+    {
+        const uint8_t * registers = hll_dense_tile( thiz->registers, thiz->encoding, off, tile, tlen );
+
+        for ( int i = 0; i < tlen; i++ )
+        {
+            uint8_t cur = registers[ i ];
+
+            if ( val == cur || 0 == num )
+            {
+                val = cur;
+                num++;
+                continue;
+            }
+
+            buf[ write_len ] = val;                         // 输出值
+            write_len += 1;
+
+            write_len += varint_encode_uint32( num, buf + write_len );
+
+            val = cur;
+            num = 1;
+        }
+    }
+
+    // 最后一段也要输出
+    buf[ write_len ] = val;
+    write_len += 1;
+
+    write_len += varint_encode_uint32( num, buf + write_len );
+
+    // 写个末尾的小哨兵。因为64是不可能出现的 val 值
+    buf[ write_len ] = ( 1 << HLL_BITS );
+    write_len += 1;
+
+    return write_len;
+}
+
+
+
+/**
+ * 输出序列化数据的头部: magic, 编码, hash函数, 精度(可选), 个数
+ *      返回值：写入的字节数
+ */
+static int
+hll_write_header( hll_ctx_t * thiz, uint8_t encoding, uint8_t * buf )
+{
+    int       write_len = 0;
+
+    buf[ 0 ] = 'H'; buf[ 1 ] = 'L'; buf[ 2 ] = 'L';
+    write_len += HLL_MAGIC_BYTES;
+
+    buf[ write_len ] = HLL_HDR_BYTE( encoding, thiz->hash_type );         // 输出编码 和 hash函数
+    write_len += 1;
+
+    if ( HLL_P != thiz->precision )                         // 非默认精度 才写精度，默认的和老数据一致
+    {
+        buf[ write_len - 1 ] |= HLL_HDR_PRECISION;
+        buf[ write_len ]      = thiz->precision;
+        write_len += 1;
+    }
+
+    // 写入个数
+    write_len += varint_encode_uint32 ( thiz->ele_num, buf + write_len );
+
+    return write_len;
+}
+
+
+
+/**
+ * 分块格式的一块: 块头 1 个字节, 高3位是位宽 w, 低5位是基准值 base
+ *      w = 0        : 所有桶都是 base, 没有后续数据 (全0的块 就只有1个字节)
+ *      w = 1~6      : 每个桶存 (值 - base), 每 8 个桶 w 个字节; w = 6 时 base 一定是0, 解出来的值不会超过 63
+ *      w = 7        : 非0的桶很少, 后面是个数 k, 和 k 组 (块内位置, 值)
+ * 哪种更小 用哪种, 低填充率时 大部分块只有1~2个字节, 高填充率时 桶值集中 一般 4~5 bit 就够了
+ *
+ *      返回值：写入的字节数
+ */
+static int
+hll_block_encode( const uint8_t * regs, int blk, uint8_t * buf )
+{
+    uint8_t min = HLL_REGISTER_MAX, max = 0;
+    int     nz  = 0;
+
+    for ( int i = 0; i < blk; i++ )
+    {
+        uint8_t v = regs[ i ];
+
+        if ( v < min ) min = v;
+        if ( v > max ) max = v;
+        nz += ( 0 != v );
+    }
+
+    uint8_t base = ( min > HLL_BLOCK_BASE_MAX ) ? HLL_BLOCK_BASE_MAX : min;
+    int     w    = ( max == base ) ? 0 : 32 - __builtin_clz( (unsigned)( max - base ) );
+
+    if ( HLL_BITS == w ) base = 0;                          // 6bit 什么值都放得下，不需要基准值
+
+    int packed = blk * w / 8;
+
+    if ( 0 == min && 1 + 2 * nz < packed )                  // 只列出非0的桶
+    {
+        int len = 0;
+
+        buf[ len++ ] = HLL_BLOCK_SPARSE << 5;
+        buf[ len++ ] = (uint8_t)nz;
+
+        for ( int i = 0; i < blk; i++ )
+        {
+            if ( 0 == regs[ i ] ) continue;
+
+            buf[ len++ ] = (uint8_t)i;
+            buf[ len++ ] = regs[ i ];
+        }
+
+        return len;
+    }
+
+    buf[ 0 ] = (uint8_t)( ( w << 5 ) | base );
+
+    for ( int i = 0; i < blk && w > 0; i += 8 )             // 每 8 个桶 拼成 w 个字节
+    {
+        uint64_t word = 0;
+
+        for ( int j = 0; j < 8; j++ )
+            word |= (uint64_t)( regs[ i + j ] - base ) << ( j * w );
+
+        for ( int k = 0; k < w; k++ )
+            buf[ 1 + i / 8 * w + k ] = (uint8_t)( word >> ( k * 8 ) );
+    }
+
+    return 1 + packed;
+}
+
+
+
+/**
+ * 解析分块格式的一块 到 dst 中
+ *      read_len: 输入时是 块开始的位置，返回时是 结束的位置
+ *
+ *      返回值：-1：表示数据有误 0:表示成功
+ */
+static int
+hll_block_decode( const uint8_t * src, int src_len, int * read_len, uint8_t * dst, int blk )
+{
+    int pos = *read_len;
+
+    if ( pos >= src_len ) return -1;
+
+    uint8_t hdr  = src[ pos++ ];
+    int     w    = hdr >> 5;
+    uint8_t base = hdr & HLL_BLOCK_BASE_MAX;
+
+    if ( HLL_BLOCK_SPARSE == w )
+    {
+        if ( pos >= src_len ) return -1;
+
+        int k = src[ pos++ ];
+        if ( k > blk || pos + 2 * k > src_len ) return -1;
+
+        memset( dst, 0, blk );
+
+        for ( int i = 0; i < k; i++, pos += 2 )
+        {
+            if ( src[ pos ] >= blk || src[ pos + 1 ] > HLL_REGISTER_MAX ) return -1;
+
+            dst[ src[ pos ] ] = src[ pos + 1 ];
+        }
+    }
+    else if ( 0 == w )
+    {
+        memset( dst, base, blk );
+    }
+    else
+    {
+        int bytes = blk * w / 8;
+
+        if ( HLL_BITS == w && 0 != base ) return -1;
+        if ( pos + bytes > src_len )      return -1;
+
+        hll_kernel()->unpack_bits( dst, src + pos, blk, w, base, src_len - pos );
+        pos += bytes;
+    }
+
+    *read_len = pos;
+    return 0;
+}
+
+
+
+/** HLL_FORMAT_BLOCK: 头部 + 版本 + 原来的稠密编码 + 每一块 */
+static int
+hll_ctx_write_block( hll_ctx_t * thiz, uint8_t * buf )
+{
+    uint8_t   tile[ HLL_MERGE_TILE ];
+    long      tlen      = HLL_TILE( thiz->precision );
+    int       blk       = HLL_BLOCK_REGS( thiz->precision );
+    int       write_len = hll_write_header( thiz, HLL_ENC_BLOCK, buf );
+
+    buf[ write_len++ ] = HLL_BLOCK_VERSION;
+    buf[ write_len++ ] = thiz->encoding;
+
+    for ( long off = 0; off < HLL_REGISTERS( thiz->precision ); off += tlen )
+    {
+        const uint8_t * registers = hll_dense_tile( thiz->registers, thiz->encoding, off, tile, tlen );
+
+        for ( long b = 0; b < tlen; b += blk )
+            write_len += hll_block_encode( registers + b, blk, buf + write_len );
+    }
+
+    return write_len;
+}
+
+
+
+int hll_ctx_serialize_format( hll_ctx_t * thiz, uint8_t * buf, int format )
+{
+    if ( NULL == thiz || NULL == buf ) return -1;
+
+    if ( HLL_FORMAT_DEFAULT == format ) return hll_ctx_serialize( thiz, buf );
+    if ( HLL_FORMAT_BLOCK != format )   return -1;
+
+    if ( !HLL_IS_DENSE( thiz->encoding ) ) return hll_ctx_serialize( thiz, buf );   // 稀疏的 本身就很小
+
+    return hll_ctx_write_block( thiz, buf );
+}
+
+
+
+int hll_ctx_serialize( hll_ctx_t * thiz, uint8_t * buf )
+{
+    if ( NULL == thiz || NULL == buf ) return -1;
+
+    int       write_len = hll_write_header( thiz, thiz->encoding, buf );
+
+    // 区分不同编码 分别处理
+    if ( HLL_SPARSE == thiz->encoding )
+    {
+        // TODO: 这里有个潜在的改进是把 每个小区域具体有多少个值 先存起来
+        memcpy( buf + write_len, thiz->regi_arr, HLL_REGI_MAX_BYTES );
+        write_len += HLL_REGI_MAX_BYTES;
+
+        return write_len;
+    }
+
+    if ( HLL_SPARSE_LIST == thiz->encoding )
+    {
+        hll_slist_t * sl = thiz->slist;
+
+        if ( -1 == hll_slist_flush( sl ) ) return -1;
+
+        buf[ write_len ] = sl->sparse_p;
+        write_len += 1;
+
+        write_len += varint_encode_uint32( sl->num,   buf + write_len );
+        write_len += varint_encode_uint32( sl->bytes, buf + write_len );
+
+        memcpy( buf + write_len, sl->data, sl->bytes );
+        write_len += sl->bytes;
+
+        return write_len;
+    }
+
+    if ( thiz->ele_num < HLL_SERIAL_SPARSE_MIN( thiz->precision ) )
+    {
+        write_len += hll_ctx_write_rle( thiz, buf + write_len );
+    }
+    else
+    {
+        // HLL_DENSE 2^p, HLL_DENSE_PACKED 0.75*2^p, 都是原样输出
+        memcpy( buf + write_len, thiz->registers, HLL_DENSE_BYTES( thiz->encoding, thiz->precision ) );
+        write_len += HLL_DENSE_BYTES( thiz->encoding, thiz->precision );
+    }
+
+    return write_len;
+}
+
+
+
+int hll_ctx_delta_maxBytes( hll_ctx_t * thiz )
+{
+    if ( NULL == thiz || NULL == thiz->dirty ) return -1;
+
+    if ( !HLL_IS_DENSE( thiz->encoding ) ) return hll_ctx_serial_maxBytes( thiz );
+
+    // 最坏的情况 脏块和干净的块交替出现, 每一段都要 间隔 和 块数 两个varint
+    long runs = HLL_DIRTY_BLOCKS( thiz->precision ) / 2 + 1;
+
+    return (int)( HLL_MAGIC_BYTES + 2 + VARINT32_MAX_BYTES
+                  + HLL_REGISTERS( thiz->precision ) + ( runs + 1 ) * 2 * VARINT32_MAX_BYTES );
+}
+
+
+
+/**
+ * 增量的格式: 头部(编码是 HLL_ENC_DELTA) + 若干段 + 结束标记
+ *      每一段: varint 和上一段末尾间隔的块数, varint 块数, 然后是这些块的 块数*8 个桶值(每个桶一个字节)
+ *      结束标记: 间隔 0, 块数 0
+ * 只包含桶的当前值，合并时取 max, 所以丢失/重复/乱序的增量 在之后补齐时都不影响结果
+ */
+int hll_ctx_serialize_delta( hll_ctx_t * thiz, uint8_t * buf )
+{
+    if ( NULL == thiz || NULL == buf || NULL == thiz->dirty ) return -1;
+
+    if ( !HLL_IS_DENSE( thiz->encoding ) )                  // 稀疏的 本身就很小，直接全量输出, 转成稠密时会把非0的块都标记上
+    {
+        int write_len = hll_ctx_serialize( thiz, buf );
+
+        if ( -1 != write_len )
+            memset( thiz->dirty, 0, HLL_DIRTY_WORDS( thiz->precision ) * sizeof(uint64_t) );
+
+        return write_len;
+    }
+
+    uint64_t * dirty     = thiz->dirty;
+    long       nblk      = HLL_DIRTY_BLOCKS( thiz->precision );
+    long       prev_end  = 0;
+    long       b         = 0;
+    int        write_len = hll_write_header( thiz, HLL_ENC_DELTA, buf );
+
+    while ( b < nblk )
+    {
+        uint64_t w = dirty[ b >> 6 ] >> ( b & 63 );
+
+        if ( 0 == w )                                       // 这个字剩下的都是干净的
+        {
+            b = ( ( b >> 6 ) + 1 ) << 6;
+            continue;
+        }
+
+        b += __builtin_ctzll( w );
+        if ( b >= nblk ) break;
+
+        long e = b + 1;                                     // 连续的脏块 合成一段
+        while ( e < nblk && ( dirty[ e >> 6 ] >> ( e & 63 ) & 1 ) ) e++;
+
+        write_len += varint_encode_uint32( (uint32_t)( b - prev_end ), buf + write_len );
+        write_len += varint_encode_uint32( (uint32_t)( e - b ),        buf + write_len );
+
+        long begin = b << HLL_DIRTY_SHIFT;
+        long len   = ( e - b ) << HLL_DIRTY_SHIFT;
+
+        if ( HLL_DENSE == thiz->encoding )
+        {
+            memcpy( buf + write_len, thiz->registers + begin, len );
+        }
+        else
+        {
+            for ( long i = 0; i < len; i++ )
+                buf[ write_len + i ] = hll_packed_get( thiz->registers, begin + i );
+        }
+
+        write_len += len;
+        prev_end   = e;
+        b          = e;
+    }
+
+    buf[ write_len++ ] = 0;                                 // 结束标记
+    buf[ write_len++ ] = 0;
+
+    memset( dirty, 0, HLL_DIRTY_WORDS( thiz->precision ) * sizeof(uint64_t) );
+
+    return write_len;
+}
+
+
+
+int hll_ctx_merge_registers( uint8_t * dst, uint8_t * src, long m )
+{
+    return hll_kernel()->merge_count( dst, src, m );
+}
+
+
+
+/**
+ * 把精度更高的一份完整的稠密桶 折叠合并到 稠密的 thiz 中
+ *      按块解包 src，每个非0的桶 折叠到 thiz 的精度上 取max
+ *
+ *      返回值：被改大的桶的个数
+ */
+static int
+hll_ctx_fold_dense( hll_ctx_t * thiz, const uint8_t * src, uint8_t src_encoding, int src_p )
+{
+    int       ele_num = 0;
+    long      tlen    = HLL_TILE( src_p );
+    uint8_t   src_tile[ HLL_MERGE_TILE ];
+
+    for ( long off = 0; off < HLL_REGISTERS( src_p ); off += tlen )
+    {
+        const uint8_t * s = hll_dense_tile( src, src_encoding, off, src_tile, tlen );
+
+        for ( long i = 0; i < tlen; i++ )
+        {
+            if ( 0 == s[ i ] ) continue;
+
+            uint64_t index;
+            uint8_t  count = hll_fold_regi( off + i, s[ i ], src_p, thiz->precision, &index );
+
+            ele_num += hll_ctx_dense_max( thiz, index, count );
+        }
+    }
+
+    return ele_num;
+}
+
+
+
+/**
+ * 把一份完整的稠密桶 合并到 稠密的 thiz 中
+ *      src_encoding: src 的布局，HLL_DENSE 或 HLL_DENSE_PACKED
+ *      src_p       : src 的精度, 不能比 thiz 的低, 更高的 折叠后合并
+ *      有紧凑编码的，按块解包到L1中合并，再打包写回
+ *
+ *      返回值：被改大的桶的个数
+ */
+static int
+hll_ctx_merge_dense( hll_ctx_t * thiz, const uint8_t * src, uint8_t src_encoding, int src_p )
+{
+    if ( src_p != thiz->precision )
+        return hll_ctx_fold_dense( thiz, src, src_encoding, src_p );
+
+    if ( HLL_DENSE == thiz->encoding && HLL_DENSE == src_encoding && NULL == thiz->dirty )
+        return hll_ctx_merge_registers( thiz->registers, (uint8_t *)src, HLL_REGISTERS( src_p ) );
+
+    const hll_kernel_t * kernel  = hll_kernel();
+    int                  ele_num = 0;
+    long                 tlen    = HLL_TILE( src_p );
+    uint8_t              dst_tile[ HLL_MERGE_TILE ];
+    uint8_t              src_tile[ HLL_MERGE_TILE ];
+    uint8_t              old_tile[ HLL_MERGE_TILE ];
+
+    for ( long off = 0; off < HLL_REGISTERS( src_p ); off += tlen )
+    {
+        uint8_t * d = hll_dense_tile( thiz->registers, thiz->encoding, off, dst_tile, tlen );
+        uint8_t * s = hll_dense_tile( src, src_encoding, off, src_tile, tlen );
+
+        if ( NULL != thiz->dirty ) memcpy( old_tile, d, tlen );
+
+        int       n = kernel->merge_count( d, s, tlen );
+
+        if ( n > 0 )
+        {
+            hll_dense_tile_store( thiz->registers, thiz->encoding, off, d, tlen );
+            if ( NULL != thiz->dirty ) hll_ctx_dirty_diff( thiz, off, old_tile, d, tlen );
+        }
+
+        ele_num += n;
+    }
+
+    return ele_num;
+}
+
+
+
+/**
+ * 解析 val:num 格式的数据，合并到 稠密的 thiz 中
+ *      src_p   : 数据的精度, 比 thiz 高的 折叠后合并
+ *      read_len: 输入时是 数据开始的位置，返回时是 结束的位置
+ *
+ *      返回值：被改大的桶的个数
+ */
+static int
+hll_ctx_merge_rle( hll_ctx_t * thiz, const uint8_t * src, int src_len, int * read_len, int src_p )
+{
+    int       pos       = *read_len;
+    uint8_t   val       = 0;                                        // 实际的值
+    uint32_t  num       = 0;                                        // 重复的次数
+    long      write_idx = 0;
+    long      m         = HLL_REGISTERS( src_p );
+    int       ele_num   = 0;
+
+    while ( (val = src[ pos ++ ]) != ( 1 << HLL_BITS ) )            // 一直循环到哨兵
+    {
+        pos += varint_decode_uint32( src + pos, &num );
+
+        if ( 0 == val )                                             // 空桶 不用合并
+        {
+            write_idx += num;
+            num        = 0;
+        }
+
+        for ( uint32_t i = 0; i < num; i++ )
+        {
+            if ( write_idx < m )                                    // 写边界保护
+            {
+                uint64_t index = write_idx;
+                uint8_t  count = val;
+
+                if ( src_p != thiz->precision )
+                    count = hll_fold_regi( write_idx, val, src_p, thiz->precision, &index );
+
+                ele_num += hll_ctx_dense_max( thiz, index, count );
+            }
+
+            write_idx++;
+        }
+
+        if ( pos >= src_len ) break;                                // 读边界保护
+    }
+
+    *read_len = pos;
+    return ele_num;
+}
+
+
+
+/**
+ * 解析分块格式的数据，合并到 稠密的 thiz 中
+ *      按 tile 解码到L1中，精度相同的 用 merge_count 一次合并一整块; 精度更高的 折叠后逐个合并
+ *      read_len: 输入时是 版本开始的位置，返回时是 结束的位置
+ *
+ *      返回值：-1：表示数据有误 >=0:被改大的桶的个数
+ */
+static int
+hll_ctx_merge_block( hll_ctx_t * thiz, const uint8_t * src, int src_len, int * read_len, int src_p )
+{
+    const hll_kernel_t * kernel  = hll_kernel();
+    int                  pos     = *read_len;
+    int                  ele_num = 0;
+    long                 tlen    = HLL_TILE( src_p );
+    int                  blk     = HLL_BLOCK_REGS( src_p );
+    uint8_t              src_tile[ HLL_MERGE_TILE ];
+    uint8_t              dst_tile[ HLL_MERGE_TILE ];
+    uint8_t              old_tile[ HLL_MERGE_TILE ];
+
+    if ( pos + 2 > src_len || HLL_BLOCK_VERSION != src[ pos ] ) return -1;
+    pos += 2;                                                       // 版本, 原来的稠密编码
+
+    for ( long off = 0; off < HLL_REGISTERS( src_p ); off += tlen )
+    {
+        for ( long b = 0; b < tlen; b += blk )
+            if ( -1 == hll_block_decode( src, src_len, &pos, src_tile + b, blk ) ) return -1;
+
+        if ( src_p == thiz->precision )
+        {
+            uint8_t * d = hll_dense_tile( thiz->registers, thiz->encoding, off, dst_tile, tlen );
+
+            if ( NULL != thiz->dirty ) memcpy( old_tile, d, tlen );
+
+            int n = kernel->merge_count( d, src_tile, tlen );
+
+            if ( n > 0 )
+            {
+                hll_dense_tile_store( thiz->registers, thiz->encoding, off, d, tlen );
+                if ( NULL != thiz->dirty ) hll_ctx_dirty_diff( thiz, off, old_tile, d, tlen );
+            }
+
+            ele_num += n;
+            continue;
+        }
+
+        for ( long i = 0; i < tlen; i++ )
+        {
+            uint64_t index;
+
+            if ( 0 == src_tile[ i ] ) continue;
+
+            uint8_t count = hll_fold_regi( off + i, src_tile[ i ], src_p, thiz->precision, &index );
+            ele_num += hll_ctx_dense_max( thiz, index, count );
+        }
+    }
+
+    *read_len = pos;
+    return ele_num;
+}
+
+
+
+/**
+ * 解析增量的数据，合并到 稠密的 thiz 中
+ *      src_p   : 数据的精度, 比 thiz 高的 折叠后合并
+ *      read_len: 输入时是 数据开始的位置，返回时是 结束的位置
+ *
+ *      返回值：-1：表示数据有误 >=0:被改大的桶的个数
+ */
+static int
+hll_ctx_merge_delta( hll_ctx_t * thiz, const uint8_t * src, int src_len, int * read_len, int src_p )
+{
+    int       pos     = *read_len;
+    long      blk     = 0;
+    long      nblk    = HLL_DIRTY_BLOCKS( src_p );
+    int       ele_num = 0;
+
+    for ( ;; )
+    {
+        uint32_t gap = 0, n = 0;
+
+        if ( pos + 2 > src_len ) return -1;                         // 读边界保护, 至少还有结束标记
+
+        pos += varint_decode_uint32( src + pos, &gap );
+        if ( pos >= src_len ) return -1;
+        pos += varint_decode_uint32( src + pos, &n );
+
+        if ( 0 == n ) break;
+
+        blk += gap;
+        if ( blk + n > nblk ) return -1;
+
+        long begin = blk << HLL_DIRTY_SHIFT;
+        long len   = (long)n << HLL_DIRTY_SHIFT;
+
+        if ( pos + len > src_len ) return -1;
+
+        for ( long i = 0; i < len; i++ )
+        {
+            uint8_t  count = src[ pos + i ];
+            uint64_t index = begin + i;
+
+            if ( 0 == count ) continue;
+
+            if ( src_p != thiz->precision )
+                count = hll_fold_regi( begin + i, count, src_p, thiz->precision, &index );
+
+            ele_num += hll_ctx_dense_max( thiz, index, count );
+        }
+
+        pos += len;
+        blk += n;
+    }
+
+    *read_len = pos;
+    return ele_num;
+}
+
+
+
+/**
+ * 解析序列化数据的头部: magic, 编码, hash函数, 精度(可选), 个数
+ *
+ *      返回值：-1：表示失败 >0:头部的字节数
+ */
+static int
+hll_read_header( const uint8_t * src, int src_len, uint8_t * encoding, uint8_t * hash_type, int * precision, uint32_t * ele_num )
+{
+    int read_len = 0;
+
+    if ( src_len < HLL_MAGIC_BYTES + 2 ) return -1;
+
+    // 校验：HLL_MAGIC  "HLL"
+    if ( src[0] != 'H' || src[1] != 'L' || src[2] != 'L' ) return -1;
+    read_len += HLL_MAGIC_BYTES;
+
+    *encoding  = HLL_HDR_ENCODING( src[ read_len ] );               // 读取编码方式
+    *hash_type = HLL_HDR_HASH( src[ read_len ] );                   // 读取hash函数
+    *precision = HLL_P;
+    read_len += 1;
+
+    if ( src[ read_len - 1 ] & HLL_HDR_PRECISION )                  // 读取精度
+    {
+        *precision = src[ read_len ];
+        read_len += 1;
+    }
+
+    read_len += varint_decode_uint32( src + read_len, ele_num );
+
+    return read_len;
+}
+
+
+
+/**
+ * 解析序列化的稀疏列表的头部: p', 条数, 字节数, p' 不能比 精度 p 低
+ *      read_len: 输入时是开始的位置，返回时是 压缩数据开始的位置
+ *
+ *      返回值：-1：表示失败 0:表示成功
+ */
+static int
+hll_slist_read_header( const uint8_t * src, int src_len, int p, int * read_len, int * sparse_p, uint32_t * num, uint32_t * bytes )
+{
+    int pos = *read_len;
+
+    if ( src_len < pos + 3 )                                        // p' 1个字节, 两个varint 至少各1个字节
+        return -1;
+
+    *sparse_p = src[ pos ];
+    pos += 1;
+
+    if ( *sparse_p < p || *sparse_p > HLL_SPARSE_P ) return -1;
+
+    pos += varint_decode_uint32( src + pos, num );
+    pos += varint_decode_uint32( src + pos, bytes );
+
+    if ( src_len < pos + (long)*bytes ) return -1;                  // 避免读越界
+
+    *read_len = pos;
+    return 0;
+}
+
+
+
+/** 从序列化的数据中 读出稀疏列表，sl 需要是空的 */
+static int
+hll_slist_read( hll_slist_t * sl, const uint8_t * src, int src_len, int p, int * read_len )
+{
+    int      sparse_p;
+    uint32_t num, bytes;
+
+    if ( -1 == hll_slist_read_header( src, src_len, p, read_len, &sparse_p, &num, &bytes ) )
+        return -1;
+
+    if ( sl->cap < (int)bytes )
+    {
+        int cap = sl->cap;
+        while ( cap < (int)bytes ) cap *= 2;
+
+        uint8_t * data = (uint8_t *)realloc( sl->data, cap );
+        if ( NULL == data ) return -1;
+
+        sl->data = data;
+        sl->cap  = cap;
+    }
+
+    memcpy( sl->data, src + *read_len, bytes );
+
+    sl->sparse_p = sparse_p;
+    sl->num      = num;
+    sl->bytes    = bytes;
+    sl->tmp_num  = 0;
+
+    *read_len += bytes;
+    return 0;
+}
+
+
+
+hll_ctx_t * hll_ctx_unSerialize( const uint8_t * src, int src_len, int * read_bytes )
+{
+    if ( NULL == src ) return NULL;
+
+    uint8_t  encoding, hash_type;
+    int      precision;
+    uint32_t ele_num;
+
+    int read_len = hll_read_header( src, src_len, &encoding, &hash_type, &precision, &ele_num );
+    if ( -1 == read_len ) return NULL;
+
+    if ( HLL_ENC_BLOCK == encoding )                                // 分块格式, 按原来的稠密编码 创建对象
+    {
+        if ( src_len < read_len + 2 || !HLL_IS_DENSE( src[ read_len + 1 ] ) ) return NULL;
+
+        hll_ctx_t * thiz = hll_ctx_create_with_precision( src[ read_len + 1 ], hash_type, precision );
+        if ( NULL == thiz ) return NULL;
+
+        if ( -1 == hll_ctx_merge_block( thiz, src, src_len, &read_len, precision ) )
+        {
+            hll_ctx_free( thiz );
+            return NULL;
+        }
+
+        thiz->ele_num = ele_num;
+        *read_bytes   = read_len;
+        return thiz;
+    }
+
+    if ( HLL_ENC_DELTA == encoding )                                // 增量 展开成一个稠密的对象
+    {
+        hll_ctx_t * thiz = hll_ctx_create_with_precision( HLL_DENSE, hash_type, precision );
+        if ( NULL == thiz ) return NULL;
+
+        if ( -1 == hll_ctx_merge_delta( thiz, src, src_len, &read_len, precision ) )
+        {
+            hll_ctx_free( thiz );
+            return NULL;
+        }
+
+        thiz->ele_num = ele_num;
+        *read_bytes   = read_len;
+        return thiz;
+    }
+
+    hll_ctx_t * thiz = hll_ctx_create_with_precision( encoding, hash_type, precision );   // 重要:根据编码创建对象
+    if ( NULL == thiz ) return NULL;
+
+    if ( thiz->encoding != encoding )                               // 低精度不会有稀疏编码的数据
+        goto failed;
+
+    thiz->ele_num = ele_num;
+
+    if ( HLL_SPARSE == encoding )                                   // 稀疏编码方式
+    {
+        if ( src_len < ( read_len + HLL_REGI_MAX_BYTES ) )          // 避免读越界
+            goto failed;
+
+        memcpy( thiz->regi_arr, src + read_len, HLL_REGI_MAX_BYTES );
+        read_len += HLL_REGI_MAX_BYTES;
+
+        goto success;
+    }
+
+    if ( HLL_SPARSE_LIST == encoding )                              // 稀疏列表
+    {
+        if ( -1 == hll_slist_read( thiz->slist, src, src_len, precision, &read_len ) )
+            goto failed;
+
+        goto success;
+    }
+
+    // 稠密编码方式
+    if ( thiz->ele_num < HLL_SERIAL_SPARSE_MIN( precision ) )
+    {
+        hll_ctx_merge_rle( thiz, src, src_len, &read_len, precision );
+    }
+    else
+    {
+        if ( src_len < ( read_len + HLL_DENSE_BYTES( encoding, precision ) ) )     // 读边界保护
+            goto failed;
+
+        memcpy( thiz->registers, src + read_len, HLL_DENSE_BYTES( encoding, precision ) );
+        read_len += HLL_DENSE_BYTES( encoding, precision );
+    }
+
+success:
+    *read_bytes = read_len;
+    return thiz;
+
+failed:
+    hll_ctx_free( thiz );
+    return NULL;
+}
+
+
+
+/**
+ * 稀疏+稀疏 的合并：数据逐个写入稀疏的 thiz, 不先转成稠密
+ *      写入时 子区域满了/列表超过稠密的大小 会自动转成稠密, 剩下的继续写稠密的桶, 结果和先转稠密再合并的一样
+ *      只有稀疏编码(HLL_SPARSE / HLL_SPARSE_LIST)的 thiz 才能调用
+ */
+
+/** 写入一个 精度 src_p 的桶. 返回值：-1：表示失败 0:表示成功 */
+static inline int
+hll_ctx_sparse_merge_regi( hll_ctx_t * thiz, uint64_t index, uint8_t count, int src_p )
+{
+    if ( src_p != thiz->precision )
+        count = hll_fold_regi( index, count, src_p, thiz->precision, &index );
+
+    return hll_ctx_set_regi( thiz, index, count );
+}
+
+
+/** 写入稀疏精度 sparse_p 的一个条目, thiz 也是稀疏列表 且 p' 不更高时 直接折叠成条目. 返回值：-1：表示失败 0:表示成功 */
+static inline int
+hll_ctx_sparse_merge_entry( hll_ctx_t * thiz, uint32_t entry, int sparse_p )
+{
+    uint64_t index;
+
+    if ( HLL_SPARSE_LIST == thiz->encoding && sparse_p >= thiz->slist->sparse_p )
+    {
+        uint8_t rank = hll_fold_regi( HLL_SLIST_KEY( entry ), HLL_SLIST_RANK( entry ), sparse_p, thiz->slist->sparse_p, &index );
+
+        return hll_ctx_slist_add( thiz, (uint32_t)( index << 6 ) | rank );
+    }
+
+    uint8_t count = hll_slist_to_regi( entry, sparse_p, thiz->precision, &index );
+
+    return hll_ctx_set_regi( thiz, index, count );
+}
+
+
+/** 合并精度 src_p 的稀疏数组. 返回值：-1：表示失败 0:表示成功 */
+static int
+hll_ctx_sparse_merge_regi_arr( hll_ctx_t * thiz, const hll_regi_t * regi_arr, int src_p )
+{
+    for ( int i = 0; i < HLL_REGI_MAX; i++ )
+    {
+        hll_regi_t curr = regi_arr[ i ];
+
+        if ( curr.count == 0 )                      continue;
+        if ( curr.index >= HLL_REGISTERS( src_p ) ) continue;
+
+        if ( -1 == hll_ctx_sparse_merge_regi( thiz, curr.index, curr.count, src_p ) ) return -1;
+    }
+
+    return 0;
+}
+
+
+/** 合并稀疏列表的数据 和还没有合并进去的 tmp. 返回值：-1：表示失败 0:表示成功 */
+static int
+hll_ctx_sparse_merge_slist( hll_ctx_t * thiz, int sparse_p, const uint8_t * data, int bytes, int num,
+                            const uint32_t * tmp, int tmp_num )
+{
+    int      pos   = 0;
+    uint32_t entry = 0;
+
+    for ( int i = 0; i < num && pos < bytes; i++ )
+    {
+        uint32_t delta = 0;
+
+        pos   += varint_decode_uint32( data + pos, &delta );
+        entry += delta;
+
+        if ( -1 == hll_ctx_sparse_merge_entry( thiz, entry, sparse_p ) ) return -1;
+    }
+
+    for ( int i = 0; i < tmp_num; i++ )
+        if ( -1 == hll_ctx_sparse_merge_entry( thiz, tmp[ i ], sparse_p ) ) return -1;
+
+    return 0;
+}
+
+
+/**
+ * 稀疏的 thiz 能不能直接合并 编码是 encoding 的稀疏数据(稀疏列表的 p' 是 sparse_p, 有 num 条/bytes 字节)
+ *      HLL_SPARSE 的 thiz: 总共只有 512 个位置, 明显放不下的 直接转成稠密 再合并更快
+ *      HLL_SPARSE_LIST 的 thiz: 只接受 p' 不更低的稀疏列表, 两边的大小加起来 不超过稠密编码的大小;
+ *          桶没有完整的hash, 构造出来的条目 和真实的条目重复时 线性计数会偏大, 所以 HLL_SPARSE 的数据 还是转成稠密
+ */
+static int
+hll_ctx_sparse_mergeable( hll_ctx_t * thiz, uint8_t encoding, int sparse_p, long num, long bytes )
+{
+    if ( HLL_SPARSE == thiz->encoding )
+        return HLL_SPARSE == encoding || num <= HLL_REGI_MAX;
+
+    if ( HLL_SPARSE_LIST != encoding || sparse_p < thiz->slist->sparse_p ) return 0;
+
+    return thiz->slist->bytes + bytes <= HLL_DENSE_BYTES( thiz->dense_encoding, thiz->precision );
+}
+
+
+
+int hll_ctx_merge( hll_ctx_t * thiz, hll_ctx_t * for_merge )
+{
+    if ( NULL == thiz )      return -1;
+    if ( NULL == for_merge ) return -1;
+
+    if ( thiz->hash_type != for_merge->hash_type )          // hash函数不同的不能合并
+        return -1;
+
+    if ( thiz->precision > for_merge->precision )           // 低精度的 不能合并到高精度的中
+        return -1;
+
+    if ( thiz == for_merge ) return 0;                      // 和自己的并集 就是自己
+
+    uint8_t encoding = for_merge->encoding;
+    int     ele_num  = 0;
+
+    if ( !HLL_IS_DENSE( thiz->encoding ) )                  // 稀疏+稀疏 放得下的 保持稀疏
+    {
+        hll_slist_t * sl = for_merge->slist;
+
+        if ( HLL_SPARSE == encoding && hll_ctx_sparse_mergeable( thiz, encoding, 0, HLL_REGI_MAX, 0 ) )
+            return hll_ctx_sparse_merge_regi_arr( thiz, for_merge->regi_arr, for_merge->precision );
+
+        if ( HLL_SPARSE_LIST == encoding
+             && hll_ctx_sparse_mergeable( thiz, encoding, sl->sparse_p, sl->num + sl->tmp_num, sl->bytes ) )
+            return hll_ctx_sparse_merge_slist( thiz, sl->sparse_p, sl->data, sl->bytes, sl->num, sl->tmp, sl->tmp_num );
+    }
+
+    if ( -1 == hll_ctx_sparse_to_dense( thiz ) )            // 转成稠密编码
+        return -1;
+
+    if ( HLL_SPARSE == encoding )
+    {
+        ele_num = hll_ctx_merge_regi_arr( thiz, for_merge->regi_arr, for_merge->precision );
+    }
+    else if ( HLL_SPARSE_LIST == encoding )
+    {
+        hll_slist_t * sl = for_merge->slist;
+
+        ele_num = hll_ctx_merge_slist( thiz, sl->sparse_p, sl->data, sl->bytes, sl->num, sl->tmp, sl->tmp_num );
+    }
+    else if ( HLL_DENSE == encoding || HLL_DENSE_PACKED == encoding )
+    {
+        ele_num = hll_ctx_merge_dense( thiz, for_merge->registers, encoding, for_merge->precision );
+    }
+    else
+    {
+        return -1;
+    }
+
+    thiz->ele_num += ele_num;
+
+    if ( ele_num > 0 ) hll_ctx_invalidate( thiz );
+    return 0;
+}
+
+
+
+int hll_ctx_merge_many( hll_ctx_t * thiz, hll_ctx_t ** for_merges, int n )
+{
+    if ( NULL == thiz )       return -1;
+    if ( NULL == for_merges ) return -1;
+
+    // 先整体检查一遍，避免合并了一半才失败
+    for ( int k = 0; k < n; k++ )
+    {
+        hll_ctx_t * cur = for_merges[ k ];
+
+        if ( NULL == cur )                           return -1;
+        if ( cur->hash_type != thiz->hash_type )     return -1;
+        if ( cur->precision < thiz->precision )      return -1;
+        if ( HLL_IS_DENSE( cur->encoding ) && NULL == cur->registers ) return -1;
+        if ( HLL_SPARSE == cur->encoding && NULL == cur->regi_arr )    return -1;
+        if ( HLL_SPARSE_LIST == cur->encoding && NULL == cur->slist )  return -1;
+    }
+
+    if ( -1 == hll_ctx_sparse_to_dense( thiz ) )            // 转成稠密编码
+        return -1;
+
+    const hll_kernel_t * kernel  = hll_kernel();
+    int                  ele_num = 0;
+    int                  p       = thiz->precision;
+    long                 tlen    = HLL_TILE( p );
+    uint8_t              acc[ HLL_MERGE_TILE ];
+    uint8_t              dst_tile[ HLL_MERGE_TILE ];
+    uint8_t              src_tile[ HLL_MERGE_TILE ];
+
+    // 按块处理，一个块的 dst 只读写一次，所有精度相同的稠密的 src 在L1里面累加 max
+    for ( long off = 0; off < HLL_REGISTERS( p ); off += tlen )
+    {
+        uint8_t * d = hll_dense_tile( thiz->registers, thiz->encoding, off, dst_tile, tlen );
+
+        memcpy( acc, d, tlen );
+
+        for ( int k = 0; k < n; k++ )
+        {
+            hll_ctx_t * cur = for_merges[ k ];
+
+            if ( HLL_IS_DENSE( cur->encoding ) && cur->precision == p )
+                kernel->merge_max( acc, hll_dense_tile( cur->registers, cur->encoding, off, src_tile, tlen ), tlen );
+        }
+
+        if ( NULL != thiz->dirty ) hll_ctx_dirty_diff( thiz, off, d, acc, tlen );   // acc 是合并后的值
+
+        int changed = kernel->merge_count( d, acc, tlen );
+
+        if ( changed > 0 )
+            hll_dense_tile_store( thiz->registers, thiz->encoding, off, d, tlen );
+
+        ele_num += changed;
+    }
+
+    // 稀疏的 数量很少，直接写; 精度更高的稠密的 折叠后写
+    for ( int k = 0; k < n; k++ )
+    {
+        hll_ctx_t * cur = for_merges[ k ];
+
+        if ( HLL_IS_DENSE( cur->encoding ) && cur->precision != p )
+            ele_num += hll_ctx_fold_dense( thiz, cur->registers, cur->encoding, cur->precision );
+
+        if ( HLL_SPARSE == cur->encoding )
+            ele_num += hll_ctx_merge_regi_arr( thiz, cur->regi_arr, cur->precision );
+
+        if ( HLL_SPARSE_LIST == cur->encoding )
+            ele_num += hll_ctx_merge_slist( thiz, cur->slist->sparse_p, cur->slist->data, cur->slist->bytes,
+                                            cur->slist->num, cur->slist->tmp, cur->slist->tmp_num );
+    }
+
+    thiz->ele_num += ele_num;
+
+    if ( ele_num > 0 ) hll_ctx_invalidate( thiz );
+    return 0;
+}
+
+
+
+int hll_ctx_fast_merge( hll_ctx_t * thiz, const uint8_t * src, int src_len )
+{
+    if ( NULL == thiz || NULL == src ) return -1;
+
+    int      ele_num  = 0;
+    uint8_t  encoding = 0;
+    uint8_t  hash_type;
+    int      src_p;
+    int      sparse_p = 0;
+    uint32_t num      = 0;
+    uint32_t bytes    = 0;
+
+    int read_len = hll_read_header( src, src_len, &encoding, &hash_type, &src_p, (uint32_t *)&ele_num );
+    if ( -1 == read_len ) return -1;
+
+    if ( hash_type != thiz->hash_type )                             // hash函数不同的不能合并
+        return -1;
+
+    if ( src_p < thiz->precision || src_p > HLL_PRECISION_MAX )     // 低精度的 不能合并到高精度的中
+        return -1;
+
+    if ( !HLL_IS_DENSE( thiz->encoding ) && HLL_SPARSE == encoding    // 稀疏+稀疏 保持稀疏
+         && hll_ctx_sparse_mergeable( thiz, encoding, 0, HLL_REGI_MAX, 0 ) )
+    {
+        if ( src_len < ( read_len + HLL_REGI_MAX_BYTES ) )          // 避免读越界
+            return -1;
+
+        if ( -1 == hll_ctx_sparse_merge_regi_arr( thiz, (const hll_regi_t *)( src + read_len ), src_p ) )
+            return -1;
+
+        return read_len + HLL_REGI_MAX_BYTES;
+    }
+
+    if ( !HLL_IS_DENSE( thiz->encoding ) && HLL_SPARSE_LIST == encoding )
+    {
+        int pos = read_len;
+
+        if ( -1 == hll_slist_read_header( src, src_len, src_p, &pos, &sparse_p, &num, &bytes ) )
+            return -1;
+
+        if ( hll_ctx_sparse_mergeable( thiz, encoding, sparse_p, num, bytes ) )
+        {
+            if ( -1 == hll_ctx_sparse_merge_slist( thiz, sparse_p, src + pos, bytes, num, NULL, 0 ) )
+                return -1;
+
+            return pos + bytes;
+        }
+    }
+
+    if ( -1 == hll_ctx_sparse_to_dense( thiz ) )                    // 转成稠密编码
+        return -1;
+
+    if ( HLL_SPARSE == encoding )                                   // 稀疏编码方式
+    {
+        if ( src_len < ( read_len + HLL_REGI_MAX_BYTES ) )          // 避免读越界
+            goto failed;
+
+        ele_num = hll_ctx_merge_regi_arr( thiz, (hll_regi_t *)( src + read_len ), src_p );   // 强行转换
+        read_len += HLL_REGI_MAX_BYTES;
+
+        goto success;
+    }
+
+    if ( HLL_SPARSE_LIST == encoding )                              // 稀疏列表
+    {
+        if ( -1 == hll_slist_read_header( src, src_len, src_p, &read_len, &sparse_p, &num, &bytes ) )
+            goto failed;
+
+        ele_num   = hll_ctx_merge_slist( thiz, sparse_p, src + read_len, bytes, num, NULL, 0 );
+        read_len += bytes;
+
+        goto success;
+    }
+
+    if ( HLL_ENC_BLOCK == encoding )                                // 分块格式
+    {
+        ele_num = hll_ctx_merge_block( thiz, src, src_len, &read_len, src_p );
+        if ( -1 == ele_num ) goto failed;
+
+        goto success;
+    }
+
+    if ( HLL_ENC_DELTA == encoding )                                // 增量
+    {
+        ele_num = hll_ctx_merge_delta( thiz, src, src_len, &read_len, src_p );
+        if ( -1 == ele_num ) goto failed;
+
+        goto success;
+    }
+
+    if ( HLL_DENSE != encoding && HLL_DENSE_PACKED != encoding )
+        goto failed;
+
+    // 稠密编码方式
+    if ( ele_num < HLL_SERIAL_SPARSE_MIN( src_p ) )
+    {
+        ele_num = hll_ctx_merge_rle( thiz, src, src_len, &read_len, src_p );
+    }
+    else
+    {
+        if ( src_len < ( read_len + HLL_DENSE_BYTES( encoding, src_p ) ) )     // 读边界保护
+            goto failed;
+
+        ele_num = hll_ctx_merge_dense( thiz, src + read_len, encoding, src_p );
+        read_len += HLL_DENSE_BYTES( encoding, src_p );
+    }
+
+success:
+    thiz->ele_num += ele_num;
+
+    if ( ele_num > 0 ) hll_ctx_invalidate( thiz );
+    return read_len;
+
+failed:
+    return -1;
+}
+
+
+
+int hll_ctx_apply_delta( hll_ctx_t * thiz, const uint8_t * src, int src_len )
+{
+    return hll_ctx_fast_merge( thiz, src, src_len );
+}
+
+
+
+/** 超出范围的值 说明数据损坏了. 返回值：-1：表示失败 0:表示成功 */
+static int
+hll_histo_check( const int * reghisto, int p )
+{
+    for ( int i = HLL_Q( p ) + 2; i < HLL_RAW_HISTO_SIZE; i++ )
+        if ( 0 != reghisto[ i ] ) return -1;
+
+    return 0;
+}
+
+
+
+/**
+ * 从 val:num 格式的数据 直接统计直方图，桶的总数超过 m 的部分忽略，不足的算作0
+ *      返回值：-1：表示失败 0:表示成功
+ */
+static int
+hll_rle_histo_build( const uint8_t * src, int src_len, int pos, long m, int * reghisto )
+{
+    uint8_t   val   = 0;
+    uint32_t  num   = 0;
+    long      total = 0;
+
+    while ( pos < src_len && (val = src[ pos ++ ]) != ( 1 << HLL_BITS ) )    // 一直循环到哨兵
+    {
+        if ( val >= HLL_HISTO_SIZE ) return -1;                     // 不可能出现的值
+
+        pos += varint_decode_uint32( src + pos, &num );
+
+        if ( total + num > m ) num = m - total;                     // 写边界保护
+
+        reghisto[ val ] += num;
+        total           += num;
+    }
+
+    reghisto[ 0 ] += m - total;
+    return 0;
+}
+
+
+
+int64_t hll_count_serialized( const uint8_t * src, int src_len )
+{
+    if ( NULL == src ) return -1;
+
+    uint8_t  encoding, hash_type;
+    int      p;
+    uint32_t ele_num;
+
+    int read_len = hll_read_header( src, src_len, &encoding, &hash_type, &p, &ele_num );
+    if ( -1 == read_len ) return -1;
+
+    if ( p < HLL_PRECISION_MIN || p > HLL_PRECISION_MAX ) return -1;
+
+    long m = HLL_REGISTERS( p );
+    int  reghisto[ HLL_RAW_HISTO_SIZE ];                            // 原样的稠密数据 每个字节都可能出现
+
+    memset( reghisto, 0, sizeof( reghisto ) );
+
+    if ( HLL_SPARSE == encoding )                                   // 稀疏编码方式，只看每个位置的值
+    {
+        if ( src_len < ( read_len + HLL_REGI_MAX_BYTES ) )          // 避免读越界
+            return -1;
+
+        const hll_regi_t * regi_arr = (const hll_regi_t *)( src + read_len );
+
+        for ( int i = 0; i < HLL_REGI_MAX; i++ )
+            reghisto[ regi_arr[ i ].count ]++;
+
+        reghisto[ 0 ] += ( m - HLL_REGI_MAX );
+    }
+    else if ( HLL_SPARSE_LIST == encoding )                         // 稀疏列表 线性计数 只需要条数
+    {
+        int      sparse_p;
+        uint32_t num, bytes;
+
+        if ( -1 == hll_slist_read_header( src, src_len, p, &read_len, &sparse_p, &num, &bytes ) )
+            return -1;
+
+        return (int64_t)hll_slist_estimate( sparse_p, num );
+    }
+    else if ( HLL_ENC_BLOCK == encoding )                           // 分块格式, 逐块解码后统计
+    {
+        int     blk = HLL_BLOCK_REGS( p );
+        uint8_t regs[ 64 ];
+
+        if ( src_len < read_len + 2 || HLL_BLOCK_VERSION != src[ read_len ] ) return -1;
+        read_len += 2;
+
+        for ( long b = 0; b < m; b += blk )
+        {
+            if ( read_len < src_len && 0 == src[ read_len ] )       // 全0的块
+            {
+                reghisto[ 0 ] += blk;
+                read_len      += 1;
+                continue;
+            }
+
+            if ( -1 == hll_block_decode( src, src_len, &read_len, regs, blk ) ) return -1;
+
+            hll_histo_add( reghisto, regs, blk );
+        }
+    }
+    else if ( HLL_DENSE != encoding && HLL_DENSE_PACKED != encoding )
+    {
+        return -1;
+    }
+    else if ( ele_num < HLL_SERIAL_SPARSE_MIN( p ) )                // val:num 的格式
+    {
+        if ( -1 == hll_rle_histo_build( src, src_len, read_len, m, reghisto ) )
+            return -1;
+    }
+    else                                                            // 原样的稠密数据
+    {
+        if ( src_len < ( read_len + HLL_DENSE_BYTES( encoding, p ) ) )     // 读边界保护
+            return -1;
+
+        long    tlen = HLL_TILE( p );
+        uint8_t tile[ HLL_MERGE_TILE ];
+
+        for ( long off = 0; off < m; off += tlen )
+            hll_histo_add( reghisto, hll_dense_tile( src + read_len, encoding, off, tile, tlen ), tlen );
+    }
+
+    if ( -1 == hll_histo_check( reghisto, p ) ) return -1;
+
+    return (int64_t)hll_histo_estimate( reghisto, p );
+}
+
+
+
+/** 并集计算中 原样存放的稠密输入, 可以按块随机访问 */
+typedef struct hll_union_src_s
+{
+    const uint8_t * registers;
+    uint8_t         encoding;                                       /* HLL_DENSE or HLL_DENSE_PACKED */
+    uint8_t         precision;
+} hll_union_src_t;
+
+
+/** 并集计算中 一个线程的任务: 处理 [begin, end) 这些桶，统计到自己的直方图 */
+typedef struct hll_union_job_s
+{
+    const hll_union_src_t * srcs;
+    int                     nsrc;
+    uint8_t               * base;                                   /* 非原样的输入 预先合并到这里, 也是每一块的累加区 */
+    int                     p;
+    long                    begin;
+    long                    end;
+    int                     threaded;                               /* 1: 在新创建的线程中执行, 需要 join */
+    int                     reghisto[ HLL_RAW_HISTO_SIZE ];
+} hll_union_job_t;
+
+
+
+/**
+ * 精度更高的稠密输入 折叠到 acc 上, acc 是目标精度下 [off, off+tlen) 这一块
+ *      目标精度的第 i 个桶 对应输入中 i + k*2^dst_p 这些桶, k 就是多出来的那几位
+ *      k 不为0 时 折叠后的值只由 k 决定; k 为0 时 是原值加上多出来的位数
+ */
+static void
+hll_union_fold_tile( uint8_t * acc, const hll_union_src_t * src, int dst_p, long off, long tlen )
+{
+    uint8_t   tile[ HLL_MERGE_TILE ];
+    uint64_t  kmax = 1ULL << ( src->precision - dst_p );
+
+    for ( uint64_t k = 0; k < kmax; k++ )
+    {
+        const uint8_t * s = hll_dense_tile( src->registers, src->encoding,
+                                            (long)( k << dst_p ) + off, tile, tlen );
+
+        uint8_t c = ( 0 == k ) ? 0 : (uint8_t)( __builtin_ctzll( k ) + 1 );
+
+        for ( long i = 0; i < tlen; i++ )
+        {
+            if ( 0 == s[ i ] ) continue;
+
+            uint8_t v = ( 0 == k ) ? (uint8_t)( s[ i ] + src->precision - dst_p ) : c;
+
+            if ( v > acc[ i ] ) acc[ i ] = v;
+        }
+    }
+}
+
+
+
+static void *
+hll_union_worker( void * arg )
+{
+    hll_union_job_t    * job    = (hll_union_job_t *)arg;
+    const hll_kernel_t * kernel = hll_kernel();
+    long                 tlen   = HLL_TILE( job->p );
+    uint8_t              tile[ HLL_MERGE_TILE ];
+
+    memset( job->reghisto, 0, sizeof( job->reghisto ) );
+
+    for ( long off = job->begin; off < job->end; off += tlen )
+    {
+        uint8_t * acc = job->base + off;                            // 各线程的块 互不重叠
+
+        for ( int k = 0; k < job->nsrc; k++ )
+        {
+            const hll_union_src_t * src = job->srcs + k;
+
+            if ( src->precision == job->p )
+                kernel->merge_max( acc, hll_dense_tile( src->registers, src->encoding, off, tile, tlen ), tlen );
+            else
+                hll_union_fold_tile( acc, src, job->p, off, tlen );
+        }
+
+        hll_histo_add( job->reghisto, acc, tlen );
+    }
+
+    return NULL;
+}
+
+
+
+int64_t hll_union_count_parallel( const uint8_t ** blobs, const int * lens, int n, int nthreads )
+{
+    if ( NULL == blobs || NULL == lens || n < 0 ) return -1;
+    if ( 0 == n ) return 0;
+
+    uint8_t  encoding, hash_type;
+    int      p, min_p = HLL_PRECISION_MAX;
+    uint32_t ele_num;
+
+    // 先整体检查一遍，找到最低的精度
+    for ( int k = 0; k < n; k++ )
+    {
+        if ( NULL == blobs[ k ] ) return -1;
+
+        if ( -1 == hll_read_header( blobs[ k ], lens[ k ], &encoding, &hash_type, &p, &ele_num ) )
+            return -1;
+
+        if ( p < HLL_PRECISION_MIN || p > HLL_PRECISION_MAX ) return -1;
+
+        if ( p < min_p ) min_p = p;
+    }
+
+    int64_t            card  = -1;
+    long               m     = HLL_REGISTERS( min_p );
+    long               tlen  = HLL_TILE( min_p );
+    int                nsrc  = 0;
+    hll_union_src_t  * srcs  = (hll_union_src_t *)malloc( sizeof(hll_union_src_t) * n );
+    hll_union_job_t  * jobs  = NULL;
+    pthread_t        * tids  = NULL;
+    hll_ctx_t          base;
+
+    memset( &base, 0, sizeof( base ) );                             // 只用到稠密的桶，不需要完整的对象
+    base.encoding  = HLL_DENSE;
+    base.precision = min_p;
+    base.registers = (uint8_t *)calloc( m, sizeof(uint8_t) );
+
+    if ( NULL == srcs || NULL == base.registers ) goto done;
+
+    // 原样的稠密输入 记下位置, 其余的(稀疏, val:num)数据量很小，直接合并到 base 中
+    for ( int k = 0; k < n; k++ )
+    {
+        int read_len = hll_read_header( blobs[ k ], lens[ k ], &encoding, &hash_type, &p, &ele_num );
+
+        if ( 0 == k ) base.hash_type = hash_type;
+        if ( hash_type != base.hash_type ) goto done;               // hash函数不同的不能合并
+
+        if ( HLL_IS_DENSE( encoding ) && ele_num >= HLL_SERIAL_SPARSE_MIN( p ) )
+        {
+            if ( lens[ k ] < read_len + HLL_DENSE_BYTES( encoding, p ) )     // 读边界保护
+                goto done;
+
+            srcs[ nsrc ].registers = blobs[ k ] + read_len;
+            srcs[ nsrc ].encoding  = encoding;
+            srcs[ nsrc ].precision = p;
+            nsrc++;
+        }
+        else if ( -1 == hll_ctx_fast_merge( &base, blobs[ k ], lens[ k ] ) )
+        {
+            goto done;
+        }
+    }
+
+    {
+        long ntiles = m / tlen;
+
+        if ( nthreads < 1 )      nthreads = 1;
+        if ( nthreads > ntiles ) nthreads = ntiles;
+
+        jobs = (hll_union_job_t *)calloc( nthreads, sizeof(hll_union_job_t) );
+        tids = (pthread_t *)calloc( nthreads, sizeof(pthread_t) );
+        if ( NULL == jobs || NULL == tids ) goto done;
+
+        int reghisto[ HLL_RAW_HISTO_SIZE ];
+        memset( reghisto, 0, sizeof( reghisto ) );
+
+        // 按块平均分配，第 0 个任务 在当前线程执行
+        for ( int t = 0; t < nthreads; t++ )
+        {
+            jobs[ t ].srcs  = srcs;
+            jobs[ t ].nsrc  = nsrc;
+            jobs[ t ].base  = base.registers;
+            jobs[ t ].p     = min_p;
+            jobs[ t ].begin = ntiles * t / nthreads * tlen;
+            jobs[ t ].end   = ntiles * ( t + 1 ) / nthreads * tlen;
+
+            if ( 0 == t ) continue;
+
+            if ( 0 == pthread_create( &tids[ t ], NULL, hll_union_worker, &jobs[ t ] ) )
+                jobs[ t ].threaded = 1;
+            else
+                hll_union_worker( &jobs[ t ] );                     // 创建线程失败的 自己做
+        }
+
+        hll_union_worker( &jobs[ 0 ] );
+
+        for ( int t = 0; t < nthreads; t++ )
+        {
+            if ( jobs[ t ].threaded ) pthread_join( tids[ t ], NULL );
+
+            for ( int i = 0; i < HLL_RAW_HISTO_SIZE; i++ )
+                reghisto[ i ] += jobs[ t ].reghisto[ i ];
+        }
+
+        if ( 0 == hll_histo_check( reghisto, min_p ) )
+            card = (int64_t)hll_histo_estimate( reghisto, min_p );
+    }
+
+done:
+    if ( NULL != srcs )           free( srcs );
+    if ( NULL != jobs )           free( jobs );
+    if ( NULL != tids )           free( tids );
+    if ( NULL != base.registers ) free( base.registers );
+
+    return card;
+}
+
+
+
+int64_t hll_union_count( const uint8_t ** blobs, const int * lens, int n )
+{
+    return hll_union_count_parallel( blobs, lens, n, 1 );
+}
+
+
+
+/** 联合估算用到的直方图: K1/K2 是 A/B 在同一个桶的值 */
+typedef struct hll_joint_histo_s
+{
+    int     a_lt[ HLL_HISTO_SIZE ];                                 /* K1 < K2 的桶, K1 的直方图 */
+    int     b_gt[ HLL_HISTO_SIZE ];                                 /* K1 < K2 的桶, K2 的直方图 */
+    int     a_gt[ HLL_HISTO_SIZE ];                                 /* K1 > K2 的桶, K1 的直方图 */
+    int     b_lt[ HLL_HISTO_SIZE ];                                 /* K1 > K2 的桶, K2 的直方图 */
+    int     eq[ HLL_HISTO_SIZE ];                                   /* K1 == K2 的桶 */
+} hll_joint_histo_t;
+
+
+#define HLL_JOINT_TABLE             ( 64 * 64 )                     /* (K1, K2) 联合计数的表 */
+#define HLL_JOINT_LANES             4                               /* 表的份数, 每份最多 2^16/4 个桶 不会溢出 */
+#define HLL_JOINT_ITER_MAX          100
+#define HLL_JOINT_LAMBDA_MIN        1e-10                           /* 每个桶的速率的下限, 对应的基数可以看成0 */
+#define HLL_JOINT_BLOCK             16                              /* 两两估算时 每块的对象数 */
+
+
+
+/**
+ * 统计两组桶的联合直方图
+ *      先按 (K1, K2) 计数, 没有分支; 再按 K1 和 K2 的大小关系 分到5个直方图中
+ *      table: HLL_JOINT_LANES * HLL_JOINT_TABLE 个计数
+ *      返回值：-1：表示桶的值超出了精度 p 的范围
+ */
+static int
+hll_joint_histo_build( const uint8_t * r1, const uint8_t * r2, int p, uint16_t * table, hll_joint_histo_t * h )
+{
+    long m   = HLL_REGISTERS( p );
+    int  top = HLL_Q( p ) + 1;
+
+    memset( table, 0, sizeof(uint16_t) * HLL_JOINT_TABLE * HLL_JOINT_LANES );
+    memset( h, 0, sizeof( *h ) );
+
+    // 相邻的桶 大多落在同一格, 分到几张表中 避免连续地读改写同一个地址
+    uint16_t * t0 = table;
+    uint16_t * t1 = table + HLL_JOINT_TABLE;
+    uint16_t * t2 = table + HLL_JOINT_TABLE * 2;
+    uint16_t * t3 = table + HLL_JOINT_TABLE * 3;
+
+    uint8_t max1 = 0, max2 = 0;
+
+    for ( long i = 0; i < m; i += 4 )
+    {
+        t0[ ( ( r1[ i ]     & 63 ) << 6 ) | ( r2[ i ]     & 63 ) ]++;
+        t1[ ( ( r1[ i + 1 ] & 63 ) << 6 ) | ( r2[ i + 1 ] & 63 ) ]++;
+        t2[ ( ( r1[ i + 2 ] & 63 ) << 6 ) | ( r2[ i + 2 ] & 63 ) ]++;
+        t3[ ( ( r1[ i + 3 ] & 63 ) << 6 ) | ( r2[ i + 3 ] & 63 ) ]++;
+    }
+
+    for ( long i = 0; i < m; i++ )                                  // 只需要扫描 出现过的值的范围
+    {
+        if ( r1[ i ] > max1 ) max1 = r1[ i ];
+        if ( r2[ i ] > max2 ) max2 = r2[ i ];
+    }
+
+    if ( max1 > top ) max1 = top;
+    if ( max2 > top ) max2 = top;
+
+    long total = 0;
+    for ( int k1 = 0; k1 <= max1; k1++ )
+    {
+        for ( int k2 = 0; k2 <= max2; k2++ )
+        {
+            int x = ( k1 << 6 ) | k2;
+            int c = (int)t0[ x ] + t1[ x ] + t2[ x ] + t3[ x ];
+            if ( 0 == c ) continue;
+
+            if      ( k1 < k2 ) { h->a_lt[ k1 ] += c;  h->b_gt[ k2 ] += c; }
+            else if ( k1 > k2 ) { h->a_gt[ k1 ] += c;  h->b_lt[ k2 ] += c; }
+            else                { h->eq[ k1 ] += c; }
+
+            total += c;
+        }
+    }
+
+    return ( total == m ) ? 0 : -1;                                 // 有超出范围的值 或者 >= 64 的
+}
+
+
+
+/**
+ * 速率 λ 的泊松过程 在桶值 [lo, hi] 上的 u[k] = exp(-λ/2^k) 和 om[k] = 1 - u[k]
+ *      om 用 expm1 计算, λ 很小时也没有相减的误差
+ */
+static inline void
+hll_joint_powers( double lambda, int lo, int hi, double * u, double * om )
+{
+    for ( int k = lo; k <= hi; k++ )
+    {
+        double x = -ldexp( lambda, -k );
+
+        u[ k ]  = exp( x );
+        om[ k ] = -expm1( x );
+    }
+}
+
+
+
+/**
+ * 桶值 K 的分布: F = P(K <= k), Fm1 = P(K <= k-1), P = P(K = k), 以及 F、Fm1 对 λ 的导数
+ *      k <= q 时 F = exp(-λ/2^k), k = q+1 时 F = 1
+ */
+static inline void
+hll_joint_dist( const double * u, const double * om, int k, int q,
+                double * F, double * Fm1, double * P, double * dF, double * dFm1 )
+{
+    if ( 0 == k )
+    {
+        *F    = u[ 0 ];
+        *Fm1  = 0.0;
+        *P    = u[ 0 ];
+        *dF   = -u[ 0 ];
+        *dFm1 = 0.0;
+    }
+    else if ( k <= q )
+    {
+        double s = ldexp( 1.0, -k );
+
+        *F    = u[ k ];
+        *Fm1  = u[ k - 1 ];
+        *P    = u[ k ] * om[ k ];
+        *dF   = -s * u[ k ];
+        *dFm1 = -2.0 * s * u[ k - 1 ];
+    }
+    else
+    {
+        *F    = 1.0;
+        *Fm1  = u[ q ];
+        *P    = om[ q ];
+        *dF   = 0.0;
+        *dFm1 = -ldexp( u[ q ], -q );
+    }
+}
+
+
+
+/** ln P(K = k) 和它对 λ 的导数 */
+static inline double
+hll_joint_lnp( double lambda, const double * u, const double * om, int k, int q, double * dlnp )
+{
+    if ( 0 == k )
+    {
+        *dlnp = -1.0;
+        return -lambda;
+    }
+
+    if ( k <= q )                                                   // P = u (1-u)
+    {
+        double s = ldexp( 1.0, -k );
+
+        *dlnp = s * ( 2.0 * u[ k ] - 1.0 ) / om[ k ];
+        return -lambda * s + log( om[ k ] );
+    }
+
+    *dlnp = ldexp( u[ q ], -q ) / om[ q ];                          // P = 1-u
+    return log( om[ q ] );
+}
+
+
+
+/**
+ * 对数似然 和对 θ = ln λ 的梯度, λ 是 只在A / 只在B / 两边都有 的每个桶的速率
+ *      K1 < K2 时 K2 只能来自 只在B 的部分, K1 是 只在A+两边都有 的最大值, 两部分独立; K1 > K2 对称;
+ *      K1 == K2 = k 时 要么两边都有的部分 = k, 要么它 < k 而 A、B 各自 = k
+ */
+static double
+hll_joint_loglik( const hll_joint_histo_t * h, const int * ks, int nk, int q, const double * theta, double * grad )
+{
+    double la = exp( theta[ 0 ] ), lb = exp( theta[ 1 ] ), lx = exp( theta[ 2 ] );
+    double L  = 0.0;
+    double ga = 0.0, gb = 0.0, gx = 0.0;
+
+    // 5 种速率: A, B, 两边都有, A+两边都有, B+两边都有; 只算出现过的桶值 和它们的前一个
+    double u[ 5 ][ HLL_HISTO_SIZE ], om[ 5 ][ HLL_HISTO_SIZE ];
+    int    lo = ( ks[ 0 ] > 0 ) ? ks[ 0 ] - 1 : 0;
+    int    hi = ( ks[ nk - 1 ] < q ) ? ks[ nk - 1 ] : q;
+
+    hll_joint_powers( la,      lo, hi, u[ 0 ], om[ 0 ] );
+    hll_joint_powers( lb,      lo, hi, u[ 1 ], om[ 1 ] );
+    hll_joint_powers( lx,      lo, hi, u[ 2 ], om[ 2 ] );
+    hll_joint_powers( la + lx, lo, hi, u[ 3 ], om[ 3 ] );
+    hll_joint_powers( lb + lx, lo, hi, u[ 4 ], om[ 4 ] );
+
+    for ( int i = 0; i < nk; i++ )
+    {
+        int    k = ks[ i ];
+        double v, d;
+
+        if ( h->a_lt[ k ] ) { v = hll_joint_lnp( la + lx, u[ 3 ], om[ 3 ], k, q, &d ); L += h->a_lt[ k ] * v; ga += h->a_lt[ k ] * d; gx += h->a_lt[ k ] * d; }
+        if ( h->b_lt[ k ] ) { v = hll_joint_lnp( lb + lx, u[ 4 ], om[ 4 ], k, q, &d ); L += h->b_lt[ k ] * v; gb += h->b_lt[ k ] * d; gx += h->b_lt[ k ] * d; }
+        if ( h->a_gt[ k ] ) { v = hll_joint_lnp( la, u[ 0 ], om[ 0 ], k, q, &d );      L += h->a_gt[ k ] * v; ga += h->a_gt[ k ] * d; }
+        if ( h->b_gt[ k ] ) { v = hll_joint_lnp( lb, u[ 1 ], om[ 1 ], k, q, &d );      L += h->b_gt[ k ] * v; gb += h->b_gt[ k ] * d; }
+
+        if ( h->eq[ k ] )
+        {
+            double Fa, Fam, Pa, dFa, dFam, Fb, Fbm, Pb, dFb, dFbm, Fx, Fxm, Px, dFx, dFxm;
+
+            hll_joint_dist( u[ 0 ], om[ 0 ], k, q, &Fa, &Fam, &Pa, &dFa, &dFam );
+            hll_joint_dist( u[ 1 ], om[ 1 ], k, q, &Fb, &Fbm, &Pb, &dFb, &dFbm );
+            hll_joint_dist( u[ 2 ], om[ 2 ], k, q, &Fx, &Fxm, &Px, &dFx, &dFxm );
+
+            double E = Px * Fa * Fb + Fxm * Pa * Pb;
+
+            if ( !( E > 0.0 ) ) return -HUGE_VAL;
+
+            L  += h->eq[ k ] * log( E );
+            ga += h->eq[ k ] * ( Px * dFa * Fb + Fxm * ( dFa - dFam ) * Pb ) / E;
+            gb += h->eq[ k ] * ( Px * Fa * dFb + Fxm * Pa * ( dFb - dFbm ) ) / E;
+            gx += h->eq[ k ] * ( ( dFx - dFxm ) * Fa * Fb + dFxm * Pa * Pb ) / E;
+        }
+    }
+
+    if ( NULL != grad )
+    {
+        grad[ 0 ] = ga * la;
+        grad[ 1 ] = gb * lb;
+        grad[ 2 ] = gx * lx;
+    }
+
+    return L;
+}
+
+
+
+/** 3x3 的 A s = g, A 需要是正定的; 返回 -1 表示不正定 */
+static int
+hll_joint_solve3( double A[ 3 ][ 3 ], const double * g, double * s )
+{
+    double M[ 3 ][ 4 ];
+
+    for ( int i = 0; i < 3; i++ )
+    {
+        for ( int j = 0; j < 3; j++ ) M[ i ][ j ] = A[ i ][ j ];
+        M[ i ][ 3 ] = g[ i ];
+    }
+
+    // 不换行的消元, 主元都为正 就是正定的
+    for ( int c = 0; c < 3; c++ )
+    {
+        if ( !( M[ c ][ c ] > 0.0 ) ) return -1;
+
+        for ( int r = c + 1; r < 3; r++ )
+        {
+            double f = M[ r ][ c ] / M[ c ][ c ];
+            for ( int j = c; j < 4; j++ ) M[ r ][ j ] -= f * M[ c ][ j ];
+        }
+    }
+
+    for ( int r = 2; r >= 0; r-- )
+    {
+        double v = M[ r ][ 3 ];
+        for ( int j = r + 1; j < 3; j++ ) v -= M[ r ][ j ] * s[ j ];
+        s[ r ] = v / M[ r ][ r ];
+    }
+
+    return 0;
+}
+
+
+
+/**
+ * 由联合直方图 求最大似然的估算值
+ *      在 θ = ln λ 上做 Newton 迭代, Hessian 用梯度的差分; 不是负定 或者似然没有增加时 加大阻尼 (Levenberg)
+ *      初值用 各自的估算值 和并集的估算值 容斥得到
+ */
+static void
+hll_joint_estimate( const hll_joint_histo_t * h, int p, hll_joint_t * out )
+{
+    int    q = HLL_Q( p );
+    double m = (double)HLL_REGISTERS( p );
+    int    ks[ HLL_HISTO_SIZE ];
+    int    nk = 0;
+    int    ha[ HLL_HISTO_SIZE ], hb[ HLL_HISTO_SIZE ], hu[ HLL_HISTO_SIZE ];
+
+    for ( int k = 0; k <= q + 1; k++ )
+    {
+        ha[ k ] = h->a_lt[ k ] + h->a_gt[ k ] + h->eq[ k ];
+        hb[ k ] = h->b_lt[ k ] + h->b_gt[ k ] + h->eq[ k ];
+        hu[ k ] = h->b_gt[ k ] + h->a_gt[ k ] + h->eq[ k ];         // max(K1, K2)
+
+        if ( h->a_lt[ k ] || h->b_gt[ k ] || h->a_gt[ k ] || h->b_lt[ k ] || h->eq[ k ] ) ks[ nk++ ] = k;
+    }
 
-    int bytes = 0;
+    memset( out, 0, sizeof( *out ) );
+    if ( h->eq[ 0 ] == (int)m ) return;                             // 两个都是空的
 
-    if ( NULL != thiz->registers )                          /* 稠密 */
+    double na = (double)hll_histo_estimate( ha, p );
+    double nb = (double)hll_histo_estimate( hb, p );
+    double nu = (double)hll_histo_estimate( hu, p );
+    double nx = na + nb - nu;
+
+    if ( nx > na ) nx = na;
+    if ( nx > nb ) nx = nb;
+
+    double lo = log( HLL_JOINT_LAMBDA_MIN );
+    double theta[ 3 ], grad[ 3 ];
+
+    theta[ 0 ] = log( fmax( na - nx, 1.0 ) / m );
+    theta[ 1 ] = log( fmax( nb - nx, 1.0 ) / m );
+    theta[ 2 ] = log( fmax( nx, 1.0 ) / m );
+
+    double L = hll_joint_loglik( h, ks, nk, q, theta, grad );
+
+    for ( int iter = 0; iter < HLL_JOINT_ITER_MAX; iter++ )
     {
-        if ( thiz->ele_num < HLL_SERIAL_SPARSE_MIN )        /* 经验值 */
+        double H[ 3 ][ 3 ], A[ 3 ][ 3 ];
+        double step = 1e-4, hmax = 0.0;
+
+        for ( int j = 0; j < 3; j++ )
         {
-            bytes = HLL_SERIAL_SPARSE_BYTES;
+            double tp[ 3 ], gp[ 3 ];
+
+            memcpy( tp, theta, sizeof( tp ) );
+            tp[ j ] += step;
+
+            hll_joint_loglik( h, ks, nk, q, tp, gp );
+
+            for ( int i = 0; i < 3; i++ ) H[ i ][ j ] = ( gp[ i ] - grad[ i ] ) / step;
         }
-        else
+
+        for ( int i = 0; i < 3; i++ )
+            for ( int j = 0; j < 3; j++ )
+                if ( fabs( H[ i ][ j ] ) > hmax ) hmax = fabs( H[ i ][ j ] );
+
+        double mu       = 0.0;
+        int    accepted = 0;
+        double s[ 3 ], nt[ 3 ], ng[ 3 ], nL = L, smax = 0.0;
+
+        for ( int tries = 0; tries < 40 && !accepted; tries++ )
         {
-            bytes = HLL_SERIAL_DENSE_BYTES;
+            for ( int i = 0; i < 3; i++ )
+                for ( int j = 0; j < 3; j++ )
+                    A[ i ][ j ] = -0.5 * ( H[ i ][ j ] + H[ j ][ i ] ) + ( i == j ? mu : 0.0 );
+
+            mu = ( 0.0 == mu ) ? 1e-6 * ( hmax + 1.0 ) : mu * 4;
+
+            if ( -1 == hll_joint_solve3( A, grad, s ) ) continue;
+
+            smax = 0.0;
+            for ( int i = 0; i < 3; i++ ) if ( fabs( s[ i ] ) > smax ) smax = fabs( s[ i ] );
+            if ( smax > 4.0 )
+                for ( int i = 0; i < 3; i++ ) s[ i ] *= 4.0 / smax;
+
+            for ( int i = 0; i < 3; i++ ) nt[ i ] = fmax( theta[ i ] + s[ i ], lo );
+
+            nL = hll_joint_loglik( h, ks, nk, q, nt, ng );
+            if ( nL >= L ) accepted = 1;
         }
+
+        if ( !accepted ) break;
+
+        double moved = 0.0;
+        for ( int i = 0; i < 3; i++ ) if ( fabs( nt[ i ] - theta[ i ] ) > moved ) moved = fabs( nt[ i ] - theta[ i ] );
+
+        memcpy( theta, nt, sizeof( theta ) );
+        memcpy( grad, ng, sizeof( grad ) );
+        L = nL;
+
+        if ( moved < 1e-8 ) break;
     }
-    else
+
+    // 到了下限的 就是0
+    out->a_only = ( theta[ 0 ] <= lo ) ? 0.0 : m * exp( theta[ 0 ] );
+    out->b_only = ( theta[ 1 ] <= lo ) ? 0.0 : m * exp( theta[ 1 ] );
+    out->both   = ( theta[ 2 ] <= lo ) ? 0.0 : m * exp( theta[ 2 ] );
+}
+
+
+
+/**
+ * 得到精度 p 下 每个桶一个字节的数组
+ *      本来就是 HLL_DENSE 而且精度相同的 直接返回 registers; 否则合并到一个临时的稠密对象中, 由调用方释放 *tmp
+ */
+static const uint8_t *
+hll_joint_registers( hll_ctx_t * thiz, int p, hll_ctx_t ** tmp )
+{
+    *tmp = NULL;
+
+    if ( HLL_DENSE == thiz->encoding && thiz->precision == p && NULL != thiz->registers )
+        return thiz->registers;
+
+    *tmp = hll_ctx_create_with_precision( HLL_DENSE, thiz->hash_type, p );
+    if ( NULL == *tmp ) return NULL;
+
+    if ( -1 == hll_ctx_merge( *tmp, thiz ) )
     {
-        if ( NULL != thiz->regi_arr )                       /* 稀疏 */
-            bytes = HLL_REGI_MAX_BYTES;
+        hll_ctx_free( *tmp );
+        *tmp = NULL;
+        return NULL;
     }
 
-    bytes += sizeof( uint8_t );
-    bytes += VARINT32_MAX_BYTES;
-    bytes += HLL_MAGIC_BYTES;
+    return (*tmp)->registers;
+}
 
-    return bytes;
+
+
+/** 序列化的数据 展开到精度 p 的临时稠密对象中 */
+static hll_ctx_t *
+hll_joint_unpack( const uint8_t * src, int src_len, uint8_t hash_type, int p )
+{
+    hll_ctx_t * thiz = hll_ctx_create_with_precision( HLL_DENSE, hash_type, p );
+    if ( NULL == thiz ) return NULL;
+
+    if ( -1 == hll_ctx_fast_merge( thiz, src, src_len ) )
+    {
+        hll_ctx_free( thiz );
+        return NULL;
+    }
+
+    return thiz;
 }
 
 
 
-int hll_ctx_serialize( hll_ctx_t * thiz, uint8_t * buf )
+/** 两组精度 p 的桶 做联合估算 */
+static int
+hll_joint_registers_estimate( const uint8_t * r1, const uint8_t * r2, int p, hll_joint_t * out )
 {
-    if ( NULL == thiz || NULL == buf ) return -1;
+    hll_joint_histo_t h;
+    uint16_t          table[ HLL_JOINT_TABLE * HLL_JOINT_LANES ];
 
-    int       write_len = 0;
-    uint8_t * registers = thiz->registers;
+    if ( -1 == hll_joint_histo_build( r1, r2, p, table, &h ) ) return -1;
 
-    buf[ 0 ] = 'H'; buf[ 1 ] = 'L'; buf[ 2 ] = 'L';
-    write_len += HLL_MAGIC_BYTES;
+    hll_joint_estimate( &h, p, out );
+    return 0;
+}
 
-    buf[ write_len ] = thiz->encoding;                          // 输出编码
-    write_len += 1;
 
-    // 写入个数
-    write_len += varint_encode_uint32 ( thiz->ele_num, buf + write_len );
 
-    // 区分不同编码 分别处理
-    if ( HLL_SPARSE == thiz->encoding )
-    {
-        // TODO: 这里有个潜在的改进是把 每个小区域具体有多少个值 先存起来
-        memcpy( buf + write_len, thiz->regi_arr, HLL_REGI_MAX_BYTES );
-        write_len += HLL_REGI_MAX_BYTES;
+int hll_ctx_joint( hll_ctx_t * a, hll_ctx_t * b, hll_joint_t * out )
+{
+    if ( NULL == a || NULL == b || NULL == out ) return -1;
 
-        return write_len;
-    }
+    return hll_ctx_joint_batch( a, &b, 1, out );
+}
 
-    if ( thiz->ele_num < HLL_SERIAL_SPARSE_MIN )
-    {
-        /** 转换成 val:num;val:num;val:num的格式，注意：不是 index:val;index:val的格式 ,
-         *  原因是:
-         *      超过128的index在varint中基本都要2个字节来表示, 如果用index:val的方式，一个pair需要2个字节
-         *      num超过128是很少见的，一般1个字节就够了，用val:num的方式，这样一个pair只需要2个字节
-         */
-        uint8_t  val = registers[ 0 ];
-        int      num = 1;
 
-        for ( int i = 1; i < HLL_REGISTERS; i++ )
-        {
-            uint8_t cur = registers[ i ];
 
-            if ( val == cur )
-            {
-                num++;
-                continue;
-            }
-            else
-            {
-                buf[ write_len ] = val;                 // 输出值
-                write_len += 1;
+int hll_ctx_joint_batch( hll_ctx_t * a, hll_ctx_t ** bs, int n, hll_joint_t * out )
+{
+    if ( NULL == a || NULL == bs || NULL == out || n < 0 ) return -1;
 
-                write_len += varint_encode_uint32( num, buf + write_len );
+    for ( int k = 0; k < n; k++ )
+        if ( NULL == bs[ k ] || bs[ k ]->hash_type != a->hash_type ) return -1;
 
-                val = cur;
-                num = 1;
-            }
-        }
+    // 每一对 折叠到两者中低的精度, 和 hll_ctx_joint 一致; a 在每个用到的精度上 只展开一次
+    const uint8_t * ra[ HLL_PRECISION_MAX + 1 ]    = { NULL };
+    hll_ctx_t     * tmp_a[ HLL_PRECISION_MAX + 1 ] = { NULL };
+    int             ret = 0;
 
-        // 写个末尾的小哨兵。因为64是不可能出现的 val 值
-        buf[ write_len ] = ( 1 << HLL_BITS );
-        write_len += 1;
-    }
-    else
+    for ( int k = 0; k < n && 0 == ret; k++ )
     {
-        /** 从16K->12K 感觉没有大的价值，先不弄了 */
-        memcpy( buf + write_len, thiz->registers, HLL_REGISTERS );
-        write_len += ( HLL_REGISTERS );
+        int p = ( bs[ k ]->precision < a->precision ) ? bs[ k ]->precision : a->precision;
+
+        if ( NULL == ra[ p ] )
+            ra[ p ] = hll_joint_registers( a, p, &tmp_a[ p ] );
+
+        hll_ctx_t     * tmp_b = NULL;
+        const uint8_t * rb    = hll_joint_registers( bs[ k ], p, &tmp_b );
+
+        if ( NULL == ra[ p ] || NULL == rb || -1 == hll_joint_registers_estimate( ra[ p ], rb, p, out + k ) ) ret = -1;
+
+        hll_ctx_free( tmp_b );
     }
 
-    return write_len;
+    for ( int p = HLL_PRECISION_MIN; p <= HLL_PRECISION_MAX; p++ )
+        hll_ctx_free( tmp_a[ p ] );
+
+    return ret;
 }
 
 
 
-int hll_ctx_merge_registers( uint8_t * dst, uint8_t * src )
+int hll_joint_serialized( const uint8_t * a, int a_len, const uint8_t * b, int b_len, hll_joint_t * out )
 {
-    int ele_num0 = 0;
-    int ele_num1 = 0;
-    int ele_num2 = 0;
-    int ele_num3 = 0;
+    if ( NULL == a || NULL == b || NULL == out ) return -1;
+
+    uint8_t  enc_a, enc_b, hash_a, hash_b;
+    int      p_a, p_b;
+    uint32_t num;
+
+    if ( -1 == hll_read_header( a, a_len, &enc_a, &hash_a, &p_a, &num ) ) return -1;
+    if ( -1 == hll_read_header( b, b_len, &enc_b, &hash_b, &p_b, &num ) ) return -1;
+    if ( hash_a != hash_b ) return -1;
+
+    int         p   = ( p_a < p_b ) ? p_a : p_b;
+    int         ret = -1;
+    hll_ctx_t * ca  = hll_joint_unpack( a, a_len, hash_a, p );
+    hll_ctx_t * cb  = hll_joint_unpack( b, b_len, hash_b, p );
+
+    if ( NULL != ca && NULL != cb )
+        ret = hll_joint_registers_estimate( ca->registers, cb->registers, p, out );
+
+    hll_ctx_free( ca );
+    hll_ctx_free( cb );
+    return ret;
+}
+
+
+
+/** 两两估算的任务: 所有输入展开后的桶 按行存放, 块对 (I, J) 按顺序领取 */
+typedef struct hll_joint_job_s
+{
+    const uint8_t * regs;                                           /* n 行, 每行 2^p 个桶 */
+    int             n;
+    int             p;
+    int             nblocks;
+    long            next;                                           /* 下一个块对, 原子递增 */
+    int             failed;
+    hll_joint_t   * out;
+} hll_joint_job_t;
 
-    for ( long i = 0; i < HLL_REGISTERS;  )
+
+
+static void *
+hll_joint_worker( void * arg )
+{
+    hll_joint_job_t * job    = (hll_joint_job_t *)arg;
+    long              m      = HLL_REGISTERS( job->p );
+    long              npairs = (long)job->nblocks * ( job->nblocks + 1 ) / 2;
+    uint16_t        * table  = (uint16_t *)malloc( sizeof(uint16_t) * HLL_JOINT_TABLE * HLL_JOINT_LANES );
+    hll_joint_histo_t h;
+
+    if ( NULL == table )
     {
-        uint8_t max0 = dst[ i ];
-        uint8_t val0 = src[ i ];
+        __atomic_store_n( &job->failed, 1, __ATOMIC_RELAXED );
+        return NULL;
+    }
 
-        if ( val0 > max0 )
-        {
-            dst[ i ] = val0;
-            ele_num0 += 1;
-        }
+    for ( ;; )
+    {
+        long t = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED );
+        if ( t >= npairs ) break;
 
-        uint8_t max1 = dst[ i + 1 ];
-        uint8_t val1 = src[ i + 1 ];
+        // 第 t 个块对 (I, J), I <= J, 两块一共 2*HLL_JOINT_BLOCK 行 可以留在 L2 中
+        int I = 0;
+        while ( t >= job->nblocks - I ) { t -= job->nblocks - I; I++; }
+        int J = I + (int)t;
 
-        if ( val1 > max1 )
+        for ( int i = I * HLL_JOINT_BLOCK; i < ( I + 1 ) * HLL_JOINT_BLOCK && i < job->n; i++ )
         {
-            dst[ i + 1 ] = val1;
-            ele_num1 += 1;
-        }
+            int j0 = ( I == J ) ? i + 1 : J * HLL_JOINT_BLOCK;
 
-        uint8_t max2 = dst[ i + 2 ];
-        uint8_t val2 = src[ i + 2 ];
+            for ( int j = j0; j < ( J + 1 ) * HLL_JOINT_BLOCK && j < job->n; j++ )
+            {
+                hll_joint_t * o = job->out + (long)i * job->n + j;
 
-        if ( val2 > max2 )
-        {
-            dst[ i + 2 ] = val2;
-            ele_num2 += 1;
-        }
+                if ( -1 == hll_joint_histo_build( job->regs + i * m, job->regs + j * m, job->p, table, &h ) )
+                {
+                    __atomic_store_n( &job->failed, 1, __ATOMIC_RELAXED );
+                    continue;
+                }
 
-        uint8_t max3 = dst[ i + 3 ];
-        uint8_t val3 = src[ i + 3 ];
+                hll_joint_estimate( &h, job->p, o );
 
-        if ( val3 > max3 )
-        {
-            dst[ i + 3 ] = val3;
-            ele_num3 += 1;
+                hll_joint_t * r = job->out + (long)j * job->n + i;  // 对称的位置 A/B 互换
+                r->a_only = o->b_only;
+                r->b_only = o->a_only;
+                r->both   = o->both;
+            }
         }
-
-        i += 4;
     }
 
-    return ele_num0 + ele_num1 + ele_num2 + ele_num3;
+    free( table );
+    return NULL;
 }
 
 
 
-hll_ctx_t * hll_ctx_unSerialize( const uint8_t * src, int src_len, int * read_bytes )
+int hll_joint_all_pairs( const uint8_t ** blobs, const int * lens, int n, int nthreads, hll_joint_t * out )
 {
-    if ( NULL == src ) return NULL;
+    if ( NULL == blobs || NULL == lens || NULL == out || n < 0 ) return -1;
+    if ( 0 == n ) return 0;
 
-    int read_len = 0;
+    uint8_t  encoding, hash_type = 0, first_hash = 0;
+    int      p, min_p = HLL_PRECISION_MAX;
+    uint32_t ele_num;
 
-    // 校验：HLL_MAGIC  "HLL"
-    if ( src[0] != 'H' || src[1] != 'L' || src[2] != 'L' ) return NULL;
-    read_len += HLL_MAGIC_BYTES;
+    for ( int k = 0; k < n; k++ )
+    {
+        if ( NULL == blobs[ k ] ) return -1;
+        if ( -1 == hll_read_header( blobs[ k ], lens[ k ], &encoding, &hash_type, &p, &ele_num ) ) return -1;
 
-    uint8_t encoding = src[ read_len ];                             // 读取编码方式
-    read_len += 1;
+        if ( 0 == k ) first_hash = hash_type;
+        if ( hash_type != first_hash ) return -1;
+        if ( p < min_p ) min_p = p;
+    }
 
-    hll_ctx_t * thiz = hll_ctx_create( encoding );                  // 重要:根据编码创建对象
-    if ( NULL == thiz ) return NULL;
+    long             m    = HLL_REGISTERS( min_p );
+    int              ret  = -1;
+    uint8_t        * regs = (uint8_t *)malloc( (size_t)n * m );
+    pthread_t      * tids = NULL;
+    hll_joint_job_t  job;
 
-    read_len += varint_decode_uint32( src + read_len, (uint32_t *)&(thiz->ele_num) );
+    memset( &job, 0, sizeof( job ) );
+    if ( NULL == regs ) return -1;
 
-    if ( HLL_SPARSE == encoding )                                   // 稀疏编码方式
+    // 先全部展开到同一个精度, 每个对象一行
+    for ( int k = 0; k < n; k++ )
     {
-        if ( src_len < ( read_len + HLL_REGI_MAX_BYTES ) )          // 避免读越界
-            goto failed;
+        hll_ctx_t * c = hll_joint_unpack( blobs[ k ], lens[ k ], first_hash, min_p );
+        if ( NULL == c ) goto done;
 
-        memcpy( thiz->regi_arr, src + read_len, HLL_REGI_MAX_BYTES );
-        read_len += HLL_REGI_MAX_BYTES;
+        memcpy( regs + k * m, c->registers, m );
 
-        goto success;
+        out[ (long)k * n + k ].a_only = 0.0;
+        out[ (long)k * n + k ].b_only = 0.0;
+        out[ (long)k * n + k ].both   = (double)hll_ctx_count( c );
+
+        hll_ctx_free( c );
     }
 
-    // 稠密编码方式
-    uint8_t * registers = thiz->registers;
+    job.regs    = regs;
+    job.n       = n;
+    job.p       = min_p;
+    job.nblocks = ( n + HLL_JOINT_BLOCK - 1 ) / HLL_JOINT_BLOCK;
+    job.out     = out;
 
-    if ( thiz->ele_num < HLL_SERIAL_SPARSE_MIN )
-    {
-        uint8_t  val       = 0;                                         // 实际的值
-        uint32_t num       = 0;                                         // 重复的次数
-        int      write_idx = 0;
+    if ( nthreads < 1 ) nthreads = 1;
+    if ( nthreads > job.nblocks * ( job.nblocks + 1 ) / 2 ) nthreads = job.nblocks * ( job.nblocks + 1 ) / 2;
 
-        while ( (val = src[ read_len ++ ]) != ( 1 << HLL_BITS ) )       // 一直循环到哨兵
-        {
-            read_len += varint_decode_uint32( src + read_len, &num );
+    tids = (pthread_t *)calloc( nthreads, sizeof(pthread_t) );
+    if ( NULL == tids ) goto done;
 
-            for ( uint32_t i = 0; i < num; i++ )
-            {
-                if ( write_idx < HLL_REGISTERS )
-                    registers[ write_idx ] = val;                       // 写边界保护
+    {
+        int started = 0;
 
-                write_idx++;
-            }
+        // 第 0 个在当前线程执行, 创建失败的 由其余线程分担
+        for ( int t = 1; t < nthreads; t++ )
+            if ( 0 == pthread_create( &tids[ started ], NULL, hll_joint_worker, &job ) ) started++;
 
-            if ( read_len >= src_len ) break;                           // 读边界保护
-        }
-    }
-    else
-    {
-        if ( src_len < ( read_len + HLL_REGISTERS ) )                   // 读边界保护
-            goto failed;
+        hll_joint_worker( &job );
 
-        memcpy( thiz->registers, src + read_len, HLL_REGISTERS );
-        read_len += HLL_REGISTERS;
+        for ( int t = 0; t < started; t++ ) pthread_join( tids[ t ], NULL );
     }
 
-success:
-    *read_bytes = read_len;
-    return thiz;
+    ret = job.failed ? -1 : 0;
 
-failed:
-    hll_ctx_free( thiz );
-    return NULL;
+done:
+    free( tids );
+    free( regs );
+    return ret;
 }
 
 
 
-int hll_ctx_merge( hll_ctx_t * thiz, hll_ctx_t * for_merge )
+int64_t hll_ctx_intersect_count( hll_ctx_t * a, hll_ctx_t * b )
 {
-    if ( NULL == thiz )      return -1;
-    if ( NULL == for_merge ) return -1;
+    hll_joint_t j;
 
-    if ( -1 == hll_ctx_sparse_to_dense( thiz ) )            // 转成稠密编码
-        return -1;
+    if ( -1 == hll_ctx_joint( a, b, &j ) ) return -1;
 
-    uint8_t encoding = for_merge->encoding;
-    int     ele_num  = 0;
+    return (int64_t)llround( j.both );
+}
 
-    if ( HLL_DENSE == encoding )
-    {
-        ele_num = hll_ctx_merge_registers( thiz->registers, for_merge->registers );
-        thiz->ele_num += ele_num;
 
-        return 0;
-    }
 
-    if ( HLL_SPARSE != encoding )  return -1;
+int64_t hll_ctx_diff_count( hll_ctx_t * a, hll_ctx_t * b )
+{
+    hll_joint_t j;
 
-    ele_num = hll_ctx_regi_arr_to_registers( thiz->registers, for_merge->regi_arr );
-    thiz->ele_num += ele_num;
+    if ( -1 == hll_ctx_joint( a, b, &j ) ) return -1;
 
-    return 0;
+    return (int64_t)llround( j.a_only );
 }
 
 
 
-int hll_ctx_fast_merge( hll_ctx_t * thiz, const uint8_t * src, int src_len )
+double hll_ctx_jaccard( hll_ctx_t * a, hll_ctx_t * b )
 {
-    if ( NULL == thiz || NULL == src ) return -1;
+    hll_joint_t j;
 
-    int read_len = 0;
-    int ele_num  = 0;
+    if ( -1 == hll_ctx_joint( a, b, &j ) ) return -1.0;
 
-    // 校验：HLL_MAGIC  "HLL"
-    if ( src[0] != 'H' || src[1] != 'L' || src[2] != 'L' ) return -1;
-    read_len += HLL_MAGIC_BYTES;
+    double u = j.a_only + j.b_only + j.both;
 
-    if ( -1 == hll_ctx_sparse_to_dense( thiz ) )                    // 转成稠密编码
-        return -1;
+    return ( u > 0.0 ) ? j.both / u : 0.0;
+}
 
-    uint8_t * registers = thiz->registers;
-    uint8_t   encoding  = src[ read_len ];                          // 读取编码方式
-    read_len += 1;
 
-    read_len += varint_decode_uint32( src + read_len, (uint32_t *)&(ele_num) );
 
-    if ( HLL_SPARSE == encoding )                                   // 稀疏编码方式
-    {
-        if ( src_len < ( read_len + HLL_REGI_MAX_BYTES ) )          // 避免读越界
-            goto failed;
+hll_pool_t * hll_pool_create( unsigned char hash_type, int precision )
+{
+    if ( -1 == hll_ctx_check_args( HLL_DENSE, hash_type, precision ) ) return NULL;
 
-        hll_regi_t * regi_arr = (hll_regi_t *)( src + read_len );   // 强行转换
+    hll_pool_t * pool = (hll_pool_t *)calloc( 1, sizeof(hll_pool_t) );
+    if ( NULL == pool ) return NULL;
 
-        ele_num = hll_ctx_regi_arr_to_registers( thiz->registers, regi_arr );
-        read_len += HLL_REGI_MAX_BYTES;
+    pool->hash_type = hash_type;
+    pool->precision = precision;
 
-        goto success;
-    }
+    hll_slab_init( &pool->ctx,      sizeof( hll_ctx_t ) );
+    hll_slab_init( &pool->regi_arr, HLL_REGI_MAX_BYTES );
+    hll_slab_init( &pool->dense,    HLL_DENSE_BYTES( HLL_DENSE, precision ) );
+    hll_slab_init( &pool->packed,   HLL_DENSE_BYTES( HLL_DENSE_PACKED, precision ) );
+    hll_slab_init( &pool->histo,    sizeof(int) * HLL_HISTO_SIZE );
 
-    // 稠密编码方式
-    if ( ele_num < HLL_SERIAL_SPARSE_MIN )
-    {
-        uint8_t  val       = 0;                                         // 实际的值
-        uint32_t num       = 0;                                         // 重复的次数
-        int      write_idx = 0;
-                 ele_num   = 0;
+    return pool;
+}
 
-        while ( (val = src[ read_len ++ ]) != ( 1 << HLL_BITS ) )       // 一直循环到哨兵
-        {
-            read_len += varint_decode_uint32( src + read_len, &num );
 
-            for ( uint32_t i = 0; i < num; i++ )
-            {
-                if ( write_idx < HLL_REGISTERS && registers[ write_idx ] < val )
-                {
-                    registers[ write_idx ] = val;                       // 写边界保护
-                    ele_num++;
-                }
 
-                write_idx++;
-            }
+hll_ctx_t * hll_pool_ctx_create( hll_pool_t * pool, unsigned char encoding )
+{
+    if ( NULL == pool ) return NULL;
 
-            if ( read_len >= src_len ) break;                           // 读边界保护
-        }
-    }
-    else
-    {
-        if ( src_len < ( read_len + HLL_REGISTERS ) )                   // 读边界保护
-            goto failed;
+    int enc = hll_ctx_check_args( encoding, pool->hash_type, pool->precision );
+    if ( -1 == enc || HLL_SPARSE_LIST == enc ) return NULL;      // 稀疏列表的大小不固定，不从池中分配
+
+    hll_ctx_t * thiz = (hll_ctx_t *)hll_slab_alloc( &pool->ctx );
+    if ( NULL == thiz ) return NULL;
 
-        uint8_t * src_registers = (uint8_t *)(src + read_len );
+    thiz->mem_type = HLL_MEM_POOL;
+    thiz->pool     = pool;
 
-        ele_num = hll_ctx_merge_registers( registers, src_registers );
-        read_len += HLL_REGISTERS;
+    if ( -1 == hll_ctx_init( thiz, enc, pool->hash_type, pool->precision ) )
+    {
+        hll_slab_release( &pool->ctx, thiz );
+        return NULL;
     }
 
-success:
-    thiz->ele_num += ele_num;
-    return read_len;
+    return thiz;
+}
 
-failed:
-    return -1;
+
+
+void hll_pool_reset( hll_pool_t * pool )
+{
+    if ( NULL == pool ) return;
+
+    hll_slab_reset( &pool->ctx );
+    hll_slab_reset( &pool->regi_arr );
+    hll_slab_reset( &pool->dense );
+    hll_slab_reset( &pool->packed );
+    hll_slab_reset( &pool->histo );
+}
+
+
+
+void hll_pool_free( hll_pool_t * pool )
+{
+    if ( NULL == pool ) return;
+
+    hll_slab_destroy( &pool->ctx );
+    hll_slab_destroy( &pool->regi_arr );
+    hll_slab_destroy( &pool->dense );
+    hll_slab_destroy( &pool->packed );
+    hll_slab_destroy( &pool->histo );
+
+    free( pool );
 }
@@ -6,10 +6,28 @@ extern "C" {
 #endif
 
 typedef struct hll_ctx_s hll_ctx_t;
+typedef struct hll_pool_s hll_pool_t;
 
 
 #define HLL_DENSE     0       /* 稠密编码方式，占用 16K 内存 */
 #define HLL_SPARSE    1       /* 稀疏编码方式, 创建时用 1.5K 内存，在元素不断加入后，自行决定何时转换为稠密编码方式 */
+#define HLL_DENSE_PACKED  2   /* 紧凑的稠密编码方式，每个桶6bit，占用 12K 内存 */
+#define HLL_SPARSE_LIST   3   /* HLL++风格的稀疏编码, 有序压缩的列表, 按需翻倍增长, 超过稠密编码的大小时才转换为稠密编码
+                                 元素较少时 误差比 HLL_SPARSE 小很多 */
+
+
+#define HLL_HASH_MURMUR64A  0   /* 默认的hash函数 */
+#define HLL_HASH_WYHASH     1   /* wyhash风格的hash, 短key更快 */
+
+
+#define HLL_FORMAT_DEFAULT  0   /* hll_ctx_serialize 的格式，老版本也能读 */
+#define HLL_FORMAT_BLOCK    1   /* 稠密编码按 64 个桶分块, 每块选 全相同/基准值+位宽打包/只列非0 中最小的, 各种填充率都比较小
+                                   需要新版本才能读 */
+
+
+#define HLL_PRECISION_MIN       4    /* 精度 p 的范围, 桶的个数是 2^p */
+#define HLL_PRECISION_MAX       16
+#define HLL_PRECISION_DEFAULT   14   /* 16384 个桶, 标准误差约 0.81% */
 
 
 /**
@@ -21,21 +39,180 @@ typedef struct hll_ctx_s hll_ctx_t;
  */
 hll_ctx_t * hll_ctx_create( unsigned char encoding );
 
+/**
+ * 创建，并指定hash函数, hll_ctx_create 使用的是 HLL_HASH_MURMUR64A
+ *      hash函数会记录在序列化的数据中，hash函数不同的 不能合并
+ *
+ *      返回 NULL:表示失败
+ */
+hll_ctx_t * hll_ctx_create_with_hash( unsigned char encoding, unsigned char hash_type );
+
+/**
+ * 创建，并指定hash函数和精度 p, 范围 [HLL_PRECISION_MIN, HLL_PRECISION_MAX]
+ *      桶的个数是 2^p, 稠密编码占用 2^p 字节(HLL_DENSE_PACKED 是 2^p*3/4), 标准误差约 1.04/sqrt(2^p)
+ *      精度很低 稠密编码比稀疏编码还小时, HLL_SPARSE 会直接使用稠密编码
+ *
+ *      精度高的 可以合并到精度低的中(会折叠成低精度), 反过来不行
+ *
+ *      返回 NULL:表示失败
+ */
+hll_ctx_t * hll_ctx_create_with_precision( unsigned char encoding, unsigned char hash_type, int precision );
+
+/**
+ * 创建一个可以多线程并发写入的对象，固定使用 HLL_DENSE 编码, 2^p 字节
+ *      桶按 64 位的字 用 CAS 取 max，不加锁; ele_num 是 relaxed 的原子计数
+ *      hll_ctx_add / hll_ctx_add_hash / 各种批量添加 / hll_ctx_count 可以多线程同时调用，
+ *      count 读到的是某一时刻附近的快照，不缓存结果;
+ *      其余的操作(合并到它, 序列化, 重置, 释放 等) 需要先停止写入
+ *
+ *      返回 NULL:表示失败
+ */
+hll_ctx_t * hll_ctx_create_concurrent( unsigned char hash_type, int precision );
+
+/**
+ * 在调用方提供的内存上 初始化一个对象，不再申请任何内存(开启直方图 也不会)
+ *      mem 需要 8 字节对齐, 长度至少是 hll_ctx_inplace_bytes 的返回值
+ *      HLL_SPARSE 会同时预留稠密编码的空间, 转成稠密时 不需要申请内存; 不支持 HLL_SPARSE_LIST
+ *      已经是稠密的 不能再用 hll_ctx_set_dense_encoding 切换布局
+ *
+ *      不用时 调用 hll_ctx_free 或者直接释放 mem 都可以
+ *      返回 NULL:表示失败
+ */
+hll_ctx_t * hll_ctx_init_inplace( void * mem, int mem_len, unsigned char encoding, unsigned char hash_type, int precision );
+
+/**
+ * 重新使用 一块已经用 hll_ctx_init_inplace 初始化过的内存，例如 mmap 重新打开的文件 或者 拷贝到别处的内存
+ *      内容保持不变，只按现在的地址 修正内部的指针，每次地址可能变化时 都需要调用
+ *      指针已经和现在的地址一致时 不会写 mem，只读的访问 不会弄脏 mmap 的页
+ *      要求 和初始化时 是同一个编译版本(结构体的布局一致)
+ *
+ *      返回 NULL:表示失败
+ */
+hll_ctx_t * hll_ctx_attach_inplace( void * mem, int mem_len );
+
+/** hll_ctx_init_inplace 需要的内存大小，返回 -1: 表示不支持 */
+int hll_ctx_inplace_bytes( unsigned char encoding, int precision );
+
+/**
+ * 对象池：大量生命周期很短的对象，每种大小的内存 从各自的 slab 中分配，释放后放回空闲链表复用
+ *      池中的对象 使用同样的 hash函数和精度，不支持 HLL_SPARSE_LIST
+ *      池不是线程安全的，需要每个线程一个池 或者由调用方加锁
+ *
+ *      返回 NULL:表示失败
+ */
+hll_pool_t * hll_pool_create( unsigned char hash_type, int precision );
+
+/**
+ * 从池中创建一个对象，用法和 hll_ctx_create 一样, 用 hll_ctx_free 释放(放回池中)
+ *      返回 NULL:表示失败
+ */
+hll_ctx_t * hll_pool_ctx_create( hll_pool_t * pool, unsigned char encoding );
+
+/** 一次性回收池中所有的对象，之前创建的对象都不能再使用，内存留在池中 给后面的对象复用 */
+void hll_pool_reset( hll_pool_t * pool );
+
+/** 释放池 和池中所有的对象 */
+void hll_pool_free( hll_pool_t * pool );
+
+/** 获得精度 p */
+int hll_ctx_precision( hll_ctx_t * thiz );
+
+/** 获得当前的编码, 稀疏编码的 转成稠密以后 返回 HLL_DENSE / HLL_DENSE_PACKED */
+int hll_ctx_encoding( hll_ctx_t * thiz );
+
 /** 释放 */
 void  hll_ctx_free( hll_ctx_t * thiz );
 
 /** 重置 */
 void  hll_ctx_reset( hll_ctx_t * thiz );
 
-/** 获得基数统计的值 */
+/**
+ * 设置稠密编码的布局：HLL_DENSE(16K) 或 HLL_DENSE_PACKED(12K)
+ *      已经是稠密的，立即转换; 稀疏的，在以后转换成稠密时 使用这个布局
+ *
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_ctx_set_dense_encoding( hll_ctx_t * thiz, unsigned char dense_encoding );
+
+/**
+ * 设置 HLL_SPARSE_LIST 的稀疏精度 p', 范围 [p, 25], 默认 25
+ *      p' 越大 元素少时误差越小, 每条记录也越大. 只能在加入元素之前设置
+ *
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_ctx_set_sparse_precision( hll_ctx_t * thiz, int sparse_p );
+
+/**
+ * 获得基数统计的值
+ *      结果会被缓存，两次调用之间没有修改过的 直接返回上次的结果
+ */
 uint64_t hll_ctx_count( hll_ctx_t * thiz );
 
+/**
+ * 开启/关闭 直方图的增量维护
+ *      开启后 每次添加/合并 都会同步更新每个桶值的个数, hll_ctx_count 只需要处理 52 个直方图的值，
+ *      不用再扫描所有的桶. 适合 读多写少 的场景，会多占用 208 字节
+ *
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_ctx_enable_histo( hll_ctx_t * thiz, int enable );
+
+/**
+ * 开启/关闭 增量序列化
+ *      开启后 每 8 个桶一个脏标记, 记录上次 hll_ctx_serialize_delta 之后被改过的块(p=14 时 256 字节)
+ *      开启时所有块都是脏的，第一次的增量 就是完整的数据
+ *      只支持 hll_ctx_create* 创建的 非并发的对象. hll_ctx_reset 后 接收方需要重新全量同步
+ *
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_ctx_enable_delta( hll_ctx_t * thiz, int enable );
+
 /**
  * 添加一个新的值
  *      返回值：-1：表示失败 0:表示成功
  */
 int hll_ctx_add( hll_ctx_t * thiz, const unsigned char * ele, int ele_len );
 
+/**
+ * 批量添加，效果等同于循环调用 hll_ctx_add，但多个hash交错计算，并一次性写入桶
+ *      eles/lens: n 个元素的指针和长度
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_ctx_add_batch( hll_ctx_t * thiz, const uint8_t ** eles, const int * lens, int n );
+
+/**
+ * 批量添加定长的key，keys 是 n 个连续存放的key
+ *      key_len: 只支持 8 和 16 字节
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_ctx_add_fixed( hll_ctx_t * thiz, const uint8_t * keys, int key_len, int n );
+
+/**
+ * 添加一个已经算好的64位hash值，跳过内部的hash计算
+ *      hash值需要是分布均匀的，建议和创建时指定的hash函数一致
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_ctx_add_hash( hll_ctx_t * thiz, uint64_t hash );
+
+/**
+ * 批量添加已经算好的hash值
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_ctx_add_hash_batch( hll_ctx_t * thiz, const uint64_t * hashes, int n );
+
+/**
+ * 按 hash函数 计算一个元素的hash值，和 hll_ctx_add 内部使用的一样
+ *      配合 hll_ctx_add_hash 使用，例如 先算好hash 再决定加到哪个对象中
+ */
+uint64_t hll_ele_hash( unsigned char hash_type, const unsigned char * ele, int ele_len );
+
+/**
+ * 由桶值的直方图 估算基数, 和 hll_ctx_count 使用同一个估算方法
+ *      reghisto[i] 是值为 i 的桶的个数, 长度至少是 64 - precision + 2
+ *      用于自己维护桶值的结构, 例如 hll_window
+ */
+uint64_t hll_histo_count( const int * reghisto, int precision );
+
 /** 获得序列化后的字节最大长度，用于提前准备内存 */
 int hll_ctx_serial_maxBytes( hll_ctx_t * thiz );
 
@@ -45,6 +222,36 @@ int hll_ctx_serial_maxBytes( hll_ctx_t * thiz );
  */
 int hll_ctx_serialize( hll_ctx_t * thiz, uint8_t * buf );
 
+/** 获得增量序列化的字节最大长度，没有开启增量时 返回 -1 */
+int hll_ctx_delta_maxBytes( hll_ctx_t * thiz );
+
+/**
+ * 增量序列化: 只输出上次调用之后 被改过的块 (连续的块合成一段, 每段是 间隔+块数+桶值), 然后清空脏标记
+ *      稀疏编码的 数据本身就很小, 输出的是完整的序列化数据
+ *      结果可以用 hll_ctx_apply_delta / hll_ctx_fast_merge 合并, 用 hll_ctx_unSerialize 展开成一个稠密的对象
+ *      内部不会检查buf的可写部分，请调用 hll_ctx_delta_maxBytes 进行保障
+ *
+ *      返回值：-1:表示失败  >=0:表示实际输出的字节数
+ */
+int hll_ctx_serialize_delta( hll_ctx_t * thiz, uint8_t * buf );
+
+/**
+ * 合并一份增量, 和 hll_ctx_fast_merge 一样, 也接受完整的序列化数据
+ *      桶只取 max, 增量按任意顺序到达 或者重复到达 结果都一样
+ *      返回值：-1：表示失败  >=0:实际使用的字节数
+ */
+int hll_ctx_apply_delta( hll_ctx_t * thiz, const uint8_t * src, int src_len );
+
+/**
+ * 按指定的格式序列化, HLL_FORMAT_DEFAULT 同 hll_ctx_serialize
+ *      HLL_FORMAT_BLOCK 只对稠密编码生效, 稀疏编码的 仍然输出默认格式;
+ *      反序列化/合并/计数 都按块解码到L1中, 用 SIMD 解包 再一次合并一整块
+ *      内部不会检查buf的可写部分，请调用 hll_ctx_serial_maxBytes 进行保障
+ *
+ *      返回值：-1:表示失败  >=0:表示实际输出的字节数
+ */
+int hll_ctx_serialize_format( hll_ctx_t * thiz, uint8_t * buf, int format );
+
 /**
  * 反序列化
  *     read_bytes: 将会返回反序列化 实际使用的字节数，辅助外部程序做后续动作
@@ -53,19 +260,102 @@ int hll_ctx_serialize( hll_ctx_t * thiz, uint8_t * buf );
  */
 hll_ctx_t * hll_ctx_unSerialize( const uint8_t * src, int src_len, int * read_bytes );
 
+/**
+ * 直接从序列化的数据 估算基数，不创建对象 也不展开成桶，结果和 反序列化后 hll_ctx_count 的一样
+ *      适合只读一次就丢弃的场合
+ *
+ *      返回值：-1：表示失败 >=0:基数统计的值
+ */
+int64_t hll_count_serialized( const uint8_t * src, int src_len );
+
+/**
+ * 多个序列化数据的并集的基数，结果和 都 hll_ctx_fast_merge 到一个对象中 再 hll_ctx_count 的一样
+ *      不需要创建对象; 按块处理，每一块 所有输入的桶 在L1中取max
+ *      hash函数需要一致，精度不同的 折叠到最低的精度上
+ *
+ *      返回值：-1：表示失败 >=0:基数统计的值
+ */
+int64_t hll_union_count( const uint8_t ** blobs, const int * lens, int n );
+
+/**
+ * 同 hll_union_count，桶按块分给 nthreads 个线程并行处理，输入很多时使用
+ *      返回值：-1：表示失败 >=0:基数统计的值
+ */
+int64_t hll_union_count_parallel( const uint8_t ** blobs, const int * lens, int n, int nthreads );
+
 /**
  * 合并
+ *      for_merge 的精度比 thiz 高时，折叠到 thiz 的精度上; 比 thiz 低的 不能合并
+ *      thiz 和 for_merge 都是稀疏编码的，逐个写入 thiz 保持稀疏, 放不下时才转成稠密
  *      返回值：-1：表示失败 0:表示成功
  */
 int hll_ctx_merge( hll_ctx_t * thiz, hll_ctx_t * for_merge );
 
 /**
- * 快速合并，不经过反序列化 直接合并
+ * 多路合并，把 n 个对象一次性合并到 thiz 中
+ *      按块遍历 thiz 的桶，每一块只读写一次，比循环调用 hll_ctx_merge 访存少很多
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_ctx_merge_many( hll_ctx_t * thiz, hll_ctx_t ** for_merges, int n );
+
+/**
+ * 快速合并，不经过反序列化 直接合并, 精度的要求和 hll_ctx_merge 一样
+ *      稀疏+稀疏 的 和 hll_ctx_merge 一样 保持稀疏
  *      返回值：-1：表示失败  >=0:实际使用的字节数
  */
 int hll_ctx_fast_merge( hll_ctx_t * thiz, const uint8_t * src, int src_len );
 
 
+/**
+ * 两个集合 A, B 的 差集和交集 的估算值
+ *      用两边的桶一起做最大似然估计(每个桶看成 只在A/只在B/两边都有 三个泊松过程的最大值),
+ *      不是 |A|+|B|-|A∪B| 的容斥, 交集相对并集很小时 误差也小得多
+ */
+typedef struct hll_joint_s
+{
+    double      a_only;                                         /* |A - B| */
+    double      b_only;                                         /* |B - A| */
+    double      both;                                           /* |A ∩ B| */
+} hll_joint_t;
+
+/**
+ * 两个对象的联合估算, 任意编码都可以, hash函数需要一致, 精度不同的 折叠到低的精度上
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_ctx_joint( hll_ctx_t * a, hll_ctx_t * b, hll_joint_t * out );
+
+/**
+ * 同 hll_ctx_joint, 直接使用序列化的数据, 不需要先反序列化
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_joint_serialized( const uint8_t * a, int a_len, const uint8_t * b, int b_len, hll_joint_t * out );
+
+/**
+ * a 和 n 个对象 分别做联合估算, out[i] 对应 bs[i], 结果和逐个调用 hll_ctx_joint 相同
+ *      每一对 折叠到两者中低的精度, a 的桶 在每个用到的精度上 只展开一次
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_ctx_joint_batch( hll_ctx_t * a, hll_ctx_t ** bs, int n, hll_joint_t * out );
+
+/**
+ * n 份序列化数据 两两做联合估算, 结果是 n*n 的矩阵, out[i*n+j] 中 A 是第 i 个, B 是第 j 个
+ *      对角线上 只有 both, 是各自的基数
+ *      所有输入先展开到 其中最低的精度, 再按块 由 nthreads 个线程处理, 每一块的桶都在缓存中
+ *
+ *      返回值：-1：表示失败 0:表示成功
+ */
+int hll_joint_all_pairs( const uint8_t ** blobs, const int * lens, int n, int nthreads, hll_joint_t * out );
+
+/** |A ∩ B| 的估算值, 返回 -1 表示失败 */
+int64_t hll_ctx_intersect_count( hll_ctx_t * a, hll_ctx_t * b );
+
+/** |A - B| 的估算值, 返回 -1 表示失败 */
+int64_t hll_ctx_diff_count( hll_ctx_t * a, hll_ctx_t * b );
+
+/** Jaccard 相似度 |A ∩ B| / |A ∪ B|, 两个都是空的 返回 0, 返回 -1 表示失败 */
+double hll_ctx_jaccard( hll_ctx_t * a, hll_ctx_t * b );
+
+
 #ifdef __cplusplus
 }
 #endif